@@ -0,0 +1,1195 @@
+/*********************************************************************************
+ *
+ *  sim.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Host simulation and benchmark harness for the firefly engine.
+ *
+ *       fireflies.c and envelope.c are compiled natively against stubs of the
+ *       system and LED interfaces. The engine is run for a number of simulated
+ *       hours as fast as the host allows, timing every periodic callback. The
+ *       selected envelope engine is then checked against the reference
+ *       integration, and its traces are optionally written out as CSV. The
+ *       LED current of every frame is checked against FIREFLY_CURRENT_BUDGET.
+ *
+ *       A run can be recorded to a replay log, and a log, recorded here or
+ *       dumped from g_replay_log on a jar built with REPLAY_RECORD, replayed
+ *       in place of a free run. A replay built as the recording was checks
+ *       its LED writes against the recorded hash. Every LED frame can also
+ *       be written to a golden frame file, or compared against one. The
+ *       engines quantize smoothing differently, so frames are only
+ *       comparable between builds of the same engine: `make golden` pins
+ *       the frames of every engine as built from a known good commit, the
+ *       last one by default, then holds the working tree to them, as well as
+ *       every engine to the reference integration.
+ *
+ *       A free run can also move on to the next pattern set every few
+ *       simulated minutes, as a double tap does. The comparison against the
+ *       reference always covers the patterns of the boot set.
+ *
+ *       The exit status is 1 if the engine strays from the reference, or
+ *       the frames from the golden ones, by more than the tolerance, or
+ *       if a plain replay does not reproduce its recorded hash. With -w
+ *       or -c the hash is only reported, as only a build of the recording
+ *       engine can reproduce it, and the golden frames stand in for it.
+ *
+ *       Usage: firefly_sim [-r log] [-p log] [-w frames] [-c frames]
+ *                          [-t tolerance] [-s minutes] [hours] [trace.csv]
+ *
+ *           -r  record the run to a replay log
+ *           -p  replay a log instead of running for hours
+ *           -w  write every LED frame to a golden frame file
+ *           -c  compare every LED frame against a golden frame file
+ *           -t  largest brightness error accepted, SIM_TOLERANCE by default
+ *           -s  move on to the next pattern set every so many minutes
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "system.h"
+#include "leds.h"
+#include "envelope.h"
+#include "fireflies.h"
+#include "link.h"
+#include "random.h"
+#include "replay.h"
+
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define SIM_TICKS_PER_HOUR      ( 60 * 60 * SYSTICK_HZ )
+#define SIM_SEED                ( 1 )
+#define SIM_STEP                ( 8 )       /* Matches FIREFLY_TIMESTEP         */
+#define SIM_TRACE_SMOOTHING_STEP ( 150 )
+#define SIM_TOLERANCE           ( 16 )      /* Of LED_BRIGHTNESS_MAX            */
+#define SIM_NS_BIN              ( 10 )      /* Call time histogram bin (ns)     */
+#define SIM_NS_BINS             ( 1000 )    /* Last bin holds longer calls      */
+#define SIM_NS_TAIL             ( 1000 )    /* Worst calls reported, 1 in       */
+
+#if( !REPLAY_RECORD )
+#error "The harness records every run, build with REPLAY_RECORD=1"
+#endif
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_LUT )
+#define SIM_ENGINE_NAME         "lut"
+#elif( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+#define SIM_ENGINE_NAME         "integral"
+#elif( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+#define SIM_ENGINE_NAME         "fir"
+#else
+#define SIM_ENGINE_NAME         "reference"
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                       TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Stubbed system task
+------------------------------------------------------------*/
+typedef struct
+{
+    task_ptr_type   task;
+    uint32_t        period;
+    uint32_t        due;
+    uint64_t        calls;
+    uint64_t        ns;
+    uint32_t        ns_hist[ SIM_NS_BINS ];
+}sim_task_type;
+
+/*------------------------------------------------------------
+Envelope comparison results for one species
+------------------------------------------------------------*/
+typedef struct
+{
+    int32_t         err_visited;    /* Max error at stepped times   */
+    int32_t         err_any;        /* Max error at any ms          */
+    uint64_t        samples;
+}sim_compare_type;
+
+/*------------------------------------------------------------
+Golden frame, the LEDs as committed by one update
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        tick;
+    uint16_t        brightness[ LED_COUNT ];
+}sim_frame_type;
+
+/*------------------------------------------------------------
+Golden frame comparison results
+------------------------------------------------------------*/
+typedef struct
+{
+    uint64_t        frames;         /* Frames compared              */
+    uint64_t        fails;          /* Frames past the tolerance    */
+    uint32_t        err_max;        /* Largest LED error            */
+    boolean         diverged;       /* Frame ticks stopped matching */
+}sim_golden_type;
+
+
+/*--------------------------------------------------------------------------------
+                                    MEMORY CONSTANTS
+--------------------------------------------------------------------------------*/
+
+static const char * const species_names[ FLASH_COUNT ] =
+{
+    "pallens",
+    "lewisi",
+    "amplus",
+    "xanthophotis",
+    "jamaicensis",
+    "leucopyge",
+};
+
+
+/*--------------------------------------------------------------------------------
+                                 STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+static sim_task_type    s_tasks[ SYSTEM_TASKS_MAX ];
+static uint32_t         s_tick;
+static uint32_t         s_led_brightness[ LED_COUNT ];
+static uint64_t         s_flash_count;
+
+/*------------------------------------------------------------
+Ticks between pattern set changes of a free run, 0 for none
+------------------------------------------------------------*/
+static uint64_t         s_set_ticks;
+
+/*------------------------------------------------------------
+LED current of every frame, through the led_get_current() stub
+------------------------------------------------------------*/
+static uint64_t         s_current_frames;
+static uint64_t         s_current_sum;
+static uint32_t         s_current_peak;
+
+/*------------------------------------------------------------
+LED writes, and the largest change one made, the coarsest
+stair step a flash shows
+------------------------------------------------------------*/
+static uint64_t         s_led_writes;
+static uint32_t         s_led_step_max;
+
+/*------------------------------------------------------------
+Log being replayed, and the inputs it currently holds
+------------------------------------------------------------*/
+static replay_log_type  s_replay;
+static uint8_t          s_degrade;
+static uint32_t         s_beacon;
+
+/*------------------------------------------------------------
+Golden frame files, NULL when not in use
+------------------------------------------------------------*/
+static FILE           * s_frames_out;
+static FILE           * s_frames_in;
+static uint32_t         s_tolerance = SIM_TOLERANCE;
+static sim_golden_type  s_golden;
+
+
+/*--------------------------------------------------------------------------------
+                                    PROCEDURES
+--------------------------------------------------------------------------------*/
+
+static void sim_call
+    (
+    sim_task_type     * task
+    );
+
+static boolean sim_compare
+    (
+    FILE              * trace
+    );
+
+static void sim_frame
+    (
+    void
+    );
+
+static boolean sim_load
+    (
+    const char        * path
+    );
+
+static uint64_t sim_now_ns
+    (
+    void
+    );
+
+static void sim_replay
+    (
+    void
+    );
+
+static void sim_report
+    (
+    void
+    );
+
+static void sim_run
+    (
+    double              hours
+    );
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      main
+ *
+ *  Description:
+ *      Harness entry point.
+ *
+ ************************************************************************/
+int main
+    (
+    int                 argc,
+    char             ** argv
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    double              hours;
+    FILE              * trace;
+    FILE              * record;
+    const char        * record_path;
+    const char        * replay_path;
+    const char        * frames_path;
+    int                 opt;
+    int                 status;
+
+    /*--------------------------------------------------------
+    Parse options
+    --------------------------------------------------------*/
+    record_path = NULL;
+    replay_path = NULL;
+    frames_path = NULL;
+    while( ( opt = getopt( argc, argv, "r:p:w:c:t:s:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'r':
+                record_path = optarg;
+                break;
+
+            case 'p':
+                replay_path = optarg;
+                break;
+
+            case 'w':
+            case 'c':
+                frames_path = optarg;
+                s_frames_out = ( opt == 'w' ) ? fopen( optarg, "wb" ) : NULL;
+                s_frames_in  = ( opt == 'c' ) ? fopen( optarg, "rb" ) : NULL;
+                if( s_frames_out == NULL
+                 && s_frames_in == NULL )
+                {
+                    perror( optarg );
+                    return( 1 );
+                }
+                break;
+
+            case 't':
+                s_tolerance = strtoul( optarg, NULL, 0 );
+                break;
+
+            case 's':
+                s_set_ticks = (uint64_t)( atof( optarg ) * SIM_TICKS_PER_HOUR / 60 );
+                break;
+
+            default:
+                fprintf( stderr, "usage: %s [-r log] [-p log] [-w frames] [-c frames] [-t tolerance] [-s minutes] [hours] [trace.csv]\n", argv[ 0 ] );
+                return( 1 );
+        }
+    }
+
+    hours = ( argc > optind ) ? atof( argv[ optind ] ) : 1.0;
+    trace = NULL;
+    if( argc > optind + 1 )
+    {
+        trace = fopen( argv[ optind + 1 ], "w" );
+        if( trace == NULL )
+        {
+            perror( argv[ optind + 1 ] );
+            return( 1 );
+        }
+    }
+
+    printf( "envelope engine: %s\n", SIM_ENGINE_NAME );
+
+    /*--------------------------------------------------------
+    Seed and start the engine the way the log says, or the
+    way the harness always does
+    --------------------------------------------------------*/
+    status = 0;
+    if( replay_path != NULL )
+    {
+        if( !sim_load( replay_path ) )
+        {
+            return( 1 );
+        }
+        random_seed( s_replay.seed );
+        replay_record_seed( s_replay.seed );
+        s_tick = s_replay.entries[ 0 ].tick;
+        firefly_init();
+        sim_replay();
+        if( g_replay_log.frame_hash != s_replay.frame_hash
+         && s_frames_in == NULL
+         && s_frames_out == NULL )
+        {
+            status = 1;
+        }
+    }
+    else
+    {
+        random_seed( SIM_SEED );
+        replay_record_seed( SIM_SEED );
+        firefly_init();
+        sim_run( hours );
+    }
+    if( !sim_compare( trace ) )
+    {
+        status = 1;
+    }
+
+    /*--------------------------------------------------------
+    Save the log, and report on the golden frames
+    --------------------------------------------------------*/
+    if( record_path != NULL )
+    {
+        record = fopen( record_path, "wb" );
+        if( record == NULL
+         || fwrite( &g_replay_log, sizeof( g_replay_log ), 1, record ) != 1 )
+        {
+            perror( record_path );
+            status = 1;
+        }
+        if( record != NULL )
+        {
+            fclose( record );
+        }
+    }
+
+    if( s_frames_out != NULL )
+    {
+        fclose( s_frames_out );
+    }
+    if( s_frames_in != NULL )
+    {
+        if( fgetc( s_frames_in ) != EOF )
+        {
+            s_golden.diverged = TRUE;
+        }
+        fclose( s_frames_in );
+
+        printf( "golden: %llu frames against %s, max err %lu, %llu over %lu%s\n",
+                (unsigned long long)s_golden.frames, frames_path, (unsigned long)s_golden.err_max,
+                (unsigned long long)s_golden.fails, (unsigned long)s_tolerance,
+                s_golden.diverged ? ", DIVERGED" : "" );
+        if( s_golden.fails != 0
+         || s_golden.diverged )
+        {
+            status = 1;
+        }
+    }
+
+    if( trace != NULL )
+    {
+        fclose( trace );
+    }
+
+    return( status );
+
+}   /* main() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_run
+ *
+ *  Description:
+ *      Run all registered tasks for a number of simulated hours, moving
+ *      on to the next pattern set every s_set_ticks, and report the host
+ *      time spent per task call.
+ *
+ ************************************************************************/
+static void sim_run
+    (
+    double              hours
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint64_t            ticks;
+    uint64_t            t;
+    sim_task_type     * task;
+    uint32_t            i;
+
+    ticks = (uint64_t)( hours * SIM_TICKS_PER_HOUR );
+    for( t = 0; t < ticks; t++ )
+    {
+        s_tick++;
+        if( s_set_ticks != 0
+         && t % s_set_ticks == s_set_ticks - 1 )
+        {
+            firefly_next_set();
+        }
+        for( i = 0; i < count_of_array( s_tasks ); i++ )
+        {
+            task = &s_tasks[ i ];
+            if( task->task == NULL
+             || (int32_t)( s_tick - task->due ) < 0 )
+            {
+                continue;
+            }
+
+            task->due += task->period;
+            sim_call( task );
+        }
+    }
+
+    printf( "simulated: %.2f h, %llu flashes\n", hours, (unsigned long long)s_flash_count );
+    sim_report();
+
+}   /* sim_run() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_replay
+ *
+ *  Description:
+ *      Replay a loaded log. Updates follow one period apart, except where
+ *      the log moves them, with the degraded mode, beacon weights, pace
+ *      and pattern set the log gives them. Every registered task runs on every replayed
+ *      update, the firefly engine being the only one in the harness.
+ *
+ ************************************************************************/
+static void sim_replay
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const replay_entry_type
+                      * entry;
+    uint32_t            next;
+    uint32_t            update;
+    uint32_t            period;
+    uint32_t            tick;
+    uint32_t            i;
+
+    tick = s_replay.entries[ 0 ].tick;
+    period = s_replay.entries[ 0 ].value;
+    next = 1;
+    for( update = 0; update < s_replay.updates; update++ )
+    {
+        tick += period;
+        if( next < s_replay.count
+         && s_replay.entries[ next ].id == REPLAY_ENTRY_UPDATE
+         && s_replay.entries[ next ].value == update )
+        {
+            tick = s_replay.entries[ next++ ].tick;
+        }
+
+        s_beacon = 0;
+        while( next < s_replay.count
+            && s_replay.entries[ next ].tick == tick
+            && s_replay.entries[ next ].id != REPLAY_ENTRY_UPDATE )
+        {
+            entry = &s_replay.entries[ next++ ];
+            if( entry->id == REPLAY_ENTRY_DEGRADE )
+            {
+                s_degrade = entry->value;
+            }
+            else if( entry->id == REPLAY_ENTRY_BEACON )
+            {
+                s_beacon = entry->value;
+            }
+            else if( entry->id == REPLAY_ENTRY_PACE )
+            {
+                firefly_set_pace( entry->value );
+            }
+            else if( entry->id == REPLAY_ENTRY_SET )
+            {
+                firefly_select_set( entry->value );
+            }
+        }
+
+        s_tick = tick;
+        for( i = 0; i < count_of_array( s_tasks ); i++ )
+        {
+            if( s_tasks[ i ].task != NULL )
+            {
+                sim_call( &s_tasks[ i ] );
+            }
+        }
+    }
+
+    printf( "replayed: %lu updates, %llu flashes, hash %08lx, recorded %08lx%s\n",
+            (unsigned long)s_replay.updates, (unsigned long long)s_flash_count,
+            (unsigned long)g_replay_log.frame_hash, (unsigned long)s_replay.frame_hash,
+            ( g_replay_log.frame_hash == s_replay.frame_hash ) ? "" : ", MISMATCH" );
+    sim_report();
+
+}   /* sim_replay() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_call
+ *
+ *  Description:
+ *      Run one task, timed.
+ *
+ ************************************************************************/
+static void sim_call
+    (
+    sim_task_type     * task
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint64_t            start;
+    uint64_t            ns;
+
+    start = sim_now_ns();
+    task->task();
+    ns = sim_now_ns() - start;
+    task->ns += ns;
+    task->ns_hist[ min_val( ns / SIM_NS_BIN, SIM_NS_BINS - 1 ) ]++;
+    task->calls++;
+
+}   /* sim_call() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_report
+ *
+ *  Description:
+ *      Report the host time spent per task call, on average and in the
+ *      worst one in SIM_NS_TAIL calls, which unlike the single longest
+ *      call is not set by host preemption. Then report the LED current
+ *      drawn, and how finely the LEDs were stepped.
+ *
+ ************************************************************************/
+static void sim_report
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    sim_task_type     * task;
+    uint64_t            tail;
+    uint32_t            bin;
+    uint32_t            i;
+
+    for( i = 0; i < count_of_array( s_tasks ); i++ )
+    {
+        task = &s_tasks[ i ];
+        if( task->calls )
+        {
+            tail = 0;
+            for( bin = SIM_NS_BINS; bin-- > 0 && tail < task->calls / SIM_NS_TAIL; )
+            {
+                tail += task->ns_hist[ bin ];
+            }
+
+            printf( "task %lu (every %lu ms): %llu calls, %.1f ns/call, %lu ns/call tail\n",
+                    (unsigned long)i, (unsigned long)task->period,
+                    (unsigned long long)task->calls, (double)task->ns / task->calls,
+                    (unsigned long)( ( bin + 1 ) * SIM_NS_BIN ) );
+        }
+    }
+
+    if( s_current_frames )
+    {
+        printf( "current: peak %lu, mean %.1f, budget %lu DAC codes\n",
+                (unsigned long)s_current_peak, (double)s_current_sum / s_current_frames,
+                (unsigned long)FIREFLY_CURRENT_BUDGET );
+    }
+
+    printf( "leds: %llu writes, largest step %lu\n",
+            (unsigned long long)s_led_writes, (unsigned long)s_led_step_max );
+
+}   /* sim_report() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_compare
+ *
+ *  Description:
+ *      Compare the selected envelope engine against the reference for
+ *      every species across the smoothing range. Errors are reported both
+ *      at the flash times a stepping firefly visits and at every ms. The
+ *      boot set is loaded and built again first, as a run may have moved
+ *      on from it. Returns FALSE if any error is past the tolerance.
+ *
+ ************************************************************************/
+static boolean sim_compare
+    (
+    FILE              * trace
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    sim_compare_type    results[ FLASH_COUNT ];
+    sim_compare_type  * result;
+    flash_id_type       flash_id;
+    int16_t             width;
+    int16_t             smoothing;
+    int32_t             start_time;
+    int32_t             end_time;
+    int32_t             t;
+    int32_t             err;
+    flash_brightness_type
+                        engine;
+    flash_brightness_type
+                        reference;
+    uint64_t            start;
+    uint64_t            engine_ns;
+    uint64_t            reference_ns;
+    uint64_t            calls;
+    int32_t             err_max;
+    volatile flash_brightness_type
+                        sink;
+    envelope_cursor_type
+                        cursor;
+
+    envelope_init();
+    clear_array( results );
+    if( trace != NULL )
+    {
+        fprintf( trace, "species,smoothing,time,engine,reference\n" );
+    }
+
+    for( flash_id = FLASH_FIRST; flash_id <= FLASH_LAST; flash_id++ )
+    {
+        result = &results[ flash_id ];
+        for( width = ENVELOPE_SMOOTHING_MIN; width <= ENVELOPE_SMOOTHING_MAX; width++ )
+        {
+            /*------------------------------------------------
+            Use the width a firefly would actually flash with,
+            once per distinct width.
+            ------------------------------------------------*/
+            smoothing = envelope_smoothing_quantize( width );
+            if( width != ENVELOPE_SMOOTHING_MIN
+             && smoothing == envelope_smoothing_quantize( width - 1 ) )
+            {
+                continue;
+            }
+            start_time = -( smoothing / 2 );
+            end_time = envelope_flash_length( flash_id ) + smoothing;
+
+            cursor = ENVELOPE_CURSOR_START;
+            for( t = start_time; t <= end_time; t++ )
+            {
+                engine = envelope_brightness( flash_id, t, smoothing, &cursor );
+                reference = envelope_brightness_reference( flash_id, t, smoothing );
+                err = abs( engine - reference );
+
+                result->err_any = max_val( result->err_any, err );
+                if( ( t - start_time ) % SIM_STEP == 0 )
+                {
+                    result->err_visited = max_val( result->err_visited, err );
+                }
+                result->samples++;
+
+                if( trace != NULL
+                 && ( width - ENVELOPE_SMOOTHING_MIN ) % SIM_TRACE_SMOOTHING_STEP == 0 )
+                {
+                    fprintf( trace, "%s,%d,%ld,%ld,%ld\n", species_names[ flash_id ], smoothing,
+                             (long)t, (long)engine, (long)reference );
+                }
+            }
+        }
+    }
+
+    /*--------------------------------------------------------
+    Time both paths over the same stepped samples
+    --------------------------------------------------------*/
+    engine_ns = 0;
+    reference_ns = 0;
+    calls = 0;
+    for( flash_id = FLASH_FIRST; flash_id <= FLASH_LAST; flash_id++ )
+    {
+        smoothing = envelope_smoothing_quantize( ( ENVELOPE_SMOOTHING_MIN + ENVELOPE_SMOOTHING_MAX ) / 2 );
+        end_time = envelope_flash_length( flash_id ) + smoothing;
+
+        cursor = ENVELOPE_CURSOR_START;
+        start = sim_now_ns();
+        for( t = -( smoothing / 2 ); t <= end_time; t += SIM_STEP )
+        {
+            sink = envelope_brightness( flash_id, t, smoothing, &cursor );
+        }
+        engine_ns += sim_now_ns() - start;
+
+        start = sim_now_ns();
+        for( t = -( smoothing / 2 ); t <= end_time; t += SIM_STEP )
+        {
+            sink = envelope_brightness_reference( flash_id, t, smoothing );
+            calls++;
+        }
+        reference_ns += sim_now_ns() - start;
+    }
+    (void)sink;
+
+    printf( "envelope: %.1f ns/call %s, %.1f ns/call reference\n",
+            (double)engine_ns / calls, SIM_ENGINE_NAME, (double)reference_ns / calls );
+    printf( "%-14s %12s %12s\n", "species", "err stepped", "err any ms" );
+    err_max = 0;
+    for( flash_id = FLASH_FIRST; flash_id <= FLASH_LAST; flash_id++ )
+    {
+        printf( "%-14s %12ld %12ld\n", species_names[ flash_id ],
+                (long)results[ flash_id ].err_visited, (long)results[ flash_id ].err_any );
+        err_max = max_val( err_max, results[ flash_id ].err_any );
+    }
+
+    if( err_max > s_tolerance )
+    {
+        printf( "envelope: max err %ld, over %lu\n", (long)err_max, (unsigned long)s_tolerance );
+        return( FALSE );
+    }
+
+    return( TRUE );
+
+}   /* sim_compare() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_frame
+ *
+ *  Description:
+ *      Write the LEDs as just committed to the golden frame file, or
+ *      compare them against the next frame in it. Once the frame ticks
+ *      stop matching, the flash schedules have diverged and no further
+ *      frames are compared.
+ *
+ ************************************************************************/
+static void sim_frame
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    sim_frame_type      frame;
+    sim_frame_type      golden;
+    uint32_t            err;
+    uint32_t            err_max;
+    uint32_t            current;
+    uint32_t            i;
+
+    frame.tick = s_tick;
+    current = 0;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        frame.brightness[ i ] = s_led_brightness[ i ];
+        current += led_get_current( s_led_brightness[ i ] );
+    }
+    s_current_frames++;
+    s_current_sum += current;
+    s_current_peak = max_val( s_current_peak, current );
+
+    if( s_frames_out != NULL )
+    {
+        fwrite( &frame, sizeof( frame ), 1, s_frames_out );
+    }
+
+    if( s_frames_in == NULL
+     || s_golden.diverged )
+    {
+        return;
+    }
+
+    if( fread( &golden, sizeof( golden ), 1, s_frames_in ) != 1
+     || golden.tick != frame.tick )
+    {
+        s_golden.diverged = TRUE;
+        return;
+    }
+
+    err_max = 0;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        err = abs( (int32_t)frame.brightness[ i ] - (int32_t)golden.brightness[ i ] );
+        err_max = max_val( err_max, err );
+    }
+
+    s_golden.frames++;
+    s_golden.err_max = max_val( s_golden.err_max, err_max );
+    if( err_max > s_tolerance )
+    {
+        s_golden.fails++;
+    }
+
+}   /* sim_frame() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_load
+ *
+ *  Description:
+ *      Load a replay log, as written by -r or dumped from a jar. Returns
+ *      FALSE if it is not a log this build can replay.
+ *
+ ************************************************************************/
+static boolean sim_load
+    (
+    const char        * path
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    FILE              * log;
+    size_t              size;
+
+    log = fopen( path, "rb" );
+    if( log == NULL )
+    {
+        perror( path );
+        return( FALSE );
+    }
+    size = fread( &s_replay, 1, sizeof( s_replay ), log );
+    fclose( log );
+
+    if( size < offsetof( replay_log_type, entries )
+     || s_replay.magic != REPLAY_MAGIC
+     || s_replay.count == 0
+     || s_replay.count > REPLAY_LOG_MAX
+     || size < offsetof( replay_log_type, entries[ s_replay.count ] )
+     || s_replay.entries[ 0 ].id != REPLAY_ENTRY_START )
+    {
+        fprintf( stderr, "%s: not a replay log\n", path );
+        return( FALSE );
+    }
+
+    if( s_replay.dropped != 0 )
+    {
+        printf( "replay: %s filled up, replaying its first %lu updates\n", path, (unsigned long)s_replay.updates );
+    }
+
+    return( TRUE );
+
+}   /* sim_load() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      sim_now_ns
+ *
+ *  Description:
+ *      Host monotonic time in nanoseconds.
+ *
+ ************************************************************************/
+static uint64_t sim_now_ns
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    struct timespec     now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return( (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec );
+
+}   /* sim_now_ns() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_frame_begin
+ *
+ *  Description:
+ *      LED stub, the simulation has no frame buffers.
+ *
+ ************************************************************************/
+void led_frame_begin
+    (
+    void
+    )
+{
+
+}   /* led_frame_begin() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_frame_commit
+ *
+ *  Description:
+ *      LED stub, hands the frame to the golden frame check.
+ *
+ ************************************************************************/
+void led_frame_commit
+    (
+    void
+    )
+{
+    sim_frame();
+
+}   /* led_frame_commit() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_set_brightness
+ *
+ *  Description:
+ *      LED stub. Counts flashes as LEDs leaving zero, and measures the
+ *      change each write makes.
+ *
+ ************************************************************************/
+void led_set_brightness
+    (
+    led_type    led_id,
+    uint32_t    led_brightness
+    )
+{
+    if( led_id < LED_COUNT )
+    {
+        if( s_led_brightness[ led_id ] == 0
+         && led_brightness != 0 )
+        {
+            s_flash_count++;
+        }
+        s_led_writes++;
+        s_led_step_max = max_val( s_led_step_max, (uint32_t)abs( (int32_t)( led_brightness - s_led_brightness[ led_id ] ) ) );
+        s_led_brightness[ led_id ] = led_brightness;
+    }
+
+}   /* led_set_brightness() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_get_current
+ *
+ *  Description:
+ *      LED stub. A square law stands in for the gamma curve, drawing
+ *      slightly more than it does.
+ *
+ ************************************************************************/
+uint32_t led_get_current
+    (
+    uint32_t    led_brightness
+    )
+{
+    led_brightness = min_val( led_brightness, LED_BRIGHTNESS_MAX );
+
+    return( ( led_brightness * led_brightness * LED_DAC_MAX ) / ( LED_BRIGHTNESS_MAX * LED_BRIGHTNESS_MAX ) );
+
+}   /* led_get_current() */
+
+
+#if( LINK_ENABLE )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_poll
+ *
+ *  Description:
+ *      Link stub, hears the beacon weight a replayed update heard.
+ *
+ ************************************************************************/
+uint32_t link_poll
+    (
+    void
+    )
+{
+    return( s_beacon );
+
+}   /* link_poll() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_send
+ *
+ *  Description:
+ *      Link stub, there is no jar downstream.
+ *
+ ************************************************************************/
+void link_send
+    (
+    uint32_t        flashes
+    )
+{
+
+}   /* link_send() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_add_task
+ *
+ *  Description:
+ *      Scheduler stub, tasks run from sim_run().
+ *
+ ************************************************************************/
+void system_add_task
+    (
+    task_ptr_type   tsk,
+    uint32_t        prd,
+    uint8_t         flags
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t        i;
+
+    for( i = 0; i < count_of_array( s_tasks ); i++ )
+    {
+        if( s_tasks[ i ].task == NULL )
+        {
+            s_tasks[ i ].task = tsk;
+            s_tasks[ i ].period = max_val( prd, 1 );
+            s_tasks[ i ].due = s_tick + s_tasks[ i ].period;
+            break;
+        }
+
+        if( s_tasks[ i ].task == tsk )
+        {
+            break;
+        }
+    }
+
+}   /* system_add_task() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_event_post
+ *
+ *  Description:
+ *      Event queue stub, there is no main loop to handle events.
+ *
+ ************************************************************************/
+boolean system_event_post
+    (
+    system_event_id_type
+                    id,
+    uint8_t         arg,
+    task_ptr_type   task
+    )
+{
+    return( TRUE );
+
+}   /* system_event_post() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_get_degrade
+ *
+ *  Description:
+ *      Simulated tasks never overrun, replayed ones run degraded as
+ *      recorded.
+ *
+ ************************************************************************/
+uint8_t system_get_degrade
+    (
+    void
+    )
+{
+    return( s_degrade );
+
+}   /* system_get_degrade() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_get_tick
+ *
+ *  Description:
+ *      Simulated tick counter.
+ *
+ ************************************************************************/
+uint32_t system_get_tick
+    (
+    void
+    )
+{
+    return( s_tick );
+
+}   /* system_get_tick() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_remove_task
+ *
+ *  Description:
+ *      Scheduler stub.
+ *
+ ************************************************************************/
+void system_remove_task
+    (
+    task_ptr_type   tsk
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t        i;
+
+    for( i = 0; i < count_of_array( s_tasks ); i++ )
+    {
+        if( s_tasks[ i ].task == tsk )
+        {
+            s_tasks[ i ].task = NULL;
+        }
+    }
+
+}   /* system_remove_task() */
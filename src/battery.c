@@ -0,0 +1,289 @@
+/*********************************************************************************
+ *
+ *  battery.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Track the supply voltage and stretch the show as the cell drains.
+ *
+ *       VDDA is found from conversions of VREFINT against its factory reading,
+ *       so no pin or divider is needed. A reading takes about 100 us of ADC
+ *       time once a second from a deferred task, and the ADC is powered down
+ *       in between. Readings are filtered, as a flash pulls the supply down
+ *       for a moment, and the policy is only ever eased after the supply has
+ *       clearly recovered, so that the jar does not brighten and dim again as
+ *       a resting cell creeps back up.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stm32f3xx.h>
+#include "system.h"
+#include "leds.h"
+#include "fireflies.h"
+#include "battery.h"
+
+#if( BATTERY_MONITOR )
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define BATTERY_ADC_SMP         ( 7 )       /* 601.5 ADC clocks, VREFINT needs > 2.2 us */
+#define BATTERY_SAMPLES         ( 8 )       /* Conversions per reading                  */
+#define BATTERY_FILTER_SHIFT    ( 2 )       /* Each reading moves the filter a quarter  */
+#define BATTERY_SHUTDOWN_READINGS ( 3 )     /* Low readings in a row to shut down       */
+#define BATTERY_HEADROOM_ONE    ( 256 )
+
+compile_assert( BATTERY_MV_FULL > BATTERY_MV_EMPTY && BATTERY_MV_EMPTY >= BATTERY_MV_SHUTDOWN, battery_levels );
+compile_assert( BATTERY_SCALE_EMPTY <= LED_SCALE_ONE, battery_scale );
+compile_assert( BATTERY_PACE_EMPTY >= FIREFLY_PACE_ONE, battery_pace );
+compile_assert( BATTERY_REFRESH_DIVIDER_MAX >= 1, battery_refresh_divider );
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               MEMORY_CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+volatile battery_stats_type g_battery_stats;
+
+/*--------------------------------------------------------------------------------
+                               STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Filtered VDDA, in mV << BATTERY_FILTER_SHIFT
+------------------------------------------------------------*/
+static uint32_t         s_filter;
+
+/*------------------------------------------------------------
+Set once the jar has started shutting down
+------------------------------------------------------------*/
+static boolean          s_shutdown;
+
+/*--------------------------------------------------------------------------------
+                                  PROCEDURES
+--------------------------------------------------------------------------------*/
+
+static void battery_apply
+    (
+    uint32_t        mv
+    );
+
+static void battery_periodic_callback
+    (
+    void
+    );
+
+static uint32_t battery_read
+    (
+    void
+    );
+
+static void battery_shutdown
+    (
+    void
+    );
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      battery_init
+ *
+ *  Description:
+ *      Take a first reading, set the policy for it and start monitoring.
+ *      A jar booted on a cell that is already too low shuts down again
+ *      straight away.
+ *
+ ************************************************************************/
+void battery_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        mv;
+
+    clear_struct( g_battery_stats );
+    s_shutdown = FALSE;
+
+    mv = battery_read();
+    s_filter = mv << BATTERY_FILTER_SHIFT;
+    g_battery_stats.readings = 1;
+    g_battery_stats.mv = mv;
+    g_battery_stats.mv_min = mv;
+    battery_apply( mv );
+
+    if( mv < BATTERY_MV_SHUTDOWN )
+    {
+        battery_shutdown();
+        return;
+    }
+
+    system_add_task( battery_periodic_callback, BATTERY_PERIOD_MS, SYSTEM_TASK_DEFERRED );
+
+}   /* battery_init() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      battery_apply
+ *
+ *  Description:
+ *      Set the brightness scale, refresh rate and pace for a supply
+ *      voltage. Headroom runs from BATTERY_HEADROOM_ONE at
+ *      BATTERY_MV_FULL and up, to 0 at BATTERY_MV_EMPTY and below, and
+ *      each setting follows it linearly from its full to its empty value.
+ *
+ ************************************************************************/
+static void battery_apply
+    (
+    uint32_t        mv
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        headroom;
+    uint32_t        drop;
+
+    mv = limit_val( mv, BATTERY_MV_EMPTY, BATTERY_MV_FULL );
+    headroom = ( ( mv - BATTERY_MV_EMPTY ) * BATTERY_HEADROOM_ONE ) / ( BATTERY_MV_FULL - BATTERY_MV_EMPTY );
+    drop = BATTERY_HEADROOM_ONE - headroom;
+
+    g_battery_stats.mv_policy = mv;
+    g_battery_stats.headroom = headroom;
+
+    led_set_scale( LED_SCALE_ONE - ( ( LED_SCALE_ONE - BATTERY_SCALE_EMPTY ) * drop ) / BATTERY_HEADROOM_ONE );
+    led_set_refresh_divider( 1 + ( ( BATTERY_REFRESH_DIVIDER_MAX - 1 ) * drop + BATTERY_HEADROOM_ONE / 2 ) / BATTERY_HEADROOM_ONE );
+    firefly_set_pace( FIREFLY_PACE_ONE + ( ( BATTERY_PACE_EMPTY - FIREFLY_PACE_ONE ) * drop ) / BATTERY_HEADROOM_ONE );
+
+}   /* battery_apply() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      battery_periodic_callback
+ *
+ *  Description:
+ *      Take a reading, tighten the policy as the supply falls, ease it
+ *      once the supply has recovered by BATTERY_MV_HYSTERESIS, and shut
+ *      down after BATTERY_SHUTDOWN_READINGS readings in a row under
+ *      BATTERY_MV_SHUTDOWN.
+ *
+ ************************************************************************/
+static void battery_periodic_callback
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        mv;
+
+    s_filter += battery_read() - ( s_filter >> BATTERY_FILTER_SHIFT );
+    mv = s_filter >> BATTERY_FILTER_SHIFT;
+
+    g_battery_stats.readings++;
+    g_battery_stats.mv = mv;
+    g_battery_stats.mv_min = min_val( g_battery_stats.mv_min, mv );
+
+    if( mv < g_battery_stats.mv_policy
+     || mv >= g_battery_stats.mv_policy + BATTERY_MV_HYSTERESIS )
+    {
+        battery_apply( mv );
+    }
+
+    if( mv >= BATTERY_MV_SHUTDOWN )
+    {
+        g_battery_stats.low_readings = 0;
+    }
+    else if( ++g_battery_stats.low_readings >= BATTERY_SHUTDOWN_READINGS )
+    {
+        battery_shutdown();
+    }
+
+}   /* battery_periodic_callback() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      battery_read
+ *
+ *  Description:
+ *      Measure VDDA in mV. VREFINT reads lower the higher VDDA is.
+ *
+ ************************************************************************/
+static uint32_t battery_read
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        sum;
+    uint32_t        i;
+
+    sum = 0;
+    system_adc_start();
+    for( i = 0; i < BATTERY_SAMPLES; i++ )
+    {
+        sum += system_adc_convert( SYSTEM_ADC_VREFINT, BATTERY_ADC_SMP );
+    }
+    system_adc_stop();
+
+    return( ( SYSTEM_VREFINT_CAL_MV * SYSTEM_VREFINT_CAL * BATTERY_SAMPLES ) / max_val( sum, 1 ) );
+
+}   /* battery_read() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      battery_shutdown
+ *
+ *  Description:
+ *      Go dark and stop monitoring, then have the main loop let go of
+ *      the power. Should a touch still hold the power on, the jar stays
+ *      dark.
+ *
+ ************************************************************************/
+static void battery_shutdown
+    (
+    void
+    )
+{
+    if( s_shutdown )
+    {
+        return;
+    }
+    s_shutdown = TRUE;
+
+    led_set_scale( 0 );
+    system_remove_task( battery_periodic_callback );
+    system_event_post( SYSTEM_EVENT_SHUTDOWN, 0, NULL );
+
+}   /* battery_shutdown() */
+
+#endif
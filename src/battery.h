@@ -0,0 +1,105 @@
+/*********************************************************************************
+ *
+ *  battery.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Track the supply voltage and stretch the show as the cell drains.
+ *
+ ********************************************************************************/
+
+#ifndef BATTERY_H_
+#define BATTERY_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Set BATTERY_MONITOR to 1 to measure VDDA against VREFINT once
+every BATTERY_PERIOD_MS. The LED drivers run from the same
+supply, so as it falls from BATTERY_MV_FULL to BATTERY_MV_EMPTY
+they lose headroom, and the jar dims every LED towards
+BATTERY_SCALE_EMPTY, refreshes them up to
+BATTERY_REFRESH_DIVIDER_MAX times less often and stretches
+random mode delays up to BATTERY_PACE_EMPTY times, so that
+flashes stay even and the cell lasts. Below
+BATTERY_MV_SHUTDOWN the jar goes dark and lets go of its
+power, well before a brownout could leave it half running.
+Readings only ever lower the policy, unless the supply has
+recovered by BATTERY_MV_HYSTERESIS.
+------------------------------------------------------------*/
+#ifndef BATTERY_MONITOR
+#define BATTERY_MONITOR         ( 1 )
+#endif
+
+#ifndef BATTERY_PERIOD_MS
+#define BATTERY_PERIOD_MS       ( 1000 )
+#endif
+
+#ifndef BATTERY_MV_FULL
+#define BATTERY_MV_FULL         ( 3200 )
+#endif
+
+#ifndef BATTERY_MV_EMPTY
+#define BATTERY_MV_EMPTY        ( 2800 )
+#endif
+
+#ifndef BATTERY_MV_SHUTDOWN
+#define BATTERY_MV_SHUTDOWN     ( 2600 )
+#endif
+
+#ifndef BATTERY_MV_HYSTERESIS
+#define BATTERY_MV_HYSTERESIS   ( 50 )
+#endif
+
+#ifndef BATTERY_SCALE_EMPTY
+#define BATTERY_SCALE_EMPTY     ( 128 )         /* Of LED_SCALE_ONE                     */
+#endif
+
+#ifndef BATTERY_PACE_EMPTY
+#define BATTERY_PACE_EMPTY      ( 512 )         /* Of FIREFLY_PACE_ONE                  */
+#endif
+
+#ifndef BATTERY_REFRESH_DIVIDER_MAX
+#define BATTERY_REFRESH_DIVIDER_MAX ( 2 )
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Battery state, for inspection from a debugger
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        readings;       /* Readings taken               */
+    uint32_t        mv;             /* Filtered VDDA                */
+    uint32_t        mv_min;         /* Lowest filtered VDDA         */
+    uint32_t        mv_policy;      /* VDDA the policy is set for   */
+    uint32_t        headroom;       /* Q8, 0 at BATTERY_MV_EMPTY    */
+    uint32_t        low_readings;   /* Readings under shutdown      */
+}battery_stats_type;
+
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+#if( BATTERY_MONITOR )
+extern volatile battery_stats_type g_battery_stats;
+#endif
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+void battery_init
+    (
+    void
+    );
+
+
+#endif /* BATTERY_H_ */
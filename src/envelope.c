@@ -0,0 +1,2378 @@
+/*********************************************************************************
+ *
+ *  envelope.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Flash pattern definitions and smoothed brightness envelopes.
+ *
+ *       The reference engine box-filters the piecewise linear flash pattern
+ *       analytically on every call. The LUT engine samples the reference
+ *       output once at boot for a set of quantized smoothing widths, so a
+ *       firefly update becomes a table read and at most one interpolation.
+ *       The integral engine stores the running integral of each unsmoothed
+ *       pattern at its segment boundaries, so any smoothing window reduces
+ *       to two integral lookups and a subtraction. The FIR engine builds the
+ *       LUT engine's tables with a decimating FIR over a 1 ms q15 raster of the
+ *       unsmoothed pattern, so any kernel costs the same as a box at run time.
+ *
+ *       The batch entry point evaluates two LUT lanes per word. Bounds checks
+ *       and the sample index are packed halfword operations, only the table
+ *       reads themselves are per lane.
+ *
+ *       Patterns come in sets, read from a flash page into RAM slots. A set
+ *       can be swapped in while the jar runs, its tables built a slice at a
+ *       time, with flashes drawn from it running on the reference engine
+ *       until they are ready.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "system.h"
+#include "envelope.h"
+
+#if( ENVELOPE_SIMD || ENVELOPE_FIR_CMSIS_DSP )
+#include <stm32f3xx.h>
+#endif
+
+#if( ( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR ) && ENVELOPE_FIR_CMSIS_DSP )
+#include <arm_math.h>
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define FLASH_SEGMENTS_MAX      ( 15  )
+
+#define LUT_LEVEL_STEP          ( ( ENVELOPE_SMOOTHING_MAX - ENVELOPE_SMOOTHING_MIN ) / ( ENVELOPE_LUT_LEVELS - 1 ) )
+
+/*------------------------------------------------------------
+Engines read from the LUT tables
+------------------------------------------------------------*/
+#define LUT_TABLES              ( ( ENVELOPE_ENGINE == ENVELOPE_ENGINE_LUT ) || ( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR ) )
+
+/*------------------------------------------------------------
+FIR engine. The raster is filtered FIR_BLOCK samples at a
+time and decimated to one output per LUT sample. Brightness
+is scaled up by FIR_INPUT_SHIFT to use the q15 range. The
+kernel samples the reference window, 2 * ( smoothing / 2 )
++ 1 ms from half the smoothing before a sample time, at
+every ms including both ends.
+------------------------------------------------------------*/
+#define FIR_DECIMATION          ( ENVELOPE_LUT_RESOLUTION )
+#define FIR_BLOCK               ( 8 * FIR_DECIMATION )
+#define FIR_TAPS( smoothing )   ( 2 * ( (smoothing) / 2 ) + 2 )
+#define FIR_TAPS_MAX            ( FIR_TAPS( ENVELOPE_SMOOTHING_MAX ) )
+#define FIR_INPUT_SHIFT         ( 5 )
+#define FIR_Q15_ONE             ( 1 << 15 )
+
+/*------------------------------------------------------------
+Tables of a set are built a slice at a time, one FIR block of
+LUT samples or one integral pattern
+------------------------------------------------------------*/
+#define BUILD_SLICE_SAMPLES     ( FIR_BLOCK / FIR_DECIMATION )
+
+/*------------------------------------------------------------
+Pattern set store
+------------------------------------------------------------*/
+#define SET_MAGIC               ( 0x54455350 )  /* "PSET"                   */
+#define SET_SLOT_NONE           ( ENVELOPE_SET_SLOTS )
+
+/*------------------------------------------------------------
+Integral engine reciprocal table, one entry per half
+smoothing width from ENVELOPE_SMOOTHING_MIN to _MAX.
+------------------------------------------------------------*/
+#define INTEGRAL_HALF_SMOOTH_MIN    ( ENVELOPE_SMOOTHING_MIN >> 1 )
+#define INTEGRAL_HALF_SMOOTH_MAX    ( ENVELOPE_SMOOTHING_MAX >> 1 )
+#define INTEGRAL_SLOPE_SHIFT        ( 16 )
+
+/*------------------------------------------------------------
+Packed LUT lanes. Shifting a word of sample offsets right
+carries bits across lanes, which the index mask drops. A
+negative offset then reads as an index past every table.
+------------------------------------------------------------*/
+#define LUT_LANE_INDEX_MASK     ( ( 0xFFFF >> ENVELOPE_LUT_SHIFT ) * 0x00010001 )
+#define LUT_LANE_FRAC_MASK      ( ( ENVELOPE_LUT_RESOLUTION - 1 ) * 0x00010001 )
+
+
+/*--------------------------------------------------------------------------------
+                                       TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Flash points, the building blocks of a flash pattern.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint16_t        target;     /* Target brightness        */
+    uint16_t        time;       /* Transition time          */
+}flash_point_type;
+
+/*------------------------------------------------------------
+Flash pattern index entry. The points of a set are stored
+back to back, so a pattern is located by its offset and
+walked by its segment count.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint16_t        offset;     /* Index of first point     */
+    uint16_t        length;     /* Unsmoothed run time (ms) */
+    uint8_t         count;      /* Number of segments       */
+}flash_pattern_type;
+
+/*------------------------------------------------------------
+Pattern set store, as kept in flash. The header is followed
+by size bytes of set records, back to back.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        magic;
+    uint16_t        count;      /* Number of sets           */
+    uint16_t        size;       /* Bytes of set records     */
+    uint32_t        checksum;   /* Inverted sum of record halfwords */
+}set_store_type;
+
+/*------------------------------------------------------------
+Stored pattern set. The pattern index is followed by the
+points, which its offsets count from.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint8_t         count;      /* Number of patterns       */
+    uint8_t         points;     /* Number of flash points   */
+    flash_pattern_type
+                    pattern[];
+}set_record_type;
+
+/*------------------------------------------------------------
+Resident pattern set, with the start time of every segment of
+every pattern, closed by the flash length
+------------------------------------------------------------*/
+typedef struct
+{
+    flash_pattern_type
+                    pattern[ ENVELOPE_SET_PATTERNS_MAX ];
+    flash_point_type
+                    point[ ENVELOPE_SET_POINTS_MAX ];
+    uint16_t        segment_start[ ENVELOPE_SET_PATTERNS_MAX ][ FLASH_SEGMENTS_MAX + 1 ];
+    uint8_t         count;      /* Number of patterns       */
+}set_slot_type;
+
+/*------------------------------------------------------------
+Progress of the tables. They are built for one slot, entry by
+entry, and only read once ready.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint8_t         slot;       /* Slot built for           */
+    boolean         ready;      /* Every table complete     */
+    uint8_t         pattern;    /* Pattern being built      */
+#if( LUT_TABLES )
+    uint8_t         level;      /* Its smoothing level      */
+    uint16_t        done;       /* Samples of entry built   */
+    uint16_t        offset;     /* First free sample        */
+    envelope_cursor_type
+                    cursor;     /* Pattern segment sampled  */
+#endif
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+    int32_t         raster_time;/* Next raster sample time  */
+#endif
+}table_build_type;
+
+/*------------------------------------------------------------
+LUT index entry, one per flash pattern and smoothing level
+------------------------------------------------------------*/
+typedef struct
+{
+    uint16_t        offset;     /* Index of first sample    */
+    uint16_t        count;      /* Number of samples        */
+    int32_t         origin;     /* Flash time of 1st sample */
+}lut_entry_type;
+
+/*------------------------------------------------------------
+Cumulative integral of a flash pattern. Integrals are doubled
+to stay exact for the trapezoid of each segment. Slopes are
+in brightness per ms, Q16, so evaluating a segment needs no
+divide.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        count;      /* Number of segments       */
+    int32_t         start[ FLASH_SEGMENTS_MAX + 1 ];
+                                /* Segment start times      */
+    int32_t         integral[ FLASH_SEGMENTS_MAX + 1 ];
+                                /* 2x integral at start     */
+    int32_t         slope[ FLASH_SEGMENTS_MAX ];
+                                /* Segment slope, Q16       */
+}integral_pattern_type;
+
+
+/*--------------------------------------------------------------------------------
+                                    MEMORY CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Flash pattern definitions. Each flash is assumed to start at 0
+brightness. Each flash point in the pattern then defines the
+next target brightness and the amount of time allowed to reach
+that brightness. Every pattern closes with a single END point,
+which fades back to zero brightness and ends the flash.
+
+Patterns are written once as POINT( target, time ) lists and
+expanded below into the built-in sets and the build time
+checks, so the two can never disagree.
+
+Flash patterns based on research by McDermott and Buck (1959),
+the Photuris crescendo and flicker after Barber (1951)
+------------------------------------------------------------*/
+
+/*--------------------------------------------------------
+Flash of the Photinus pallens
+--------------------------------------------------------*/
+#define PATTERN_PHOTINUS_PALLENS( POINT, END )      \
+    POINT(  800,  300 )                             \
+    POINT( 1000,  100 )                             \
+    POINT(  800,  200 )                             \
+    END  (        400 )
+
+/*--------------------------------------------------------
+Flash of the Photinus lewisi
+--------------------------------------------------------*/
+#define PATTERN_PHOTINUS_LEWISI( POINT, END )       \
+    POINT(  500,  100 )                             \
+    POINT(  500,  800 )                             \
+    END  (        100 )
+
+/*--------------------------------------------------------
+Flash of the Photinus amplus
+--------------------------------------------------------*/
+#define PATTERN_PHOTINUS_AMPLUS( POINT, END )       \
+    POINT( 1000,  100 )                             \
+    POINT(    1,  100 )                             \
+    POINT(    1,  100 )                             \
+    POINT( 1000,  100 )                             \
+    END  (        100 )
+
+/*--------------------------------------------------------
+Flash of the Photinus xanthophotis
+--------------------------------------------------------*/
+#define PATTERN_PHOTINUS_XANTHOPHOTIS( POINT, END ) \
+    POINT( 1000,  200 )                             \
+    POINT(    1,  100 )                             \
+    POINT(    1,  200 )                             \
+    POINT(  300,  100 )                             \
+    POINT(    1,  100 )                             \
+    POINT(  300,  100 )                             \
+    END  (        100 )
+
+/*--------------------------------------------------------
+Flash of the Photuris jamaicensis
+--------------------------------------------------------*/
+#define PATTERN_PHOTURIS_JAMAICENSIS( POINT, END )  \
+    POINT(  500,   50 )                             \
+    POINT(  500,  200 )                             \
+    END  (         50 )
+
+/*--------------------------------------------------------
+Flash of the Photinus leucopyge
+--------------------------------------------------------*/
+#define PATTERN_PHOTINUS_LEUCOPYGE( POINT, END )    \
+    POINT( 1000,   50 )                             \
+    POINT( 1000,  200 )                             \
+    END  (         50 )
+
+/*--------------------------------------------------------
+Flash of the Photuris lucicrescens, slowly swelling
+--------------------------------------------------------*/
+#define PATTERN_PHOTURIS_LUCICRESCENS( POINT, END ) \
+    POINT(  200,  300 )                             \
+    POINT(  600,  400 )                             \
+    POINT( 1000,  300 )                             \
+    END  (        100 )
+
+/*--------------------------------------------------------
+Flash of the Photuris versicolor, flickered
+--------------------------------------------------------*/
+#define PATTERN_PHOTURIS_VERSICOLOR( POINT, END )   \
+    POINT(  800,   60 )                             \
+    POINT(  300,   60 )                             \
+    POINT(  900,   60 )                             \
+    POINT(  300,   60 )                             \
+    POINT( 1000,   60 )                             \
+    END  (        100 )
+
+/*------------------------------------------------------------
+Every pattern
+------------------------------------------------------------*/
+#define PATTERN_LIST( PATTERN )                     \
+    PATTERN( PHOTINUS_PALLENS )                     \
+    PATTERN( PHOTINUS_LEWISI )                      \
+    PATTERN( PHOTINUS_AMPLUS )                      \
+    PATTERN( PHOTINUS_XANTHOPHOTIS )                \
+    PATTERN( PHOTURIS_JAMAICENSIS )                 \
+    PATTERN( PHOTINUS_LEUCOPYGE )                   \
+    PATTERN( PHOTURIS_LUCICRESCENS )                \
+    PATTERN( PHOTURIS_VERSICOLOR )
+
+/*------------------------------------------------------------
+Built-in pattern sets, each in flash ID order. Set 0 is the
+one flash_id_type lists.
+------------------------------------------------------------*/
+#define SET_MIXED( PATTERN, set )                   \
+    PATTERN( set, PHOTINUS_PALLENS )                \
+    PATTERN( set, PHOTINUS_LEWISI )                 \
+    PATTERN( set, PHOTINUS_AMPLUS )                 \
+    PATTERN( set, PHOTINUS_XANTHOPHOTIS )           \
+    PATTERN( set, PHOTURIS_JAMAICENSIS )            \
+    PATTERN( set, PHOTINUS_LEUCOPYGE )
+
+#define SET_PHOTINUS( PATTERN, set )                \
+    PATTERN( set, PHOTINUS_PALLENS )                \
+    PATTERN( set, PHOTINUS_LEWISI )                 \
+    PATTERN( set, PHOTINUS_AMPLUS )                 \
+    PATTERN( set, PHOTINUS_XANTHOPHOTIS )           \
+    PATTERN( set, PHOTINUS_LEUCOPYGE )
+
+#define SET_PHOTURIS( PATTERN, set )                \
+    PATTERN( set, PHOTURIS_JAMAICENSIS )            \
+    PATTERN( set, PHOTURIS_LUCICRESCENS )           \
+    PATTERN( set, PHOTURIS_VERSICOLOR )
+
+#define SET_LIST( SET )                             \
+    SET( MIXED )                                    \
+    SET( PHOTINUS )                                 \
+    SET( PHOTURIS )
+
+/*------------------------------------------------------------
+Pattern expansions
+------------------------------------------------------------*/
+#define POINT_DATA( target, time )      { ( target ), ( time ) },
+#define END_DATA( time )                { 0, ( time ) },
+#define POINT_COUNT( target, time )     + 1
+#define END_COUNT( time )               + 1
+#define POINT_LENGTH( target, time )    + ( time )
+#define END_LENGTH( time )              + ( time )
+#define POINT_ENDS( target, time )      + 0
+#define END_ENDS( time )                + 1
+#define POINT_VALID( target, time )     && ( target ) >= 0 && ( target ) <= ENVELOPE_BRIGHTNESS_MAX && ( time ) > 0
+#define END_VALID( time )               && ( time ) > 0
+
+#define pattern_count( name )           ( 0 PATTERN_##name( POINT_COUNT, END_COUNT ) )
+#define pattern_length( name )          ( 0 PATTERN_##name( POINT_LENGTH, END_LENGTH ) )
+#define pattern_ends( name )            ( 0 PATTERN_##name( POINT_ENDS, END_ENDS ) )
+#define pattern_valid( name )           ( 1 PATTERN_##name( POINT_VALID, END_VALID ) )
+
+/*------------------------------------------------------------
+Set expansions. Each set is laid out the way the store holds
+it, its pattern index followed by its packed flash points.
+------------------------------------------------------------*/
+#define SET_PATTERN_MEMBER( set, name ) flash_point_type name[ pattern_count( name ) ];
+#define SET_PATTERN_POINTS( set, name ) { PATTERN_##name( POINT_DATA, END_DATA ) },
+#define SET_PATTERN_COUNT( set, name )  + 1
+#define SET_POINT_COUNT( set, name )    + pattern_count( name )
+#define SET_PATTERN_INDEX( set, name )                                              \
+        {                                                                           \
+        offsetof( set_##set##_points_type, name ) / sizeof( flash_point_type ),    \
+        pattern_length( name ),                                                     \
+        pattern_count( name )                                                       \
+        },
+
+#define set_count( set )                ( 0 SET_##set( SET_PATTERN_COUNT, set ) )
+#define set_points( set )               ( 0 SET_##set( SET_POINT_COUNT, set ) )
+
+#define SET_TYPES( set )                                                            \
+    typedef struct                                                                  \
+    {                                                                               \
+        SET_##set( SET_PATTERN_MEMBER, set )                                        \
+    }set_##set##_points_type;                                                       \
+                                                                                    \
+    typedef struct                                                                  \
+    {                                                                               \
+        uint8_t             count;                                                  \
+        uint8_t             points;                                                 \
+        flash_pattern_type  pattern[ set_count( set ) ];                            \
+        set_##set##_points_type                                                     \
+                            point;                                                  \
+    }set_##set##_record_type;
+
+#define SET_MEMBER( set )               set_##set##_record_type set;
+#define SET_DATA( set )                                                             \
+    {                                                                               \
+    set_count( set ),                                                               \
+    set_points( set ),                                                              \
+    { SET_##set( SET_PATTERN_INDEX, set ) },                                        \
+    { SET_##set( SET_PATTERN_POINTS, set ) }                                        \
+    },
+#define SET_COUNT( set )                + 1
+#define SET_SIZE( set )                 + sizeof( set_##set##_record_type )
+
+/*------------------------------------------------------------
+Built-in store, the seed of the store page
+------------------------------------------------------------*/
+SET_LIST( SET_TYPES )
+
+typedef struct
+{
+    set_store_type      header;
+    SET_LIST( SET_MEMBER )
+}set_image_type;
+
+static const set_image_type set_builtin =
+{
+    { SET_MAGIC, 0 SET_LIST( SET_COUNT ), 0 SET_LIST( SET_SIZE ), 0 },
+    SET_LIST( SET_DATA )
+};
+
+/*------------------------------------------------------------
+Build time checks. Every pattern must end with exactly one
+END point, use brightness within range, take time on every
+segment so that point times strictly increase, and fit the
+16-bit index fields and flash times. Every set must fit a
+slot, and be laid out with no padding, as the store is read.
+The image may only pad its tail, past the records.
+------------------------------------------------------------*/
+#define PATTERN_CHECK( name )                                                       \
+    compile_assert( pattern_ends( name ) == 1, name##_ends_once );                  \
+    compile_assert( pattern_valid( name ), name##_valid_points );                   \
+    compile_assert( pattern_count( name ) <= FLASH_SEGMENTS_MAX, name##_segments ); \
+    compile_assert( pattern_length( name ) <= UINT16_MAX, name##_length );          \
+    compile_assert( pattern_length( name ) + ENVELOPE_SMOOTHING_MAX                 \
+                 <= ENVELOPE_FLASH_TIME_MAX, name##_flash_time );
+
+#define SET_CHECK( set )                                                            \
+    compile_assert( set_count( set ) <= ENVELOPE_SET_PATTERNS_MAX, set##_patterns ); \
+    compile_assert( set_points( set ) <= ENVELOPE_SET_POINTS_MAX, set##_points );   \
+    compile_assert( sizeof( set_##set##_record_type ) == sizeof( set_record_type )  \
+                 + set_count( set ) * sizeof( flash_pattern_type )                  \
+                 + set_points( set ) * sizeof( flash_point_type ), set##_layout );
+
+PATTERN_LIST( PATTERN_CHECK )
+SET_LIST( SET_CHECK )
+compile_assert( set_count( MIXED ) == FLASH_COUNT, set_flash_ids );
+compile_assert( sizeof( set_builtin ) - ( sizeof( set_store_type ) + ( 0 SET_LIST( SET_SIZE ) ) ) < sizeof( uint32_t ), set_builtin_layout );
+compile_assert( sizeof( set_builtin ) <= FLASH_PAGE_BYTES, set_builtin_size );
+compile_assert( ENVELOPE_SET_PATTERNS_MAX <= FLASH_ID_PATTERN_MASK + 1, set_flash_id_pattern );
+compile_assert( FLASH_ID_REFERENCE > FLASH_ID_PATTERN_MASK && FLASH_ID_REFERENCE < ( 1 << FLASH_ID_SLOT_SHIFT ), set_flash_id_reference );
+compile_assert( ( ENVELOPE_SET_SLOTS - 1 ) << FLASH_ID_SLOT_SHIFT <= 0xFF, set_flash_id_slot );
+compile_assert( ENVELOPE_SET_POINTS_MAX <= 0xFF, set_points_range );
+compile_assert( ENVELOPE_LUT_SAMPLES_MAX < ( 0x8000 >> ENVELOPE_LUT_SHIFT ), lut_lane_index );
+compile_assert( ( ENVELOPE_BRIGHTNESS_MAX << FIR_INPUT_SHIFT ) <= INT16_MAX, fir_input_range );
+
+/*------------------------------------------------------------
+Flash points of a stored set, and the size of its record
+------------------------------------------------------------*/
+#define set_record_points( record )     ( (const flash_point_type *)&( record )->pattern[ ( record )->count ] )
+#define set_record_size( record )       ( sizeof( set_record_type )                                 \
+                                        + ( record )->count * sizeof( flash_pattern_type )          \
+                                        + ( record )->points * sizeof( flash_point_type ) )
+
+/*------------------------------------------------------------
+Resident pattern, first flash point and segment start times
+of a flash, and its entry in the tables
+------------------------------------------------------------*/
+#define flash_slot( id )        ( &s_slots[ flash_id_slot( id ) ] )
+#define flash_pattern( id )     ( &flash_slot( id )->pattern[ (id) & FLASH_ID_PATTERN_MASK ] )
+#define pattern_points( id )    ( &flash_slot( id )->point[ flash_pattern( id )->offset ] )
+#define pattern_starts( id )    ( flash_slot( id )->segment_start[ (id) & FLASH_ID_PATTERN_MASK ] )
+#define table_index( id )       ( (id) & FLASH_ID_PATTERN_MASK )
+
+
+/*--------------------------------------------------------------------------------
+                                 GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                 STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Pattern set store in use, the page or the built-in image, and
+the resident sets
+------------------------------------------------------------*/
+static const set_store_type
+                      * s_store;
+static set_slot_type    s_slots[ ENVELOPE_SET_SLOTS ];
+
+/*------------------------------------------------------------
+Progress of the tables, which hold one slot at a time
+------------------------------------------------------------*/
+static table_build_type s_build;
+
+#if( LUT_TABLES )
+static lut_entry_type   s_lut_index[ ENVELOPE_SET_PATTERNS_MAX ][ ENVELOPE_LUT_LEVELS ];
+static uint16_t         s_lut_samples[ ENVELOPE_LUT_SAMPLES_MAX ];
+#endif
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+static integral_pattern_type
+                        s_integral[ ENVELOPE_SET_PATTERNS_MAX ];
+
+/*------------------------------------------------------------
+2^32 / ( 2 * smoothing ), rounded up, for each half width
+------------------------------------------------------------*/
+static uint32_t         s_integral_recip[ INTEGRAL_HALF_SMOOTH_MAX - INTEGRAL_HALF_SMOOTH_MIN + 1 ];
+#endif
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+/*------------------------------------------------------------
+Kernel of the smoothing level being built, and the filter
+state, FIR_BLOCK new raster samples behind the previous
+taps - 1 as arm_fir_decimate_q15() lays it out
+------------------------------------------------------------*/
+static int16_t          s_fir_coeffs[ FIR_TAPS_MAX ];
+static int16_t          s_fir_state[ FIR_TAPS_MAX + FIR_BLOCK - 1 ];
+
+#if( ENVELOPE_FIR_CMSIS_DSP )
+static arm_fir_decimate_instance_q15
+                        s_fir;
+#endif
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                    PROCEDURES
+--------------------------------------------------------------------------------*/
+
+static int32_t calculate_flash_length
+    (
+    flash_id_type   flash_type
+    );
+
+static flash_brightness_type calculate_brightness_smoothed
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing,
+    envelope_cursor_type
+                  * cursor
+    );
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+static flash_brightness_type calculate_brightness_unsmoothed
+    (
+    flash_id_type   flash_type,
+    int32_t         flash_time,
+    envelope_cursor_type
+                  * cursor
+    );
+#endif
+
+static void segment_build
+    (
+    uint32_t        slot
+    );
+
+static ramfunc flash_brightness_type segment_brightness
+    (
+    flash_id_type   flash_id,
+    uint32_t        segment,
+    int32_t         flash_time
+    );
+
+static ramfunc uint32_t segment_seek
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    envelope_cursor_type
+                  * cursor
+    );
+
+static const set_record_type * set_find
+    (
+    uint32_t        set
+    );
+
+#if( ENVELOPE_SET_STORE )
+static boolean set_record_valid
+    (
+    const set_record_type
+                  * record,
+    uint32_t        size
+    );
+
+static uint32_t set_store_checksum
+    (
+    const set_store_type
+                  * store
+    );
+
+static const set_store_type * set_store_init
+    (
+    void
+    );
+
+static boolean set_store_valid
+    (
+    const set_store_type
+                  * store
+    );
+#endif
+
+#if( LUT_TABLES )
+static boolean lut_build_slice
+    (
+    void
+    );
+
+static ramfunc flash_brightness_type lut_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    );
+
+static ramfunc uint32_t lut_level
+    (
+    int16_t         smoothing
+    );
+#endif
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+static ramfunc flash_brightness_type integral_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    );
+
+static void integral_build
+    (
+    flash_id_type   flash_id
+    );
+
+static void integral_build_recip
+    (
+    void
+    );
+
+static ramfunc int32_t integral_eval
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time
+    );
+#endif
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+static void fir_build_kernel
+    (
+    uint32_t        taps
+    );
+
+static void fir_filter
+    (
+    uint32_t        taps,
+    const int16_t * input,
+    int16_t       * output
+    );
+
+static int32_t fir_kernel_weight
+    (
+    uint32_t        tap,
+    uint32_t        taps
+    );
+
+static void fir_samples
+    (
+    const lut_entry_type
+                      * entry,
+    flash_id_type       flash_id,
+    int16_t             smoothing
+    );
+
+static void fir_start
+    (
+    const lut_entry_type
+                      * entry,
+    int16_t             smoothing
+    );
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_init
+ *
+ *  Description:
+ *      Find the pattern set store, seeding the page first if it holds
+ *      none, then load set 0 into slot 0 and build all of its tables for
+ *      the selected engine.
+ *
+ ************************************************************************/
+void envelope_init
+    (
+    void
+    )
+{
+#if( ENVELOPE_SET_STORE )
+    s_store = set_store_init();
+#else
+    s_store = &set_builtin.header;
+#endif
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+    integral_build_recip();
+#endif
+
+    s_build.slot = SET_SLOT_NONE;
+    envelope_set_load( 0, 0 );
+    while( !envelope_set_build( 0 ) );
+
+}   /* envelope_init() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_brightness
+ *
+ *  Description:
+ *      Get the smoothed brightness of a flash pattern at a specified
+ *      flash time using the selected envelope engine, or the reference
+ *      integration for a flash drawn before its tables were ready.
+ *
+ ************************************************************************/
+ramfunc flash_brightness_type envelope_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing,
+    envelope_cursor_type
+                  * cursor
+    )
+{
+#if( ENVELOPE_ENGINE != ENVELOPE_ENGINE_REFERENCE )
+    if( flash_id & FLASH_ID_REFERENCE )
+    {
+        return( calculate_brightness_smoothed( flash_id, flash_time, smoothing, cursor ) );
+    }
+#endif
+
+#if( LUT_TABLES )
+    return( lut_brightness( flash_id, flash_time, smoothing ) );
+#elif( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+    return( integral_brightness( flash_id, flash_time, smoothing ) );
+#else
+    return( calculate_brightness_smoothed( flash_id, flash_time, smoothing, cursor ) );
+#endif
+
+}   /* envelope_brightness() */
+
+
+#if( ENVELOPE_SIMD )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_brightness_batch
+ *
+ *  Description:
+ *      Get the smoothed brightness of every entry set in mask, two
+ *      entries per word. All arrays must be word aligned. A pair is
+ *      skipped only when neither of its entries is set, so both lanes of
+ *      a visited pair are written, unless either is on the reference
+ *      engine, whose pattern may have been swapped out since. Agrees with
+ *      envelope_brightness() exactly, off-grid times, flashes on the
+ *      reference engine and other engines use it directly.
+ *
+ ************************************************************************/
+ramfunc void envelope_brightness_batch
+    (
+    const flash_id_type   * flash_id,
+    const int16_t         * flash_time,
+    const uint16_t        * smoothing,
+    uint16_t              * brightness,
+    envelope_cursor_type  * cursor,
+    uint32_t                mask,
+    uint32_t                count
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t                pair;
+    uint32_t                lane;
+#if( LUT_TABLES )
+    const envelope_pair_type
+                          * time_pair;
+    envelope_pair_type    * brightness_pair;
+    const lut_entry_type  * entry_0;
+    const lut_entry_type  * entry_1;
+    uint32_t                offset;
+    uint32_t                index;
+    uint32_t                in_range;
+    uint32_t                sample_0;
+    uint32_t                sample_1;
+#endif
+
+#if( LUT_TABLES )
+    time_pair = (const envelope_pair_type *)flash_time;
+    brightness_pair = (envelope_pair_type *)brightness;
+#endif
+
+    for( pair = 0; pair < count / 2; pair++ )
+    {
+        lane = 2 * pair;
+        if( ( ( mask >> lane ) & 3 ) == 0 )
+        {
+            continue;
+        }
+
+#if( LUT_TABLES )
+        if( ( flash_id[ lane ] | flash_id[ lane + 1 ] ) & FLASH_ID_REFERENCE )
+        {
+            for( ; lane < 2 * pair + 2; lane++ )
+            {
+                if( mask & ( (uint32_t)1 << lane ) )
+                {
+                    brightness[ lane ] = envelope_brightness( flash_id[ lane ], flash_time[ lane ], smoothing[ lane ], &cursor[ lane ] );
+                }
+            }
+            continue;
+        }
+
+        /*----------------------------------------------------
+        Offset both times from their table origins, and clear
+        the index of any lane that falls outside its table
+        ----------------------------------------------------*/
+        entry_0 = &s_lut_index[ table_index( flash_id[ lane ] ) ][ lut_level( smoothing[ lane ] ) ];
+        entry_1 = &s_lut_index[ table_index( flash_id[ lane + 1 ] ) ][ lut_level( smoothing[ lane + 1 ] ) ];
+        offset = __QSUB16( time_pair[ pair ], __PKHBT( entry_0->origin, entry_1->origin, 16 ) );
+        index = ( offset >> ENVELOPE_LUT_SHIFT ) & LUT_LANE_INDEX_MASK;
+
+        in_range = envelope_sel_uge16( index, __PKHBT( entry_0->count, entry_1->count, 16 ), 0, 0xFFFFFFFF );
+
+        /*----------------------------------------------------
+        Times between samples interpolate, which only happens
+        off the firefly time step
+        ----------------------------------------------------*/
+        if( offset & in_range & LUT_LANE_FRAC_MASK )
+        {
+            brightness[ lane ] = lut_brightness( flash_id[ lane ], flash_time[ lane ], smoothing[ lane ] );
+            brightness[ lane + 1 ] = lut_brightness( flash_id[ lane + 1 ], flash_time[ lane + 1 ], smoothing[ lane + 1 ] );
+            continue;
+        }
+
+        index &= in_range;
+        sample_0 = ( in_range & 0x0000FFFF ) ? s_lut_samples[ entry_0->offset + ( index & 0xFFFF ) ] : 0;
+        sample_1 = ( in_range & 0xFFFF0000 ) ? s_lut_samples[ entry_1->offset + ( index >> 16 ) ] : 0;
+        brightness_pair[ pair ] = __PKHBT( sample_0, sample_1, 16 );
+#else
+        brightness[ lane ] = envelope_brightness( flash_id[ lane ], flash_time[ lane ], smoothing[ lane ], &cursor[ lane ] );
+        brightness[ lane + 1 ] = envelope_brightness( flash_id[ lane + 1 ], flash_time[ lane + 1 ], smoothing[ lane + 1 ], &cursor[ lane + 1 ] );
+#endif
+    }
+
+}   /* envelope_brightness_batch() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_brightness_hold
+ *
+ *  Description:
+ *      Get how many ms past flash_time the smoothed brightness stays
+ *      exactly as it is at flash_time, or 0 if it may change sooner. Only
+ *      plateaus, where the whole smoothing window sits on a flat run of
+ *      the pattern, hold. The LUT engines read samples on either side of
+ *      a time between them, so both must lie on the plateau. Smoothing
+ *      must be quantized, as flashes are started with, for the samples to
+ *      lie on the grid from -( smoothing / 2 ).
+ *
+ ************************************************************************/
+ramfunc int32_t envelope_brightness_hold
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const flash_point_type
+                  * points;
+    const uint16_t
+                  * segment_start;
+    envelope_cursor_type
+                    cursor;
+    uint32_t        count;
+    uint32_t        i;
+    int32_t         half_smooth;
+    int32_t         first;
+    int32_t         last;
+    int32_t         prv_target;
+#if( LUT_TABLES )
+    int32_t         origin;
+#endif
+
+    half_smooth = smoothing >> 1;
+    first = flash_time;
+#if( LUT_TABLES )
+    origin = -( smoothing / 2 );
+    first -= ( flash_time - origin ) & ( ENVELOPE_LUT_RESOLUTION - 1 );
+#endif
+
+    /*--------------------------------------------------------
+    Find the segment under the start of the earliest window
+    read, which must be flat
+    --------------------------------------------------------*/
+    first -= half_smooth;
+    if( first < 0 )
+    {
+        return( 0 );
+    }
+
+    cursor = ENVELOPE_CURSOR_START;
+    i = segment_seek( flash_id, first, &cursor );
+    count = flash_pattern( flash_id )->count;
+    if( i >= count )
+    {
+        return( 0 );
+    }
+
+    points = pattern_points( flash_id );
+    prv_target = i ? points[ i - 1 ].target : 0;
+    if( points[ i ].target != prv_target )
+    {
+        return( 0 );
+    }
+
+    /*--------------------------------------------------------
+    Run on through flat segments at the same level, and keep
+    the end of the latest window read inside the run
+    --------------------------------------------------------*/
+    while( i + 1 < count
+        && points[ i + 1 ].target == points[ i ].target )
+    {
+        i++;
+    }
+
+    segment_start = pattern_starts( flash_id );
+    last = segment_start[ i + 1 ] - half_smooth - 1;
+#if( LUT_TABLES )
+    last -= ( last - origin ) & ( ENVELOPE_LUT_RESOLUTION - 1 );
+#endif
+
+    return( max_val( last - flash_time, 0 ) );
+
+}   /* envelope_brightness_hold() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_brightness_reference
+ *
+ *  Description:
+ *      Get the smoothed brightness of a flash pattern using the reference
+ *      integration, regardless of the selected engine.
+ *
+ ************************************************************************/
+flash_brightness_type envelope_brightness_reference
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    envelope_cursor_type
+                    cursor;
+
+    cursor = ENVELOPE_CURSOR_START;
+
+    return( calculate_brightness_smoothed( flash_id, flash_time, smoothing, &cursor ) );
+
+}   /* envelope_brightness_reference() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_flash_length
+ *
+ *  Description:
+ *      Get the unsmoothed run time of a given flash pattern.
+ *
+ ************************************************************************/
+int32_t envelope_flash_length
+    (
+    flash_id_type   flash_id
+    )
+{
+    return( calculate_flash_length( flash_id ) );
+
+}   /* envelope_flash_length() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_flash_peak
+ *
+ *  Description:
+ *      Get the highest brightness of a given flash pattern. Smoothing
+ *      averages the pattern, so no smoothed flash is brighter.
+ *
+ ************************************************************************/
+int32_t envelope_flash_peak
+    (
+    flash_id_type   flash_id
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const flash_point_type
+                  * points;
+    uint32_t        i;
+    int32_t         peak;
+
+    points = pattern_points( flash_id );
+    peak = 0;
+    for( i = 0; i < flash_pattern( flash_id )->count; i++ )
+    {
+        peak = max_val( peak, points[ i ].target );
+    }
+
+    return( peak );
+
+}   /* envelope_flash_peak() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_set_build
+ *
+ *  Description:
+ *      Build a slice of the tables of the set in a slot, starting them
+ *      over if they were for another, and return TRUE once they are
+ *      ready. Every flash still reading the tables must be of the slot
+ *      built for. A slice is at most BUILD_SLICE_SAMPLES LUT samples, or
+ *      one pattern of the integral engine.
+ *
+ ************************************************************************/
+boolean envelope_set_build
+    (
+    uint32_t        slot
+    )
+{
+    if( slot != s_build.slot )
+    {
+        clear_struct( s_build );
+        s_build.slot = slot;
+    }
+
+    if( !s_build.ready )
+    {
+#if( LUT_TABLES )
+        s_build.ready = lut_build_slice();
+#elif( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+        if( s_build.pattern < s_slots[ slot ].count )
+        {
+            integral_build( ( slot << FLASH_ID_SLOT_SHIFT ) | s_build.pattern++ );
+        }
+        s_build.ready = ( s_build.pattern >= s_slots[ slot ].count );
+#else
+        s_build.ready = TRUE;
+#endif
+    }
+
+    return( s_build.ready );
+
+}   /* envelope_set_build() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_set_count
+ *
+ *  Description:
+ *      Get the number of pattern sets in the store.
+ *
+ ************************************************************************/
+uint32_t envelope_set_count
+    (
+    void
+    )
+{
+    return( s_store->count );
+
+}   /* envelope_set_count() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_set_flash
+ *
+ *  Description:
+ *      Get the flash ID of a pattern of the set in a slot. A flash drawn
+ *      before the tables of its slot are ready is marked to run on the
+ *      reference engine to its end.
+ *
+ ************************************************************************/
+flash_id_type envelope_set_flash
+    (
+    uint32_t        slot,
+    uint32_t        pattern
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    flash_id_type   flash_id;
+
+    flash_id = ( slot << FLASH_ID_SLOT_SHIFT ) | pattern;
+    if( slot != s_build.slot
+     || !s_build.ready )
+    {
+        flash_id |= FLASH_ID_REFERENCE;
+    }
+
+    return( flash_id );
+
+}   /* envelope_set_flash() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_set_load
+ *
+ *  Description:
+ *      Copy a set from the store into a slot, and return FALSE if there
+ *      is no such set. No flash may still run on the slot. Tables built
+ *      for it are dropped, to be built again for the new set.
+ *
+ ************************************************************************/
+boolean envelope_set_load
+    (
+    uint32_t        slot,
+    uint32_t        set
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const set_record_type
+                      * record;
+    set_slot_type     * resident;
+
+    record = set_find( set );
+    if( record == NULL
+     || slot >= ENVELOPE_SET_SLOTS )
+    {
+        return( FALSE );
+    }
+
+    if( slot == s_build.slot )
+    {
+        s_build.slot = SET_SLOT_NONE;
+    }
+
+    resident = &s_slots[ slot ];
+    resident->count = record->count;
+    memcpy( resident->pattern, record->pattern, record->count * sizeof( flash_pattern_type ) );
+    memcpy( resident->point, set_record_points( record ), record->points * sizeof( flash_point_type ) );
+    segment_build( slot );
+
+    return( TRUE );
+
+}   /* envelope_set_load() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_set_patterns
+ *
+ *  Description:
+ *      Get the number of patterns of the set in a slot.
+ *
+ ************************************************************************/
+uint32_t envelope_set_patterns
+    (
+    uint32_t        slot
+    )
+{
+    return( s_slots[ slot ].count );
+
+}   /* envelope_set_patterns() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      envelope_smoothing_quantize
+ *
+ *  Description:
+ *      Snap a smoothing width to one the selected engine evaluates
+ *      exactly. Flashes should be started with the returned width.
+ *
+ ************************************************************************/
+int16_t envelope_smoothing_quantize
+    (
+    int16_t         smoothing
+    )
+{
+#if( LUT_TABLES )
+    return( ENVELOPE_SMOOTHING_MIN + lut_level( smoothing ) * LUT_LEVEL_STEP );
+#else
+    return( smoothing );
+#endif
+
+}   /* envelope_smoothing_quantize() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      calculate_flash_length
+ *
+ *  Description:
+ *      Get the full run time of a given flash pattern, stored in the
+ *      pattern index.
+ *
+ ************************************************************************/
+static int32_t calculate_flash_length
+    (
+    flash_id_type   flash_type
+    )
+{
+    return( flash_pattern( flash_type )->length );
+
+} /* calculate_flash_length() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      calculate_brightness_smoothed
+ *
+ *  Description:
+ *      Calculate the smoothed brightness of a given flash type at a
+ *      specified flash time. The segments under the smoothing window are
+ *      visited from the one the cursor finds for the window start.
+ *
+ ************************************************************************/
+static flash_brightness_type calculate_brightness_smoothed
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing,
+    envelope_cursor_type
+                  * cursor
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    flash_brightness_type   brightness;
+    int32_t                 flash_length;
+    const uint16_t        * segment_start;
+    int32_t                 half_smooth;
+    int32_t                 smooth_start;
+    int32_t                 smooth_end;
+    uint32_t                i;
+    int32_t                 b1;
+    int32_t                 b2;
+    int32_t                 t1;
+    int32_t                 t2;
+
+    /*--------------------------------------------------------
+    Calculate smoothing period.
+    --------------------------------------------------------*/
+    half_smooth = smoothing >> 1;
+    smoothing = ( half_smooth << 1 ) + 1;
+    smooth_start = flash_time - half_smooth;
+    smooth_end = smooth_start + smoothing;
+
+    /*--------------------------------------------------------
+    Calculate flash length.
+    --------------------------------------------------------*/
+    flash_length = calculate_flash_length( flash_id );
+
+    /*--------------------------------------------------------
+    Confirm smoothing windows contains flash activity.
+    --------------------------------------------------------*/
+    if( smooth_end < 0
+     || smooth_start > flash_length )
+    {
+        /*----------------------------------------------------
+        Smoothing window does not overlap active flash range.
+        ----------------------------------------------------*/
+        return( 0 );
+    }
+
+    /*--------------------------------------------------------
+    Calculate average brightness over smoothing window.
+    --------------------------------------------------------*/
+    brightness = 0;
+    segment_start = pattern_starts( flash_id );
+    for( i = segment_seek( flash_id, max_val( smooth_start, 0 ), cursor ); i < flash_pattern( flash_id )->count; i++ )
+    {
+        /*----------------------------------------------------
+        Add weighted brightness for the part of the segment
+        under the window. The pattern is continuous, so its
+        end point may be evaluated within the segment.
+        ----------------------------------------------------*/
+        t1 = max_val( smooth_start, segment_start[ i ] );
+        t2 = min_val( segment_start[ i + 1 ], smooth_end );
+        b1 = segment_brightness( flash_id, i, t1 );
+        b2 = segment_brightness( flash_id, i, t2 );
+        brightness += (b2 + b1) * (t2 - t1);
+
+        /*----------------------------------------------------
+        Increment start time if smoothing period is not over.
+        ----------------------------------------------------*/
+        if( t2 == smooth_end )
+        {
+            break;
+        }
+    }
+    brightness /= 2 * smoothing;
+
+    return( brightness );
+
+} /* calculate_brightness_smoothed() */
+
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      calculate_brightness_unsmoothed
+ *
+ *  Description:
+ *      Calculate the unsmoothed brightness of a given flash type at a
+ *      given flash time.
+ *
+ ************************************************************************/
+static flash_brightness_type calculate_brightness_unsmoothed
+    (
+    flash_id_type   flash_type,
+    int32_t         flash_time,
+    envelope_cursor_type
+                  * cursor
+    )
+{
+    /*--------------------------------------------------------
+    Validate input
+    --------------------------------------------------------*/
+    if( flash_time < 0 )
+    {
+        return( 0 );
+    }
+
+    return( segment_brightness( flash_type, segment_seek( flash_type, flash_time, cursor ), flash_time ) );
+
+} /* calculate_brightness_unsmoothed() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      segment_build
+ *
+ *  Description:
+ *      Accumulate the segment start times of every pattern of the set in
+ *      a slot.
+ *
+ ************************************************************************/
+static void segment_build
+    (
+    uint32_t        slot
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const flash_point_type    * points;
+    uint16_t                  * segment_start;
+    flash_id_type               flash_id;
+    uint32_t                    i;
+
+    for( flash_id = slot << FLASH_ID_SLOT_SHIFT; table_index( flash_id ) < s_slots[ slot ].count; flash_id++ )
+    {
+        points = pattern_points( flash_id );
+        segment_start = pattern_starts( flash_id );
+        segment_start[ 0 ] = 0;
+        for( i = 0; i < flash_pattern( flash_id )->count; i++ )
+        {
+            segment_start[ i + 1 ] = segment_start[ i ] + points[ i ].time;
+        }
+    }
+
+}   /* segment_build() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      segment_brightness
+ *
+ *  Description:
+ *      Get the unsmoothed brightness at a flash time within, or at the
+ *      end of, a given segment. Past the last segment the flash is dark.
+ *
+ ************************************************************************/
+static ramfunc flash_brightness_type segment_brightness
+    (
+    flash_id_type   flash_id,
+    uint32_t        segment,
+    int32_t         flash_time
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const flash_point_type    * flash_point;
+    int32_t                     prv_target;
+    int32_t                     remaining;
+
+    if( segment >= flash_pattern( flash_id )->count )
+    {
+        return( 0 );
+    }
+
+    flash_point = &pattern_points( flash_id )[ segment ];
+    prv_target = segment ? flash_point[ -1 ].target : 0;
+    remaining = pattern_starts( flash_id )[ segment + 1 ] - flash_time;
+
+    return( ( flash_point->time - remaining ) * ( flash_point->target - prv_target ) / flash_point->time + prv_target );
+
+}   /* segment_brightness() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      segment_seek
+ *
+ *  Description:
+ *      Move a cursor to the segment holding a non-negative flash time,
+ *      or past the last segment once the flash is over, and return it.
+ *
+ ************************************************************************/
+static ramfunc uint32_t segment_seek
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    envelope_cursor_type
+                  * cursor
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const uint16_t    * segment_start;
+    uint32_t            count;
+    uint32_t            segment;
+
+    segment_start = pattern_starts( flash_id );
+    count = flash_pattern( flash_id )->count;
+    segment = min_val( *cursor, count );
+
+    while( segment > 0
+        && flash_time < segment_start[ segment ] )
+    {
+        segment--;
+    }
+
+    while( segment < count
+        && flash_time >= segment_start[ segment + 1 ] )
+    {
+        segment++;
+    }
+
+    *cursor = segment;
+
+    return( segment );
+
+}   /* segment_seek() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      set_find
+ *
+ *  Description:
+ *      Get the record of a set in the store, or NULL if there is no such
+ *      set.
+ *
+ ************************************************************************/
+static const set_record_type * set_find
+    (
+    uint32_t        set
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const set_record_type
+                  * record;
+    uint32_t        i;
+
+    if( set >= s_store->count )
+    {
+        return( NULL );
+    }
+
+    record = (const set_record_type *)( s_store + 1 );
+    for( i = 0; i < set; i++ )
+    {
+        record = (const set_record_type *)( (const uint8_t *)record + set_record_size( record ) );
+    }
+
+    return( record );
+
+}   /* set_find() */
+
+
+#if( ENVELOPE_SET_STORE )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      set_record_valid
+ *
+ *  Description:
+ *      Check that a stored set fits in size bytes and a slot, and that
+ *      every pattern of it meets the build time checks of the built-in
+ *      patterns.
+ *
+ ************************************************************************/
+static boolean set_record_valid
+    (
+    const set_record_type
+                  * record,
+    uint32_t        size
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const flash_pattern_type
+                  * pattern;
+    const flash_point_type
+                  * points;
+    uint32_t        length;
+    uint32_t        i;
+    uint32_t        j;
+
+    if( size < sizeof( set_record_type )
+     || record->count == 0
+     || record->count > ENVELOPE_SET_PATTERNS_MAX
+     || record->points > ENVELOPE_SET_POINTS_MAX
+     || set_record_size( record ) > size )
+    {
+        return( FALSE );
+    }
+
+    for( i = 0; i < record->count; i++ )
+    {
+        pattern = &record->pattern[ i ];
+        if( pattern->count == 0
+         || pattern->count > FLASH_SEGMENTS_MAX
+         || pattern->offset + pattern->count > record->points )
+        {
+            return( FALSE );
+        }
+
+        /*----------------------------------------------------
+        The last point must be the END point
+        ----------------------------------------------------*/
+        points = &set_record_points( record )[ pattern->offset ];
+        length = 0;
+        for( j = 0; j < pattern->count; j++ )
+        {
+            if( points[ j ].time == 0
+             || points[ j ].target > ENVELOPE_BRIGHTNESS_MAX
+             || ( j + 1 == pattern->count && points[ j ].target != 0 ) )
+            {
+                return( FALSE );
+            }
+            length += points[ j ].time;
+        }
+
+        if( length != pattern->length
+         || length + ENVELOPE_SMOOTHING_MAX > ENVELOPE_FLASH_TIME_MAX )
+        {
+            return( FALSE );
+        }
+    }
+
+    return( TRUE );
+
+}   /* set_record_valid() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      set_store_checksum
+ *
+ *  Description:
+ *      Get the checksum of a store, the inverted sum of every halfword of
+ *      its set records. Records are whole halfwords.
+ *
+ ************************************************************************/
+static uint32_t set_store_checksum
+    (
+    const set_store_type
+                  * store
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const uint16_t    * halfwords;
+    uint32_t            sum;
+    uint32_t            i;
+
+    halfwords = (const uint16_t *)( store + 1 );
+    sum = 0;
+    for( i = 0; i < store->size / sizeof( uint16_t ); i++ )
+    {
+        sum += halfwords[ i ];
+    }
+
+    return( ~sum );
+
+}   /* set_store_checksum() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      set_store_init
+ *
+ *  Description:
+ *      Get the store in the flash page. A blank or invalid page is
+ *      replaced with the built-in sets, which are used from the image if
+ *      they cannot be stored, as when the firmware image reaches the page.
+ *
+ ************************************************************************/
+static const set_store_type * set_store_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const set_store_type
+                  * stored;
+    set_image_type  image;
+
+    stored = system_flash_spare_page( ENVELOPE_SET_FLASH_PAGE );
+    if( stored == NULL )
+    {
+        return( &set_builtin.header );
+    }
+
+    if( set_store_valid( stored ) )
+    {
+        return( stored );
+    }
+
+    image = set_builtin;
+    image.header.checksum = set_store_checksum( &image.header );
+    if( system_flash_write_page( stored, &image, sizeof( image ) ) )
+    {
+        return( stored );
+    }
+
+    return( &set_builtin.header );
+
+}   /* set_store_init() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      set_store_valid
+ *
+ *  Description:
+ *      Check a store's header and checksum, and every set it holds.
+ *
+ ************************************************************************/
+static boolean set_store_valid
+    (
+    const set_store_type
+                  * store
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const uint8_t * record;
+    uint32_t        remaining;
+    uint32_t        i;
+
+    if( store->magic != SET_MAGIC
+     || store->count == 0
+     || store->size > FLASH_PAGE_BYTES - sizeof( *store )
+     || ( store->size % sizeof( uint16_t ) ) != 0
+     || store->checksum != set_store_checksum( store ) )
+    {
+        return( FALSE );
+    }
+
+    record = (const uint8_t *)( store + 1 );
+    remaining = store->size;
+    for( i = 0; i < store->count; i++ )
+    {
+        if( !set_record_valid( (const set_record_type *)record, remaining ) )
+        {
+            return( FALSE );
+        }
+        remaining -= set_record_size( (const set_record_type *)record );
+        record += set_record_size( (const set_record_type *)record );
+    }
+
+    return( TRUE );
+
+}   /* set_store_valid() */
+#endif
+
+
+#if( LUT_TABLES )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      lut_build_slice
+ *
+ *  Description:
+ *      Sample the reference envelope of the slot being built, or its FIR
+ *      filtered equivalent, for the next entry of every flash pattern and
+ *      smoothing level, at most BUILD_SLICE_SAMPLES at a time. Samples
+ *      are aligned to the flash times a firefly stepping at
+ *      ENVELOPE_LUT_RESOLUTION will actually visit, starting from
+ *      -( smoothing / 2 ). Returns TRUE once every entry is built.
+ *
+ ************************************************************************/
+static boolean lut_build_slice
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    lut_entry_type    * entry;
+    flash_id_type       flash_id;
+    int32_t             flash_length;
+    int16_t             smoothing;
+    uint32_t            count;
+#if( ENVELOPE_ENGINE != ENVELOPE_ENGINE_FIR )
+    uint32_t            i;
+#endif
+
+    if( s_build.pattern >= s_slots[ s_build.slot ].count )
+    {
+        return( TRUE );
+    }
+
+    flash_id = ( s_build.slot << FLASH_ID_SLOT_SHIFT ) | s_build.pattern;
+    smoothing = ENVELOPE_SMOOTHING_MIN + s_build.level * LUT_LEVEL_STEP;
+    entry = &s_lut_index[ s_build.pattern ][ s_build.level ];
+
+    if( s_build.done == 0 )
+    {
+        /*----------------------------------------------------
+        The envelope is non-zero until the smoothing window has
+        fully passed the end of the flash.
+        ----------------------------------------------------*/
+        flash_length = calculate_flash_length( flash_id );
+        entry->origin = -( smoothing / 2 );
+        count = ( ( flash_length + ( smoothing / 2 ) - entry->origin ) >> ENVELOPE_LUT_SHIFT ) + 1;
+
+        /*----------------------------------------------------
+        Truncate if the sample buffer is exhausted, the missing
+        tail then reads as dark.
+        ----------------------------------------------------*/
+        count = min_val( count, count_of_array( s_lut_samples ) - s_build.offset );
+        entry->offset = s_build.offset;
+        entry->count = count;
+        s_build.cursor = ENVELOPE_CURSOR_START;
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+        fir_start( entry, smoothing );
+#endif
+    }
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+    fir_samples( entry, flash_id, smoothing );
+#else
+    for( i = 0; i < BUILD_SLICE_SAMPLES && s_build.done < entry->count; i++ )
+    {
+        s_lut_samples[ entry->offset + s_build.done ] = calculate_brightness_smoothed( flash_id, entry->origin + ( s_build.done << ENVELOPE_LUT_SHIFT ), smoothing, &s_build.cursor );
+        s_build.done++;
+    }
+#endif
+
+    /*--------------------------------------------------------
+    Move on to the next entry once this one is complete
+    --------------------------------------------------------*/
+    if( s_build.done >= entry->count )
+    {
+        s_build.offset += entry->count;
+        s_build.done = 0;
+        if( ++s_build.level >= ENVELOPE_LUT_LEVELS )
+        {
+            s_build.level = 0;
+            s_build.pattern++;
+        }
+    }
+
+    return( s_build.pattern >= s_slots[ s_build.slot ].count );
+
+}   /* lut_build_slice() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      lut_brightness
+ *
+ *  Description:
+ *      Read the smoothed brightness from the envelope tables. Times that
+ *      fall between samples are linearly interpolated.
+ *
+ ************************************************************************/
+static ramfunc flash_brightness_type lut_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const lut_entry_type  * entry;
+    const uint16_t        * sample;
+    flash_brightness_type   brightness;
+    flash_brightness_type   next;
+    int32_t                 offset_time;
+    uint32_t                i;
+    uint32_t                frac;
+
+    /*--------------------------------------------------------
+    Locate sample preceding flash_time
+    --------------------------------------------------------*/
+    entry = &s_lut_index[ table_index( flash_id ) ][ lut_level( smoothing ) ];
+    offset_time = flash_time - entry->origin;
+    if( offset_time < 0 )
+    {
+        return( 0 );
+    }
+
+    i = offset_time >> ENVELOPE_LUT_SHIFT;
+    if( i >= entry->count )
+    {
+        return( 0 );
+    }
+
+    sample = &s_lut_samples[ entry->offset + i ];
+    brightness = sample[ 0 ];
+
+    /*--------------------------------------------------------
+    Interpolate towards the next sample when off the grid
+    --------------------------------------------------------*/
+    frac = offset_time & ( ENVELOPE_LUT_RESOLUTION - 1 );
+    if( frac )
+    {
+        next = ( i + 1 < entry->count ) ? sample[ 1 ] : 0;
+        brightness += ( ( next - brightness ) * (int32_t)frac ) >> ENVELOPE_LUT_SHIFT;
+    }
+
+    return( brightness );
+
+}   /* lut_brightness() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      lut_level
+ *
+ *  Description:
+ *      Get the nearest LUT smoothing level for a smoothing width.
+ *
+ ************************************************************************/
+static ramfunc uint32_t lut_level
+    (
+    int16_t         smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Clamp before rounding so the divide stays unsigned.
+    --------------------------------------------------------*/
+    smoothing = limit_val( smoothing, ENVELOPE_SMOOTHING_MIN, ENVELOPE_SMOOTHING_MAX );
+
+    return( (uint32_t)( smoothing - ENVELOPE_SMOOTHING_MIN + LUT_LEVEL_STEP / 2 ) / LUT_LEVEL_STEP );
+
+}   /* lut_level() */
+#endif
+
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_INTEGRAL )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      integral_brightness
+ *
+ *  Description:
+ *      Calculate the smoothed brightness as the difference of the
+ *      cumulative integral across the smoothing window. Agrees with
+ *      calculate_brightness_smoothed() to within its end point truncation
+ *      for any smoothing width between ENVELOPE_SMOOTHING_MIN and _MAX.
+ *      The window average is taken with a reciprocal multiply.
+ *
+ ************************************************************************/
+static ramfunc flash_brightness_type integral_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const integral_pattern_type
+                  * integral;
+    int32_t         half_smooth;
+    int32_t         smooth_start;
+    int32_t         smooth_end;
+    uint32_t        area;
+
+    /*--------------------------------------------------------
+    Calculate smoothing period.
+    --------------------------------------------------------*/
+    half_smooth = limit_val( smoothing >> 1, INTEGRAL_HALF_SMOOTH_MIN, INTEGRAL_HALF_SMOOTH_MAX );
+    smoothing = ( half_smooth << 1 ) + 1;
+    smooth_start = flash_time - half_smooth;
+    smooth_end = smooth_start + smoothing;
+
+    /*--------------------------------------------------------
+    Confirm smoothing windows contains flash activity.
+    --------------------------------------------------------*/
+    integral = &s_integral[ table_index( flash_id ) ];
+    if( smooth_end < 0
+     || smooth_start > integral->start[ integral->count ] )
+    {
+        return( 0 );
+    }
+
+    /*--------------------------------------------------------
+    The pattern is never negative, so the area is unsigned and
+    small enough for the rounded up reciprocal to divide it
+    exactly.
+    --------------------------------------------------------*/
+    area = integral_eval( flash_id, smooth_end ) - integral_eval( flash_id, smooth_start );
+
+    return( (flash_brightness_type)( ( (uint64_t)area * s_integral_recip[ half_smooth - INTEGRAL_HALF_SMOOTH_MIN ] ) >> 32 ) );
+
+}   /* integral_brightness() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      integral_build
+ *
+ *  Description:
+ *      Accumulate segment start times, slopes and doubled integrals of a
+ *      flash pattern. The final entry holds the flash length and the
+ *      integral of the whole flash.
+ *
+ ************************************************************************/
+static void integral_build
+    (
+    flash_id_type   flash_id
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    integral_pattern_type     * integral;
+    const flash_point_type    * points;
+    flash_brightness_type       prv_target;
+    int32_t                     delta;
+    uint32_t                    i;
+
+    integral = &s_integral[ table_index( flash_id ) ];
+    points = pattern_points( flash_id );
+
+    integral->start[ 0 ] = 0;
+    integral->integral[ 0 ] = 0;
+    prv_target = 0;
+    for( i = 0; i < flash_pattern( flash_id )->count; i++ )
+    {
+        integral->start[ i + 1 ] = integral->start[ i ] + points[ i ].time;
+        integral->integral[ i + 1 ] = integral->integral[ i ] + ( prv_target + points[ i ].target ) * points[ i ].time;
+
+        /*----------------------------------------------------
+        Round the slope to nearest
+        ----------------------------------------------------*/
+        delta = ( points[ i ].target - prv_target ) << INTEGRAL_SLOPE_SHIFT;
+        delta += ( delta < 0 ) ? -( points[ i ].time / 2 ) : ( points[ i ].time / 2 );
+        integral->slope[ i ] = delta / points[ i ].time;
+
+        prv_target = points[ i ].target;
+    }
+    integral->count = i;
+
+}   /* integral_build() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      integral_build_recip
+ *
+ *  Description:
+ *      Build the smoothing width reciprocals, so that all divides happen
+ *      at build time.
+ *
+ ************************************************************************/
+static void integral_build_recip
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t        i;
+
+    for( i = 0; i < count_of_array( s_integral_recip ); i++ )
+    {
+        s_integral_recip[ i ] = (uint32_t)( 0xFFFFFFFF / ( 2 * ( 2 * ( i + INTEGRAL_HALF_SMOOTH_MIN ) + 1 ) ) ) + 1;
+    }
+
+}   /* integral_build_recip() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      integral_eval
+ *
+ *  Description:
+ *      Get the doubled integral of the unsmoothed flash pattern from the
+ *      start of the flash to flash_time.
+ *
+ ************************************************************************/
+static ramfunc int32_t integral_eval
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const integral_pattern_type
+                              * integral;
+    flash_brightness_type       prv_target;
+    int32_t                     elapsed;
+    uint32_t                    lo;
+    uint32_t                    hi;
+    uint32_t                    mid;
+
+    integral = &s_integral[ table_index( flash_id ) ];
+
+    /*--------------------------------------------------------
+    Pattern is dark outside of the flash.
+    --------------------------------------------------------*/
+    if( flash_time <= 0 )
+    {
+        return( 0 );
+    }
+    else if( flash_time >= integral->start[ integral->count ] )
+    {
+        return( integral->integral[ integral->count ] );
+    }
+
+    /*--------------------------------------------------------
+    Binary search for the segment containing flash_time.
+    --------------------------------------------------------*/
+    lo = 0;
+    hi = integral->count;
+    while( hi - lo > 1 )
+    {
+        mid = ( lo + hi ) >> 1;
+        if( integral->start[ mid ] <= flash_time )
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    /*--------------------------------------------------------
+    Add the exact integral from the segment start to
+    flash_time. Truncating the end point brightness here would
+    scale its error with the time into the segment.
+    --------------------------------------------------------*/
+    prv_target = lo ? pattern_points( flash_id )[ lo - 1 ].target : 0;
+    elapsed = flash_time - integral->start[ lo ];
+
+    return( integral->integral[ lo ]
+          + 2 * prv_target * elapsed
+          + (int32_t)( ( (int64_t)( elapsed * elapsed ) * integral->slope[ lo ] + ( 1 << ( INTEGRAL_SLOPE_SHIFT - 1 ) ) ) >> INTEGRAL_SLOPE_SHIFT ) );
+
+}   /* integral_eval() */
+#endif
+
+
+#if( ENVELOPE_ENGINE == ENVELOPE_ENGINE_FIR )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      fir_build_kernel
+ *
+ *  Description:
+ *      Build the q15 smoothing kernel for a given number of taps, one
+ *      more than the smoothing window. Taps are rounded from the running
+ *      sum, so the kernel sums to exactly one and flat stretches of a
+ *      pattern pass through unchanged.
+ *
+ ************************************************************************/
+static void fir_build_kernel
+    (
+    uint32_t        taps
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    int64_t         total;
+    int64_t         sum;
+    int32_t         prv;
+    int32_t         cur;
+    uint32_t        i;
+
+    total = 0;
+    for( i = 0; i < taps; i++ )
+    {
+        total += fir_kernel_weight( i, taps );
+    }
+
+    sum = 0;
+    prv = 0;
+    for( i = 0; i < taps; i++ )
+    {
+        sum += fir_kernel_weight( i, taps );
+        cur = (int32_t)( ( sum * FIR_Q15_ONE + total / 2 ) / total );
+        s_fir_coeffs[ i ] = cur - prv;
+        prv = cur;
+    }
+
+}   /* fir_build_kernel() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      fir_filter
+ *
+ *  Description:
+ *      Filter FIR_BLOCK raster samples and decimate them to one output
+ *      per LUT sample, carrying the filter state over to the next block.
+ *      Without CMSIS-DSP this computes exactly what arm_fir_decimate_q15()
+ *      does, a 64-bit sum of the oldest sample under the kernel times the
+ *      first coefficient onwards, truncated and saturated to q15.
+ *
+ ************************************************************************/
+static void fir_filter
+    (
+    uint32_t        taps,
+    const int16_t * input,
+    int16_t       * output
+    )
+{
+#if( ENVELOPE_FIR_CMSIS_DSP )
+    arm_fir_decimate_q15( &s_fir, (q15_t *)input, output, FIR_BLOCK );
+#else
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    const int16_t * history;
+    int64_t         acc;
+    uint32_t        out;
+    uint32_t        i;
+
+    memcpy( &s_fir_state[ taps - 1 ], input, FIR_BLOCK * sizeof( *input ) );
+
+    for( out = 0; out < FIR_BLOCK / FIR_DECIMATION; out++ )
+    {
+        /*----------------------------------------------------
+        Oldest sample under the kernel for this output
+        ----------------------------------------------------*/
+        history = &s_fir_state[ out * FIR_DECIMATION + FIR_DECIMATION - 1 ];
+        acc = 0;
+        for( i = 0; i < taps; i++ )
+        {
+            acc += (int32_t)history[ i ] * s_fir_coeffs[ i ];
+        }
+        output[ out ] = (int16_t)limit_val( acc >> 15, INT16_MIN, INT16_MAX );
+    }
+
+    memmove( s_fir_state, &s_fir_state[ FIR_BLOCK ], ( taps - 1 ) * sizeof( *s_fir_state ) );
+#endif
+
+}   /* fir_filter() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      fir_kernel_weight
+ *
+ *  Description:
+ *      Get the unnormalized weight of one kernel tap. The box kernel
+ *      halves its end taps, which makes it integrate a piecewise linear
+ *      raster exactly. The Gaussian kernel is a cubic B-spline, whose
+ *      four unit intervals each span a quarter of the taps, scaled by
+ *      6 * span^3 with the distance from the center in half taps.
+ *
+ ************************************************************************/
+static int32_t fir_kernel_weight
+    (
+    uint32_t        tap,
+    uint32_t        taps
+    )
+{
+#if( ENVELOPE_FIR_KERNEL == ENVELOPE_FIR_KERNEL_GAUSSIAN )
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    int32_t         span;
+    int32_t         dist;
+
+    span = taps - 1;
+    dist = 2 * (int32_t)tap - span;
+    dist = ( dist < 0 ) ? -dist : dist;
+    if( dist < span )
+    {
+        return( 4 * span * span * span - 6 * dist * dist * span + 3 * dist * dist * dist );
+    }
+
+    return( ( 2 * span - dist ) * ( 2 * span - dist ) * ( 2 * span - dist ) );
+#else
+    return( ( tap == 0 || tap == taps - 1 ) ? 1 : 2 );
+#endif
+
+}   /* fir_kernel_weight() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      fir_samples
+ *
+ *  Description:
+ *      Fill the next block of a LUT entry's samples by filtering the
+ *      unsmoothed pattern. With the kernel centered, output m of the
+ *      filter lands on the LUT sample at origin + m * FIR_DECIMATION.
+ *      Patterns are dark before the raster starts.
+ *
+ ************************************************************************/
+static void fir_samples
+    (
+    const lut_entry_type
+                      * entry,
+    flash_id_type       flash_id,
+    int16_t             smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    int16_t             input[ FIR_BLOCK ];
+    int16_t             output[ FIR_BLOCK / FIR_DECIMATION ];
+    uint16_t          * sample;
+    uint32_t            i;
+
+    for( i = 0; i < FIR_BLOCK; i++ )
+    {
+        input[ i ] = calculate_brightness_unsmoothed( flash_id, s_build.raster_time + i, &s_build.cursor ) << FIR_INPUT_SHIFT;
+    }
+    s_build.raster_time += FIR_BLOCK;
+
+    fir_filter( FIR_TAPS( smoothing ), input, output );
+
+    /*--------------------------------------------------------
+    Round back to brightness
+    --------------------------------------------------------*/
+    sample = &s_lut_samples[ entry->offset + s_build.done ];
+    for( i = 0; i < count_of_array( output ) && s_build.done + i < entry->count; i++ )
+    {
+        sample[ i ] = max_val( output[ i ] + ( 1 << ( FIR_INPUT_SHIFT - 1 ) ), 0 ) >> FIR_INPUT_SHIFT;
+    }
+    s_build.done += i;
+
+}   /* fir_samples() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      fir_start
+ *
+ *  Description:
+ *      Set the filter up for a LUT entry, with the raster placed so that
+ *      its first output lands on the entry's origin. Output m is taken
+ *      over the taps raster samples ending FIR_DECIMATION - 1 after
+ *      m * FIR_DECIMATION, which start half the smoothing before the
+ *      sample time, as the reference window does.
+ *
+ ************************************************************************/
+static void fir_start
+    (
+    const lut_entry_type
+                      * entry,
+    int16_t             smoothing
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t            taps;
+
+    taps = FIR_TAPS( smoothing );
+    fir_build_kernel( taps );
+#if( ENVELOPE_FIR_CMSIS_DSP )
+    arm_fir_decimate_init_q15( &s_fir, taps, FIR_DECIMATION, s_fir_coeffs, s_fir_state, FIR_BLOCK );
+#else
+    clear_array( s_fir_state );
+#endif
+
+    s_build.raster_time = entry->origin - ( smoothing / 2 ) + taps - FIR_DECIMATION;
+
+}   /* fir_start() */
+#endif
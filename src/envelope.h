@@ -0,0 +1,311 @@
+/*********************************************************************************
+ *
+ *  envelope.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Flash pattern definitions and smoothed brightness envelopes.
+ *
+ ********************************************************************************/
+
+#ifndef ENVELOPE_H_
+#define ENVELOPE_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Envelope engines. The reference engine integrates the flash
+pattern on every call, the LUT engine reads from tables built
+for the loaded set. The integral engine differences a
+cumulative integral of the pattern, keeping arbitrary
+smoothing widths at constant per-call cost. The FIR engine
+fills the LUT engine's tables by filtering a 1 ms raster of
+each pattern, so the smoothing kernel need not be a box.
+------------------------------------------------------------*/
+#define ENVELOPE_ENGINE_REFERENCE   ( 0 )
+#define ENVELOPE_ENGINE_LUT         ( 1 )
+#define ENVELOPE_ENGINE_INTEGRAL    ( 2 )
+#define ENVELOPE_ENGINE_FIR         ( 3 )
+
+#ifndef ENVELOPE_ENGINE
+#define ENVELOPE_ENGINE             ( ENVELOPE_ENGINE_LUT )
+#endif
+
+#define ENVELOPE_BRIGHTNESS_MAX     ( 1000 )    /* Full pattern brightness      */
+#define ENVELOPE_SMOOTHING_MAX      ( 500 )     /* Widest smoothing window (ms) */
+#define ENVELOPE_SMOOTHING_MIN      ( 50  )     /* Narrowest smoothing window   */
+#define ENVELOPE_FLASH_TIME_MAX     ( INT16_MAX )
+                                                /* Flash times fit 16 bits      */
+#define ENVELOPE_CURSOR_START       ( 0 )       /* Cursor for a new flash       */
+
+/*------------------------------------------------------------
+LUT engine configuration. Envelopes are sampled every
+2^ENVELOPE_LUT_SHIFT ms, which matches FIREFLY_TIMESTEP, for
+ENVELOPE_LUT_LEVELS evenly spaced smoothing widths.
+------------------------------------------------------------*/
+#define ENVELOPE_LUT_SHIFT          ( 3 )
+#define ENVELOPE_LUT_RESOLUTION     ( 1 << ENVELOPE_LUT_SHIFT )
+#define ENVELOPE_LUT_LEVELS         ( 4 )
+#define ENVELOPE_LUT_SAMPLES_MAX    ( 3072 )
+
+/*------------------------------------------------------------
+FIR engine configuration. The q15 kernel spans the smoothing
+window and is either a box, which integrates the same window
+as the reference and so matches the other engines to within
+rounding, or a cubic B-spline bell within a few percent of a
+Gaussian of sigma = width / 7. Set ENVELOPE_FIR_CMSIS_DSP to
+filter with arm_fir_decimate_q15(), which needs the CMSIS-DSP
+library linked in.
+------------------------------------------------------------*/
+#define ENVELOPE_FIR_KERNEL_BOX     ( 0 )
+#define ENVELOPE_FIR_KERNEL_GAUSSIAN ( 1 )
+
+#ifndef ENVELOPE_FIR_KERNEL
+#define ENVELOPE_FIR_KERNEL         ( ENVELOPE_FIR_KERNEL_BOX )
+#endif
+
+#ifndef ENVELOPE_FIR_CMSIS_DSP
+#define ENVELOPE_FIR_CMSIS_DSP      ( 0 )
+#endif
+
+/*------------------------------------------------------------
+Batched evaluation. With ENVELOPE_SIMD set, fireflies are
+stepped and evaluated two to a word with the Cortex-M4 packed
+halfword instructions, through envelope_brightness_batch().
+The per-firefly scalar path stays as the reference, and is
+the only path on cores and hosts without SIMD32.
+------------------------------------------------------------*/
+#ifndef ENVELOPE_SIMD
+#if defined( __ARM_FEATURE_SIMD32 )
+#define ENVELOPE_SIMD               ( 1 )
+#else
+#define ENVELOPE_SIMD               ( 0 )
+#endif
+#endif
+
+
+/*------------------------------------------------------------
+Pattern sets. Flashes draw their patterns from one set at a
+time. With ENVELOPE_SET_STORE set, the sets are stored back
+to back in the flash page ENVELOPE_SET_FLASH_PAGE pages back
+from the end of the part's flash, which envelope_init() seeds
+with the built-in sets should it hold no valid store. Sets are
+loaded into ENVELOPE_SET_SLOTS slots in RAM, so that flashes
+of the last set run out on it while new ones draw from the
+next. The tables of one slot are held at a time and built a
+slice per envelope_set_build() call. Flashes drawn from a
+slot before its tables are ready run on the reference engine
+throughout. With ENVELOPE_SET_STORE clear, or the firmware
+image reaching the page, the built-in sets are loaded from
+the image instead. The store is opt-in, as nothing in the
+tree reserves its page. Set it only with a linker script
+that ends the FLASH region short of the last page.
+------------------------------------------------------------*/
+#ifndef ENVELOPE_SET_STORE
+#define ENVELOPE_SET_STORE          ( 0 )
+#endif
+
+#ifndef ENVELOPE_SET_FLASH_PAGE
+#define ENVELOPE_SET_FLASH_PAGE     ( 0 )           /* Last page of flash           */
+#endif
+
+#define ENVELOPE_SET_SLOTS          ( 2 )
+#define ENVELOPE_SET_PATTERNS_MAX   ( 8 )
+#define ENVELOPE_SET_POINTS_MAX     ( 48 )
+
+/*------------------------------------------------------------
+Flash ID fields. The low bits pick a pattern of the set in
+the slot above FLASH_ID_SLOT_SHIFT. FLASH_ID_REFERENCE marks
+a flash drawn before its slot's tables were ready.
+------------------------------------------------------------*/
+#define FLASH_ID_PATTERN_MASK       ( 0x0F )
+#define FLASH_ID_REFERENCE          ( 0x10 )
+#define FLASH_ID_SLOT_SHIFT         ( 5 )
+
+
+/*--------------------------------------------------------------------------------
+                                     MACROS
+--------------------------------------------------------------------------------*/
+
+#define flash_id_slot( id )         ( (uint32_t)( id ) >> FLASH_ID_SLOT_SHIFT )
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Flash IDs. Those listed are the patterns of set 0, which is
+loaded into slot 0 at boot.
+------------------------------------------------------------*/
+typedef uint8_t flash_id_type;
+enum
+{
+    FLASH_PHOTINUS_PALLENS,
+    FLASH_PHOTINUS_LEWISI,
+    FLASH_PHOTINUS_AMPLUS,
+    FLASH_PHOTINUS_XANTHOPHOTIS,
+    FLASH_PHOTURIS_JAMAICENSIS,
+    FLASH_PHOTINUS_LEUCOPYGE,
+
+    FLASH_COUNT,
+    FLASH_FIRST = FLASH_PHOTINUS_PALLENS,
+    FLASH_LAST = FLASH_PHOTINUS_LEUCOPYGE,
+};
+
+/*------------------------------------------------------------
+Flash brightness
+------------------------------------------------------------*/
+typedef int32_t flash_brightness_type;
+
+/*------------------------------------------------------------
+Pattern segment cursor, kept per firefly and reset to
+ENVELOPE_CURSOR_START when a flash starts. Evaluations walk
+the pattern from the cursor rather than from its first
+segment, so stepping through a flash costs O(1) per step. A
+stale cursor only costs a longer walk, never a wrong result.
+------------------------------------------------------------*/
+typedef uint8_t envelope_cursor_type;
+
+#if( ENVELOPE_SIMD )
+/*------------------------------------------------------------
+Two adjacent halfword lanes of a word aligned array, lane 0
+in the low half
+------------------------------------------------------------*/
+typedef uint32_t __attribute__(( may_alias )) envelope_pair_type;
+
+/*------------------------------------------------------------
+Packed halfword selects. Each lane of the result is taken
+from ge where that lane of a is at least the one of b,
+compared as signed or unsigned halfwords, and from lt
+otherwise. The subtract sets the APSR.GE flags that the
+select reads, so both sit in one asm statement, where the
+compiler cannot move other flag setting code between them.
+------------------------------------------------------------*/
+static inline uint32_t envelope_sel_sge16
+    (
+    uint32_t        a,
+    uint32_t        b,
+    uint32_t        ge,
+    uint32_t        lt
+    )
+{
+    uint32_t        result;
+
+    __asm( "ssub16 %0, %1, %2\n\tsel %0, %3, %4" : "=&r" ( result ) : "r" ( a ), "r" ( b ), "r" ( ge ), "r" ( lt ) : "cc" );
+    return( result );
+
+}   /* envelope_sel_sge16() */
+
+static inline uint32_t envelope_sel_uge16
+    (
+    uint32_t        a,
+    uint32_t        b,
+    uint32_t        ge,
+    uint32_t        lt
+    )
+{
+    uint32_t        result;
+
+    __asm( "usub16 %0, %1, %2\n\tsel %0, %3, %4" : "=&r" ( result ) : "r" ( a ), "r" ( b ), "r" ( ge ), "r" ( lt ) : "cc" );
+    return( result );
+
+}   /* envelope_sel_uge16() */
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+ramfunc flash_brightness_type envelope_brightness
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing,
+    envelope_cursor_type
+                  * cursor
+    );
+
+#if( ENVELOPE_SIMD )
+ramfunc void envelope_brightness_batch
+    (
+    const flash_id_type   * flash_id,
+    const int16_t         * flash_time,
+    const uint16_t        * smoothing,
+    uint16_t              * brightness,
+    envelope_cursor_type  * cursor,
+    uint32_t                mask,       /* Entries to evaluate, one bit each    */
+    uint32_t                count       /* Even number of entries               */
+    );
+#endif
+
+ramfunc int32_t envelope_brightness_hold
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    );
+
+flash_brightness_type envelope_brightness_reference
+    (
+    flash_id_type   flash_id,
+    int32_t         flash_time,
+    int16_t         smoothing
+    );
+
+int32_t envelope_flash_length
+    (
+    flash_id_type   flash_id
+    );
+
+int32_t envelope_flash_peak
+    (
+    flash_id_type   flash_id
+    );
+
+void envelope_init
+    (
+    void
+    );
+
+boolean envelope_set_build
+    (
+    uint32_t        slot
+    );
+
+uint32_t envelope_set_count
+    (
+    void
+    );
+
+flash_id_type envelope_set_flash
+    (
+    uint32_t        slot,
+    uint32_t        pattern
+    );
+
+boolean envelope_set_load
+    (
+    uint32_t        slot,
+    uint32_t        set
+    );
+
+uint32_t envelope_set_patterns
+    (
+    uint32_t        slot
+    );
+
+int16_t envelope_smoothing_quantize
+    (
+    int16_t         smoothing
+    );
+
+
+#endif /* ENVELOPE_H_ */
@@ -13,31 +13,87 @@
                                    INCLUDES
 --------------------------------------------------------------------------------*/
 
+#include <stddef.h>
 #include <stdio.h>
-#include <stdlib.h>
 
 #include "system.h"
 #include "leds.h"
+#include "envelope.h"
+#include "fireflies.h"
+#include "link.h"
+#include "random.h"
+#include "replay.h"
+#include "trace.h"
+
+#if( ENVELOPE_SIMD )
+#include <stm32f3xx.h>
+#endif
+
+#if( LINK_ENABLE && ( FIREFLY_MODE != FIREFLY_MODE_SYNC ) )
+#error "Jars only couple in sync mode"
+#endif
 
 
 /*--------------------------------------------------------------------------------
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
 
-#define NUMBER_OF_FIREFLIES     ( LED_COUNT )
-#define FIREFLY_TIMESTEP        ( LED_COUNT )
+#define NUMBER_OF_FIREFLIES     ( FIREFLY_POOL_SIZE )
+#define FIREFLY_TIMESTEP        ( ENVELOPE_LUT_RESOLUTION )
+#define FIREFLY_UPDATE_PERIOD   ( FIREFLY_TIMESTEP / FIREFLY_UPDATE_GROUPS )
+#define FIREFLY_FAST_UPDATES    ( max_val( FIREFLY_FAST_STEP / FIREFLY_UPDATE_PERIOD, 1 ) )
 #define FIREFLY_DELAY_MAX       ( 12000 )
 #define FIREFLY_DELAY_MIN       ( 1000 )
-#define FIREFLY_SMOOTHING_MAX   ( 500 )
-#define FIREFLY_SMOOTHING_MIN   ( 50  )
-#define FIREFLY_FLASHPOINTS_MAX ( 15  )
+#define FIREFLY_SMOOTHING_MAX   ( ENVELOPE_SMOOTHING_MAX )
+#define FIREFLY_SMOOTHING_MIN   ( ENVELOPE_SMOOTHING_MIN )
+#define FIREFLY_NONE            ( (firefly_id_type)~0 )
+                                            /* Wait list terminator     */
 
+/*------------------------------------------------------------
+Flash slots. Only flashing fireflies hold one, so flash state
+and per-update cost scale with the flashes rather than with
+the pool. A firefly that wakes to find every slot taken skips
+that flash, and degraded mode sheds flashes by holding slots
+back. The batch kernel takes one mask bit per slot.
+------------------------------------------------------------*/
+#define FIREFLY_SLOTS           ( min_val( 2 * LED_COUNT, 32 ) )
+#define FIREFLY_SLOTS_MIN       ( 2 )           /* Left in deepest degraded mode */
+#define FIREFLY_SLOT_NONE       ( 0xFF )
+#define FIREFLY_SLOT_DEFER      ( 0xFE )        /* Over the current budget      */
+#define FIREFLY_LEVEL_WRITTEN   ( 0xFFFFFFFF )  /* LED already set this update  */
 
-/*--------------------------------------------------------------------------------
-                                     MACROS
---------------------------------------------------------------------------------*/
+/*------------------------------------------------------------
+Random mode delays, stretched by the pool to LED ratio. The
+first flashes after boot are still drawn from
+FIREFLY_DELAY_MIN up, so the jar lights promptly.
+------------------------------------------------------------*/
+#define FIREFLY_DARK_SCALE( ms )    ( (ms) * NUMBER_OF_FIREFLIES / ( LED_COUNT * FIREFLY_DENSITY ) )
+#define FIREFLY_DARK_MAX        ( FIREFLY_DARK_SCALE( FIREFLY_DELAY_MAX ) )
+#define FIREFLY_DARK_MIN        ( FIREFLY_DARK_SCALE( FIREFLY_DELAY_MIN ) )
+
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+#define FIREFLY_BOOT_DELAY_MAX  ( FIREFLY_DELAY_MAX )
+#else
+#define FIREFLY_BOOT_DELAY_MAX  ( FIREFLY_DARK_MAX )
+#endif
 
-#define rand_range( min, max )  ( rand() % ( ( max ) - ( min ) + 1 ) + ( min ) )
+#define FIREFLY_PACE_MAX        ( 16 * FIREFLY_PACE_ONE )
+compile_assert( (uint64_t)FIREFLY_DARK_MAX * FIREFLY_PACE_MAX <= UINT32_MAX, firefly_pace_range );
+
+/*------------------------------------------------------------
+Sync mode. Periods run from flash start to flash start. Every
+flash started in an update adds to the mean field, which then
+advances every dark firefly by a fraction of the time it has
+already waited, FIREFLY_SYNC_COUPLING / NUMBER_OF_FIREFLIES
+(Q16) per flash. Fireflies close to flashing jump the most,
+and any pushed past their wake tick flash on the next update.
+The advance only depends on the remaining wait, so the wait
+list stays in order.
+------------------------------------------------------------*/
+#define FIREFLY_SYNC_PERIOD_MAX ( 3100 )
+#define FIREFLY_SYNC_PERIOD_MIN ( 2900 )
+#define FIREFLY_SYNC_PERIOD     ( ( FIREFLY_SYNC_PERIOD_MIN + FIREFLY_SYNC_PERIOD_MAX ) / 2 )
+#define FIREFLY_SYNC_COUPLING   ( 16384 )   /* 0.25 per jar-wide flash  */
 
 
 /*--------------------------------------------------------------------------------
@@ -45,174 +101,207 @@
 --------------------------------------------------------------------------------*/
 
 /*------------------------------------------------------------
-Flash IDs, used to index into the correct flash pattern
-------------------------------------------------------------*/
-typedef uint8_t flash_id_type;
-enum
-{
-    FLASH_PHOTINUS_PALLENS,
-    FLASH_PHOTINUS_LEWISI,
-    FLASH_PHOTINUS_AMPLUS,
-    FLASH_PHOTINUS_XANTHOPHOTIS,
-    FLASH_PHOTURIS_JAMAICENSIS,
-    FLASH_PHOTINUS_LEUCOPYGE,
-
-    FLASH_COUNT,
-    FLASH_FIRST = FLASH_PHOTINUS_PALLENS,
-    FLASH_LAST = FLASH_PHOTINUS_LEUCOPYGE,
-};
-
-/*------------------------------------------------------------
-Flash brightness
+Firefly IDs, sized to the pool
 ------------------------------------------------------------*/
-typedef int32_t flash_brightness_type;
+#if( NUMBER_OF_FIREFLIES < 0xFF )
+typedef uint8_t firefly_id_type;
+#else
+typedef uint16_t firefly_id_type;
+#endif
 
 /*------------------------------------------------------------
-Flash points, the building blocks of a flash pattern.
+Firefly state, split by how often it is touched. Flash state
+is read and written on every step of a flash, and is indexed
+by flash slot. The schedule is only touched when a firefly
+goes dark or wakes, and is all a firefly keeps for itself, a
+few bytes each. Only the firefly task touches either.
 ------------------------------------------------------------*/
 typedef struct
 {
-    flash_brightness_type
-                    target;     /* Target brightness        */
-    int32_t         time;       /* Transition time          */
-}flash_point_type;
+    uint32_t        due[ FIREFLY_SLOTS ];               /* Update of next step      */
+    uint32_t        stepped[ FIREFLY_SLOTS ];           /* Update of last step      */
+    int16_t         flash_time[ FIREFLY_SLOTS ];        /* Time into flash pattern  */
+    uint16_t        brightness[ FIREFLY_SLOTS ];        /* Firefly brightness       */
+    uint16_t        smoothing[ FIREFLY_SLOTS ];         /* Flash pattern smoothing  */
+    flash_id_type   flash_id[ FIREFLY_SLOTS ];          /* Type of flash pattern    */
+    envelope_cursor_type
+                    cursor[ FIREFLY_SLOTS ];            /* Flash pattern segment    */
+    firefly_id_type firefly[ FIREFLY_SLOTS ];           /* Firefly flashing         */
+    led_type        led[ FIREFLY_SLOTS ];               /* LED it flashes on        */
+}firefly_flash_type;
 
-/*------------------------------------------------------------
-Firefly state data
-------------------------------------------------------------*/
 typedef struct
 {
-    flash_brightness_type
-                    brightness; /* Firefly brightness       */
-    boolean         flashing;   /* Firefly is flashing      */
-    flash_id_type   flash_id;   /* Type of flash pattern    */
-    int32_t         flash_time; /* Time into flash pattern  */
-    int32_t         smoothing;  /* Flash pattern smoothing  */
-    int32_t         delay_len;  /* Delay length             */
-    int32_t         delay_time; /* Time into delay          */
-}firefly_type;
+    uint32_t        wake_tick[ NUMBER_OF_FIREFLIES ];   /* Tick of next flash start */
+    firefly_id_type next[ NUMBER_OF_FIREFLIES ];        /* Next waiting firefly     */
+}firefly_wait_type;
 
 
 /*--------------------------------------------------------------------------------
-                                    MEMORY CONSTANTS
+                                 GLOBAL VARIABLES
 --------------------------------------------------------------------------------*/
 
+/*--------------------------------------------------------------------------------
+                                 STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+static firefly_flash_type   s_flash __attribute__(( aligned( 4 ) ));
+static firefly_wait_type    s_wait;
+
 /*------------------------------------------------------------
-Flash pattern definitions. Each flash is assumed to start at 0
-brightness. Each flash point in the pattern then defines the
-next target brightness and the amount of time allowed to reach
-that brightness. The flash is over when the target brightness
-reaches zero.
+Firefly schedule. The slots of flashing fireflies are listed
+in s_active and stepped when due, the rest are stacked in
+s_free. Dark fireflies sit in a wait list sorted
+by wake tick, so an update only touches the head of the list
+until a flash is actually due. Inserting walks the list, and
+a sync pulse walks all of it, so both are O(pool). They only
+run when a flash ends or starts, a few dozen times a second
+with all 128 fireflies in sync mode, which comes to some
+thousands of node visits a second, well under 1% of the core.
+A heap or timer wheel would lose the insertion order of equal
+wake ticks, and could not spare sync mode its walk, as every
+dark firefly is advanced. The count and head are also read
+from the main loop.
+------------------------------------------------------------*/
+static uint8_t              s_active[ FIREFLY_SLOTS ];
+volatile static uint8_t     s_active_count;
+static uint8_t              s_free[ FIREFLY_SLOTS ];
+static uint8_t              s_free_count;
+volatile static firefly_id_type
+                            s_wait_head = FIREFLY_NONE;
 
-Flash patterns based on research by McDermott and Buck (1959)
+/*------------------------------------------------------------
+Flash slots holding each LED
 ------------------------------------------------------------*/
-static const flash_point_type flash_patterns[FLASH_COUNT][FIREFLY_FLASHPOINTS_MAX] =
-{
-    /*--------------------------------------------------------
-    Flash of the Photinus pallens
-    --------------------------------------------------------*/
-    {/* target, time */
-        {  800,  300 },
-        { 1000,  100 },
-        {  800,  200 },
-        {    0,  400 }
-    },
+static uint8_t              s_led_users[ LED_COUNT ];
 
-    /*--------------------------------------------------------
-    Flash of the Photinus lewisi
-    --------------------------------------------------------*/
-    {/* target, time */
-        {  500,  100 },
-        {  500,  800 },
-        {    0,  100 }
-    },
+compile_assert( LED_COUNT <= 0xFF, firefly_led_type );
 
-    /*--------------------------------------------------------
-    Flash of the Photinus amplus
-    --------------------------------------------------------*/
-    {/* target, time */
-        { 1000,  100 },
-        {    1,  100 },
-        {    1,  100 },
-        { 1000,  100 },
-        {    0,  100 }
-    },
+/*------------------------------------------------------------
+Updates run. Update n is LED group n % FIREFLY_UPDATE_GROUPS's
+turn, and the groups divide FIREFLY_TIMESTEP, so the count
+wraps without skipping a turn.
+------------------------------------------------------------*/
+static uint32_t             s_update_count;
 
-    /*--------------------------------------------------------
-    Flash of the Photinus xanthophotis
-    --------------------------------------------------------*/
-    {/* target, time */
-        { 1000,  200 },
-        {    1,  100 },
-        {    1,  200 },
-        {  300,  100 },
-        {    1,  100 },
-        {  300,  100 },
-        {    0,  100 }
-    },
+/*------------------------------------------------------------
+Random mode delay stretch, of FIREFLY_PACE_ONE. Set from other
+tasks, and read once per update.
+------------------------------------------------------------*/
+volatile static uint32_t    s_pace = FIREFLY_PACE_ONE;
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+static uint32_t             s_update_pace;
+#endif
 
-    /*--------------------------------------------------------
-    Flash of the Photuris jamaicensis
-    --------------------------------------------------------*/
-    {/* target, time */
-        {  500,   50 },
-        {  500,  200 },
-        {    0,   50 }
-    },
+/*------------------------------------------------------------
+Pattern sets. New flashes draw from the set in s_set_slot,
+while those of the last set run out on the other slot. The
+set asked for is set from other tasks, and read once per
+update. A set is only loaded into a slot no flash holds, and
+its tables only built once no flash reads those of the other
+slot. Flashes on each slot, and those reading its tables.
+------------------------------------------------------------*/
+volatile static uint8_t     s_set_request;
+static uint8_t              s_set;
+static uint8_t              s_set_slot;
+static boolean              s_set_built;
+static uint8_t              s_slot_flashes[ ENVELOPE_SET_SLOTS ];
+static uint8_t              s_table_flashes[ ENVELOPE_SET_SLOTS ];
+
+compile_assert( FIREFLY_UPDATE_GROUPS > 0 && FIREFLY_TIMESTEP % FIREFLY_UPDATE_GROUPS == 0, firefly_update_groups );
+compile_assert( FIREFLY_FAST_STEP > 0 && FIREFLY_FAST_STEP <= FIREFLY_TIMESTEP, firefly_fast_step );
+compile_assert( FIREFLY_SLOTS <= 32 && LED_COUNT <= 32, firefly_step_masks );
+compile_assert( ENVELOPE_SET_SLOTS == 2, firefly_set_slots );
+
+#if( FIREFLY_CURRENT_BUDGET )
+/*------------------------------------------------------------
+Current held by each flash slot, and by every flash, in DAC
+codes. Frames are checked against the budget with one mask
+bit per LED, counting the current last written to the LEDs
+of other update groups.
+------------------------------------------------------------*/
+static uint16_t             s_slot_current[ FIREFLY_SLOTS ];
+static uint32_t             s_current_held;
+static uint16_t             s_led_current[ LED_COUNT ];
+static uint32_t             s_frame_current;
 
-    /*--------------------------------------------------------
-    Flash of the Photinus leucopyge
-    --------------------------------------------------------*/
-    {/* target, time */
-        { 1000,   50 },
-        { 1000,  200 },
-        {    0,   50 }
-    },
-};
+compile_assert( FIREFLY_CURRENT_BUDGET > LED_COUNT && FIREFLY_CURRENT_BUDGET <= UINT16_MAX, firefly_budget_range );
+#endif
 
+#if( ENVELOPE_SIMD )
+/*------------------------------------------------------------
+The batch kernel reads flash state two slots to a word
+------------------------------------------------------------*/
+compile_assert( FIREFLY_SLOTS % 2 == 0, firefly_pairs );
+compile_assert( offsetof( firefly_flash_type, brightness ) % 4 == 0, firefly_pair_brightness );
+compile_assert( offsetof( firefly_flash_type, smoothing ) % 4 == 0, firefly_pair_smoothing );
+#endif
 
-/*--------------------------------------------------------------------------------
-                                 GLOBAL VARIABLES
---------------------------------------------------------------------------------*/
 
 /*--------------------------------------------------------------------------------
-                                 STATIC VARIABLES
+                                    PROCEDURES
 --------------------------------------------------------------------------------*/
 
-volatile static firefly_type s_fireflies[ NUMBER_OF_FIREFLIES ];
+static ramfunc void firefly_periodic_callback
+    (
+    void
+    );
 
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+static uint32_t firefly_dark_delay
+    (
+    void
+    );
+#endif
 
-/*--------------------------------------------------------------------------------
-                                    PROCEDURES
---------------------------------------------------------------------------------*/
+static ramfunc uint32_t firefly_next_step
+    (
+    uint8_t                 slot,
+    uint32_t                update,
+    uint32_t                previous
+    );
 
-static int32_t calculate_flash_length
+static ramfunc uint32_t firefly_next_turn
     (
-    flash_id_type   flash_type
+    led_type                led,
+    uint32_t                update
     );
 
-static flash_brightness_type calculate_brightness_smoothed
+static void firefly_set_update
     (
-    flash_id_type   flash_id,
-    int32_t         flash_time,
-    int16_t         smoothing
+    uint32_t                request
     );
 
-static flash_brightness_type calculate_brightness_unsmoothed
+static uint8_t firefly_start_flash
     (
-    flash_id_type   flash_type,
-    int32_t         flash_time
+    firefly_id_type         firefly
     );
 
-static void firefly_periodic_callback
+#if( !ENVELOPE_SIMD )
+static ramfunc boolean firefly_step
     (
-    void
+    uint8_t                 idx         /* Flash slot                   */
     );
+#endif
 
-static void firefly_step
+#if( ENVELOPE_SIMD )
+static ramfunc uint32_t firefly_step_batch
     (
-    firefly_type * const    firefly,
-    uint16_t                time_step
+    uint32_t                active_mask
+    );
+#endif
+
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+static void firefly_sync_pulse
+    (
+    uint32_t                now,
+    uint32_t                weight
+    );
+#endif
+
+static void wait_list_insert
+    (
+    firefly_id_type         idx
     );
 
 
@@ -234,32 +323,63 @@ void firefly_init
     Local Variables
     --------------------------------------------------------*/
     uint32_t        i;
-    firefly_type  * firefly;
+    uint32_t        now;
 
     /*--------------------------------------------------------
-    TODO: seed random number generator with unique value?
+    Precompute flash envelopes
     --------------------------------------------------------*/
-    //srand( NUM );
+    envelope_init();
+
+    /*--------------------------------------------------------
+    Every slot starts free, and is handed out lowest first
+    --------------------------------------------------------*/
+    s_active_count = 0;
+    s_free_count = 0;
+    for( i = FIREFLY_SLOTS; i-- > 0; )
+    {
+        s_flash.due[ i ] = 0;
+        s_flash.stepped[ i ] = 0;
+        s_flash.flash_time[ i ] = 0;
+        s_flash.brightness[ i ] = 0;
+        s_flash.smoothing[ i ] = FIREFLY_SMOOTHING_MIN;
+        s_flash.flash_id[ i ] = FLASH_FIRST;
+        s_flash.cursor[ i ] = ENVELOPE_CURSOR_START;
+        s_free[ s_free_count++ ] = i;
+    }
+    clear_array( s_led_users );
+#if( FIREFLY_CURRENT_BUDGET )
+    clear_array( s_slot_current );
+    clear_array( s_led_current );
+    s_current_held = 0;
+    s_frame_current = 0;
+#endif
+    s_update_count = 0;
+    s_set_request = 0;
+    s_set = 0;
+    s_set_slot = 0;
+    s_set_built = TRUE;
+    clear_array( s_slot_flashes );
+    clear_array( s_table_flashes );
 
     /*--------------------------------------------------------
     Initialize all fireflies with random delays
     --------------------------------------------------------*/
-    for( i = 0; i < count_of_array( s_fireflies ); i++ )
+    now = system_get_tick();
+#if( REPLAY_RECORD )
+    replay_record_start( now, FIREFLY_UPDATE_PERIOD );
+#endif
+    s_wait_head = FIREFLY_NONE;
+    for( i = 0; i < NUMBER_OF_FIREFLIES; i++ )
     {
-        firefly = (firefly_type *)&s_fireflies[ i ];
-        firefly->brightness = 0;
-        firefly->delay_len = rand_range( FIREFLY_DELAY_MIN, FIREFLY_DELAY_MAX );
-        firefly->delay_time = 0;
-        firefly->flash_id = FLASH_FIRST;
-        firefly->flash_time = 0;
-        firefly->flashing = FALSE;
-        firefly->smoothing = FIREFLY_SMOOTHING_MIN;
+        s_wait.wake_tick[ i ] = now + random_range( FIREFLY_DELAY_MIN, FIREFLY_BOOT_DELAY_MAX );
+        wait_list_insert( i );
     }
 
     /*--------------------------------------------------------
-    Register periodic callback function
+    Register periodic callback function. Firefly updates are
+    deferred so that they never hold up an LED refresh.
     --------------------------------------------------------*/
-    system_add_task( firefly_periodic_callback, FIREFLY_TIMESTEP );
+    system_add_task( firefly_periodic_callback, FIREFLY_UPDATE_PERIOD, SYSTEM_TASK_DEFERRED | SYSTEM_TASK_IDLE );
 
 }   /* firefly_init() */
 
@@ -267,340 +387,848 @@ void firefly_init
 /*************************************************************************
  *
  *  Procedure:
- *      calculate_flash_length
+ *      firefly_next_set
  *
  *  Description:
- *      Calculate the full run time of a given flash pattern.
+ *      Move on to the next pattern set, after the last back to the
+ *      first.
  *
  ************************************************************************/
-static int32_t calculate_flash_length
+void firefly_next_set
     (
-    flash_id_type   flash_type
+    void
+    )
+{
+    firefly_select_set( s_set_request + 1 );
+
+}   /* firefly_next_set() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_select_set
+ *
+ *  Description:
+ *      Have new flashes draw their patterns from a pattern set, wrapped
+ *      to those in the store, from the next update on. Flashes already
+ *      running finish on the set they started with.
+ *
+ ************************************************************************/
+void firefly_select_set
+    (
+    uint32_t                set
+    )
+{
+    s_set_request = set % envelope_set_count();
+
+}   /* firefly_select_set() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_set_pace
+ *
+ *  Description:
+ *      Stretch the random mode delays between flashes by
+ *      pace / FIREFLY_PACE_ONE, from each firefly's next delay on.
+ *
+ ************************************************************************/
+void firefly_set_pace
+    (
+    uint32_t                pace
+    )
+{
+    s_pace = limit_val( pace, 1, FIREFLY_PACE_MAX );
+
+}   /* firefly_set_pace() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_ticks_to_next_flash
+ *
+ *  Description:
+ *      Get the number of ticks until the next firefly starts flashing,
+ *      or 0 while any firefly is flashing.
+ *
+ ************************************************************************/
+uint32_t firefly_ticks_to_next_flash
+    (
+    void
     )
 {
     /*--------------------------------------------------------
     Local Variables
     --------------------------------------------------------*/
-    int32_t                     flash_length;
-    const flash_point_type    * flash_pattern;
-    uint32_t                    i;
+    int32_t         remaining;
+    firefly_id_type head;
 
     /*--------------------------------------------------------
-    Get start of flash pattern
+    The schedule is owned by the deferred firefly task, which
+    runs from PendSV and can preempt the main loop anywhere,
+    so read the list head only once.
     --------------------------------------------------------*/
-    flash_pattern = flash_patterns[ flash_type ];
+    head = s_wait_head;
+    if( s_active_count > 0 )
+    {
+        return( 0 );
+    }
 
-    /*--------------------------------------------------------
-    Iterate over all flash points to get cumulative run time.
-    --------------------------------------------------------*/
-    flash_length = 0;
-    for( i = 0; i == 0 || flash_pattern[ i - 1 ].target != 0; i++ )
+    if( head == FIREFLY_NONE )
     {
-        flash_length += flash_pattern[ i ].time;
+        return( SYSTEM_TICKS_FOREVER );
     }
 
-    return( flash_length );
+    remaining = (int32_t)( s_wait.wake_tick[ head ] - system_get_tick() );
+
+    return( (uint32_t)max_val( remaining, 0 ) );
 
-} /* calculate_flash_length() */
+}   /* firefly_ticks_to_next_flash() */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      calculate_brightness_smoothed
+ *      firefly_periodic_callback
  *
  *  Description:
- *      Calculate the smoothed brightness of a given flash type at a
- *      specified flash time.
+ *      Periodic callback to step the flashes due, normally those of the
+ *      next LED group, and start any new flashes due.
  *
  ************************************************************************/
-static flash_brightness_type calculate_brightness_smoothed
+static ramfunc void firefly_periodic_callback
     (
-    flash_id_type   flash_id,
-    int32_t         flash_time,
-    int16_t         smoothing
+    void
     )
 {
     /*--------------------------------------------------------
     Local Variables
     --------------------------------------------------------*/
-    flash_brightness_type   brightness;
-    int32_t                 flash_length;
-    const flash_point_type* flash_pattern;
-    const flash_point_type* flash_point;
-    int32_t                 flash_point_start_time;
-    int32_t                 flash_point_end_time;
-    int32_t                 half_smooth;
-    int32_t                 smooth_start;
-    int32_t                 smooth_end;
-    int32_t                 i;
-    int32_t                 b1;
-    int32_t                 b2;
-    int32_t                 t1;
-    int32_t                 t2;
+    uint32_t                i;
+    uint32_t                count;
+    uint32_t                touched;
+    uint32_t                now;
+    uint32_t                update;
+    uint32_t                set_request;
+    uint32_t                step_mask;
+    uint32_t                led_mask;
+    uint32_t                level[ LED_COUNT ];
+    uint32_t                brightness;
+    uint16_t                previous[ FIREFLY_SLOTS ];
+    led_type                leds[ FIREFLY_SLOTS ];
+    led_type                led;
+    uint8_t                 slot;
+    firefly_id_type         idx;
+    firefly_id_type         head;
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+    uint32_t                flashes;
+    uint32_t                weight;
+#endif
+#if( LINK_ENABLE )
+    uint32_t                beacon;
+#endif
+#if( ENVELOPE_SIMD )
+    uint32_t                done_mask;
+#endif
+#if( FIREFLY_CURRENT_BUDGET )
+    uint32_t                current;
+    uint32_t                others;
+    uint32_t                seen;
+    uint32_t                scale;
+#endif
+
+    now = system_get_tick();
+    count = s_active_count;
+    update = s_update_count++;
+    set_request = s_set_request;
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+    s_update_pace = s_pace;
+#endif
+#if( REPLAY_RECORD )
+    replay_record_update( now );
+    replay_record_degrade( now, system_get_degrade() );
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+    replay_record_pace( now, s_update_pace );
+#endif
+    replay_record_set( now, set_request );
+#endif
 
     /*--------------------------------------------------------
-    Calculate smoothing period.
+    Bring every flash due a step up to this update, and mark
+    the LEDs they are on. Without adaptive steps, those are
+    the flashes of this update's group.
     --------------------------------------------------------*/
-    half_smooth = smoothing >> 1;
-    smoothing = ( half_smooth << 1 ) + 1;
-    smooth_start = flash_time - half_smooth;
-    smooth_end = smooth_start + smoothing;
+    step_mask = 0;
+    led_mask = 0;
+    for( i = 0; i < count; i++ )
+    {
+        slot = s_active[ i ];
+        level[ s_flash.led[ slot ] ] = 0;
+        if( (int32_t)( update - s_flash.due[ slot ] ) >= 0 )
+        {
+            step_mask |= (uint32_t)1 << slot;
+            led_mask |= (uint32_t)1 << s_flash.led[ slot ];
+            previous[ slot ] = s_flash.brightness[ slot ];
+            s_flash.flash_time[ slot ] += ( update - s_flash.stepped[ slot ] ) * FIREFLY_UPDATE_PERIOD;
+        }
+    }
 
-    /*--------------------------------------------------------
-    Calculate flash length.
-    --------------------------------------------------------*/
-    flash_length = calculate_flash_length( flash_id );
+#if( ENVELOPE_SIMD )
+    done_mask = firefly_step_batch( step_mask );
+#endif
 
     /*--------------------------------------------------------
-    Confirm smoothing windows contains flash activity.
+    Step the flashes due, and add up the brightness of every
+    flash on the LEDs they are on. A slot that finishes is
+    replaced by the last active entry, so the entry at i is
+    visited again.
     --------------------------------------------------------*/
-    if( smooth_end < 0
-     || smooth_start > flash_length )
+    touched = 0;
+    i = 0;
+    while( i < count )
     {
+        slot = s_active[ i ];
+        led = s_flash.led[ slot ];
+        if( ( led_mask & ( (uint32_t)1 << led ) ) == 0 )
+        {
+            i++;
+            continue;
+        }
+        leds[ touched++ ] = led;
+        if( ( step_mask & ( (uint32_t)1 << slot ) ) == 0 )
+        {
+            level[ led ] += s_flash.brightness[ slot ];
+            i++;
+            continue;
+        }
+#if( ENVELOPE_SIMD )
+        if( ( done_mask & ( (uint32_t)1 << slot ) ) == 0 )
+#else
+        if( firefly_step( slot ) )
+#endif
+        {
+            s_flash.due[ slot ] = firefly_next_step( slot, update, previous[ slot ] );
+            level[ led ] += s_flash.brightness[ slot ];
+            i++;
+            continue;
+        }
+
         /*----------------------------------------------------
-        Smoothing window does not overlap active flash range.
+        Flash complete, schedule the next one and free the
+        slot. Sync periods were already set when the flash
+        started.
         ----------------------------------------------------*/
-        return( 0 );
+        level[ led ] += s_flash.brightness[ slot ];
+        idx = s_flash.firefly[ slot ];
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+        s_wait.wake_tick[ idx ] = now + firefly_dark_delay();
+#endif
+        wait_list_insert( idx );
+        s_led_users[ led ]--;
+        s_slot_flashes[ flash_id_slot( s_flash.flash_id[ slot ] ) ]--;
+        if( ( s_flash.flash_id[ slot ] & FLASH_ID_REFERENCE ) == 0 )
+        {
+            s_table_flashes[ flash_id_slot( s_flash.flash_id[ slot ] ) ]--;
+        }
+#if( FIREFLY_CURRENT_BUDGET )
+        s_current_held -= s_slot_current[ slot ];
+#endif
+        s_free[ s_free_count++ ] = slot;
+        s_active[ i ] = s_active[ --count ];
     }
 
+#if( FIREFLY_CURRENT_BUDGET )
     /*--------------------------------------------------------
-    Calculate average brightness over smoothing window.
+    Add up the current of the frame, that of the touched LEDs
+    and what the others were last set to. LEDs no flash holds
+    are dark, as every flash ends at zero. Current only rises
+    faster than brightness, so dimming the touched LEDs by the
+    share of the budget left to them brings the frame within
+    it, less a DAC code per LED for the rounding of the gamma
+    table.
     --------------------------------------------------------*/
-    brightness = 0;
-    flash_point_start_time = 0;
-    flash_pattern = flash_patterns[flash_id];
-    for( i = 0; i == 0 || flash_pattern[ i - 1 ].target != 0; i++ )
+    current = 0;
+    others = s_frame_current;
+    seen = 0;
+    for( i = 0; i < touched; i++ )
     {
-        /*----------------------------------------------------
-        Get current flash point data.
-        ----------------------------------------------------*/
-        flash_point = &flash_pattern[ i ];
-        flash_point_end_time = flash_point_start_time + flash_point->time;
-
-        /*----------------------------------------------------
-        Get interval start time.
-        ----------------------------------------------------*/
-        if( smooth_start >= flash_point_start_time
-         && smooth_start < flash_point_end_time )
+        led = leds[ i ];
+        if( ( seen & ( (uint32_t)1 << led ) ) == 0 )
         {
-            t1 = smooth_start;
+            seen |= (uint32_t)1 << led;
+            others -= s_led_current[ led ];
+            current += led_get_current( level[ led ] );
         }
-        else if( smooth_start < flash_point_start_time )
+    }
+
+    scale = 0x10000;
+    if( others + current > FIREFLY_CURRENT_BUDGET )
+    {
+        scale = 0;
+        if( others < FIREFLY_CURRENT_BUDGET - LED_COUNT )
         {
-            t1 = flash_point_start_time;
+            scale = ( ( FIREFLY_CURRENT_BUDGET - LED_COUNT - others ) << 16 ) / current;
         }
-        else
+    }
+#endif
+
+    /*--------------------------------------------------------
+    Write each touched LED once, in the order first visited.
+    Flashes sharing an LED add up, to full brightness at most.
+    A group with nothing flashing leaves the frame as it is.
+    --------------------------------------------------------*/
+    if( touched > 0 )
+    {
+        led_frame_begin();
+        for( i = 0; i < touched; i++ )
         {
-            flash_point_start_time = flash_point_end_time;
-            continue;
+            led = leds[ i ];
+            if( level[ led ] != FIREFLY_LEVEL_WRITTEN )
+            {
+                brightness = min_val( level[ led ], LED_BRIGHTNESS_MAX );
+#if( FIREFLY_CURRENT_BUDGET )
+                brightness = ( brightness * scale ) >> 16;
+                s_led_current[ led ] = led_get_current( brightness );
+                others += s_led_current[ led ];
+#endif
+                led_set_brightness( led, brightness );
+#if( REPLAY_RECORD )
+                replay_record_led( led, brightness );
+#endif
+                level[ led ] = FIREFLY_LEVEL_WRITTEN;
+            }
         }
+        led_frame_commit();
+#if( FIREFLY_CURRENT_BUDGET )
+        s_frame_current = others;
+#endif
+    }
 
-        /*----------------------------------------------------
-        Add weighted brightness for interval.
-        ----------------------------------------------------*/
-        b1 = calculate_brightness_unsmoothed( flash_id, t1 );
-        t2 = min_val( flash_point_end_time, smooth_end );
-        b2 = calculate_brightness_unsmoothed( flash_id, t2 );
-        brightness += (b2 + b1) * (t2 - t1);
+    /*--------------------------------------------------------
+    Move on to the set asked for, before drawing the flashes
+    this update starts
+    --------------------------------------------------------*/
+    firefly_set_update( set_request );
 
-        /*----------------------------------------------------
-        Increment start time if smoothing period is not over.
-        ----------------------------------------------------*/
-        if( t2 == smooth_end )
+    /*--------------------------------------------------------
+    Start every flash whose wake tick has passed. Deadlines
+    are absolute, so a tickless sleep needs no catching up.
+    A firefly that finds no free slot skips its flash, and
+    goes straight back to waiting. In sync mode it still
+    counts as flashing, so that the mean field does not
+    depend on the number of slots. In random mode, one over
+    the current budget tries again shortly.
+    --------------------------------------------------------*/
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+    flashes = 0;
+#endif
+    head = s_wait_head;
+    while( head != FIREFLY_NONE
+        && (int32_t)( now - s_wait.wake_tick[ head ] ) >= 0 )
+    {
+        idx = head;
+        head = s_wait.next[ idx ];
+
+        slot = firefly_start_flash( idx );
+#if( FIREFLY_CURRENT_BUDGET && ( FIREFLY_MODE != FIREFLY_MODE_SYNC ) )
+        if( slot == FIREFLY_SLOT_DEFER )
         {
-            break;
+            s_wait.wake_tick[ idx ] = now + random_range( FIREFLY_TIMESTEP, FIREFLY_BUDGET_DEFER_MAX );
+            s_wait_head = head;
+            wait_list_insert( idx );
+            head = s_wait_head;
+            continue;
+        }
+#endif
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+        s_wait.wake_tick[ idx ] = now + random_range( FIREFLY_SYNC_PERIOD_MIN, FIREFLY_SYNC_PERIOD_MAX );
+        flashes++;
+#endif
+        if( slot != FIREFLY_SLOT_NONE )
+        {
+            s_active[ count++ ] = slot;
+            continue;
         }
-        flash_point_start_time = t2;
 
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+        s_wait.wake_tick[ idx ] = now + firefly_dark_delay();
+#endif
+        s_wait_head = head;
+        wait_list_insert( idx );
+        head = s_wait_head;
     }
-    brightness /= 2 * smoothing;
+    s_wait_head = head;
+    s_active_count = count;
 
-    return( brightness );
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+    /*--------------------------------------------------------
+    Let this update's flashes, and those heard from upstream
+    jars, pull the dark fireflies forward
+    --------------------------------------------------------*/
+    weight = flashes * LINK_WEIGHT_ONE;
+#if( LINK_ENABLE )
+    if( flashes > 0 )
+    {
+        link_send( flashes );
+    }
+    beacon = link_poll();
+#if( REPLAY_RECORD )
+    replay_record_beacon( now, beacon );
+#endif
+    weight += beacon;
+#endif
+    if( weight > 0 )
+    {
+        firefly_sync_pulse( now, weight );
+    }
+#endif
+
+}   /* firefly_periodic_callback() */
+
+
+#if( FIREFLY_MODE != FIREFLY_MODE_SYNC )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_dark_delay
+ *
+ *  Description:
+ *      Draw a random mode delay until a firefly's next flash, at the
+ *      pace of this update.
+ *
+ ************************************************************************/
+static uint32_t firefly_dark_delay
+    (
+    void
+    )
+{
+    return( ( (uint32_t)random_range( FIREFLY_DARK_MIN, FIREFLY_DARK_MAX ) * s_update_pace ) >> FIREFLY_PACE_SHIFT );
 
-} /* calculate_brightness_smoothed() */
+}   /* firefly_dark_delay() */
+#endif
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      calculate_brightness_unsmoothed
+ *      firefly_next_step
  *
  *  Description:
- *      Calculate the unsmoothed brightness of a given flash type at a
- *      given flash time.
+ *      Get the update of a slot's next step, the one just taken having
+ *      moved its brightness from previous. Steep flashes step again
+ *      FIREFLY_FAST_UPDATES on, but no later than their group's next
+ *      turn. Flashes on a plateau skip every turn it holds through.
+ *      Flash times stay on the LUT grid apart from fast steps, and
+ *      return to it on the first turn after them.
  *
  ************************************************************************/
-static flash_brightness_type calculate_brightness_unsmoothed
+static ramfunc uint32_t firefly_next_step
     (
-    flash_id_type   flash_type,
-    int32_t         flash_time
+    uint8_t                 slot,
+    uint32_t                update,
+    uint32_t                previous
     )
 {
     /*--------------------------------------------------------
     Local Variables
     --------------------------------------------------------*/
-    flash_brightness_type       brightness;
-    const flash_point_type    * flash_pattern;
-    flash_point_type            flash_point_prv;
-    flash_point_type            flash_point_cur;
-    int32_t                     flash_point_end_time;
-    int32_t                     i;
+    uint32_t                turn;
+#if( FIREFLY_ADAPTIVE_STEP )
+    uint32_t                brightness;
+    uint32_t                delta;
+    uint32_t                elapsed;
+    uint32_t                last;
+#endif
+
+    turn = firefly_next_turn( s_flash.led[ slot ], update );
+
+#if( FIREFLY_ADAPTIVE_STEP )
+    brightness = s_flash.brightness[ slot ];
+    delta = ( brightness > previous ) ? brightness - previous : previous - brightness;
+    elapsed = update - s_flash.stepped[ slot ];
+    s_flash.stepped[ slot ] = update;
 
     /*--------------------------------------------------------
-    Validate input
+    Slopes are compared per FIREFLY_TIMESTEP, a full turn
     --------------------------------------------------------*/
-    if( flash_time < 0 )
+    if( delta * FIREFLY_UPDATE_GROUPS > FIREFLY_FAST_SLOPE * elapsed )
     {
-        return( 0 );
+        return( ( turn - update > FIREFLY_FAST_UPDATES ) ? update + FIREFLY_FAST_UPDATES : turn );
     }
 
-    /*--------------------------------------------------------
-    Initialize Variables
-    --------------------------------------------------------*/
-    clear_struct( flash_point_prv );
-    clear_struct( flash_point_cur );
+    if( delta == 0
+     && brightness != 0 )
+    {
+        last = update + envelope_brightness_hold( s_flash.flash_id[ slot ], s_flash.flash_time[ slot ], s_flash.smoothing[ slot ] ) / FIREFLY_UPDATE_PERIOD;
+        last -= ( last - s_flash.led[ slot ] ) % FIREFLY_UPDATE_GROUPS;
+        if( (int32_t)( last - turn ) > 0 )
+        {
+            return( last );
+        }
+    }
+#else
+    s_flash.stepped[ slot ] = update;
+#endif
+
+    return( turn );
+
+}   /* firefly_next_step() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_next_turn
+ *
+ *  Description:
+ *      Get the first update after a given one that is the turn of an
+ *      LED's group.
+ *
+ ************************************************************************/
+static ramfunc uint32_t firefly_next_turn
+    (
+    led_type                led,
+    uint32_t                update
+    )
+{
+    return( update + 1 + ( led - update - 1 ) % FIREFLY_UPDATE_GROUPS );
+
+}   /* firefly_next_turn() */
+
 
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_set_update
+ *
+ *  Description:
+ *      Move new flashes on to the set asked for, once the other slot is
+ *      free to load it into, and build its tables a slice per update
+ *      once no flash reads those of the last set.
+ *
+ ************************************************************************/
+static void firefly_set_update
+    (
+    uint32_t                request
+    )
+{
     /*--------------------------------------------------------
-    Get start of flash pattern
+    Local Variables
     --------------------------------------------------------*/
-    flash_pattern = flash_patterns[ flash_type ];
+    uint8_t                 next_slot;
+
+    next_slot = s_set_slot ^ 1;
+    if( request != s_set
+     && s_slot_flashes[ next_slot ] == 0
+     && envelope_set_load( next_slot, request ) )
+    {
+        s_set = request;
+        s_set_slot = next_slot;
+        s_set_built = FALSE;
+    }
 
+    if( !s_set_built
+     && s_table_flashes[ s_set_slot ^ 1 ] == 0 )
+    {
+        s_set_built = envelope_set_build( s_set_slot );
+    }
+
+}   /* firefly_set_update() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_start_flash
+ *
+ *  Description:
+ *      Initialize a new flash with a random pattern of the current set
+ *      and a random smoothing, in a free slot. The flash goes on the
+ *      firefly's home LED while that is free, then on the next free LED,
+ *      and is blended into its home LED if every LED is busy. Degraded
+ *      mode halves the slots in use per level. Returns the slot,
+ *      FIREFLY_SLOT_NONE if there is no free slot, or FIREFLY_SLOT_DEFER
+ *      if the flash would go over the current budget. Sync mode flashes
+ *      over the budget are skipped instead, as FIREFLY_SLOT_NONE. The
+ *      first flash of a dark jar is always let through.
+ *
+ ************************************************************************/
+static uint8_t firefly_start_flash
+    (
+    firefly_id_type         firefly
+    )
+{
     /*--------------------------------------------------------
-    Get current and previous flash points
+    Local Variables
     --------------------------------------------------------*/
-    flash_point_end_time = 0;
-    for( i = 0; i == 0 || flash_pattern[ i - 1 ].target != 0; i++ )
+    uint32_t                i;
+    led_type                home;
+    led_type                led;
+    uint8_t                 slot;
+    flash_id_type           flash_id;
+#if( FIREFLY_CURRENT_BUDGET )
+    uint32_t                current;
+#endif
+
+    if( FIREFLY_SLOTS - s_free_count >= max_val( FIREFLY_SLOTS >> system_get_degrade(), FIREFLY_SLOTS_MIN ) )
     {
-        flash_point_end_time += flash_pattern[ i ].time;
-        if( flash_time < flash_point_end_time )
-        {
-            flash_point_cur = flash_pattern[ i ];
-            if( i != 0 )
-            {
-                flash_point_prv = flash_pattern[ i - 1 ];
-            }
-            break;
-        }
+        return( FIREFLY_SLOT_NONE );
     }
 
+    flash_id = envelope_set_flash( s_set_slot, random_range( 0, envelope_set_patterns( s_set_slot ) - 1 ) );
+#if( FIREFLY_CURRENT_BUDGET )
+    current = led_get_current( envelope_flash_peak( flash_id ) );
+    if( s_current_held != 0
+     && s_current_held + current > FIREFLY_CURRENT_BUDGET )
+    {
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+        return( FIREFLY_SLOT_NONE );
+#else
+        return( FIREFLY_SLOT_DEFER );
+#endif
+    }
+#endif
+    slot = s_free[ --s_free_count ];
+
     /*--------------------------------------------------------
-    Calculate brightness at flash_time
+    Pick an LED
     --------------------------------------------------------*/
-    if( flash_point_cur.time )
+    home = firefly % LED_COUNT;
+    led = home;
+    for( i = 0; i < LED_COUNT && s_led_users[ led ] != 0; i++ )
     {
-        brightness = ( flash_point_cur.time - ( flash_point_end_time - flash_time ) ) * (flash_point_cur.target - flash_point_prv.target) / flash_point_cur.time + flash_point_prv.target;
+        led = ( led + 1 ) % LED_COUNT;
     }
-    else
+    if( s_led_users[ led ] != 0 )
     {
-        brightness = 0;
+        led = home;
     }
+    s_led_users[ led ]++;
 
-    return( brightness );
+    s_flash.firefly[ slot ] = firefly;
+    s_flash.led[ slot ] = led;
+    s_flash.flash_id[ slot ] = flash_id;
+    s_slot_flashes[ s_set_slot ]++;
+    if( ( flash_id & FLASH_ID_REFERENCE ) == 0 )
+    {
+        s_table_flashes[ s_set_slot ]++;
+    }
+#if( FIREFLY_CURRENT_BUDGET )
+    s_slot_current[ slot ] = current;
+    s_current_held += current;
+#endif
+    s_flash.smoothing[ slot ] = envelope_smoothing_quantize( random_range( FIREFLY_SMOOTHING_MIN, FIREFLY_SMOOTHING_MAX ) );
+    s_flash.flash_time[ slot ] = -( s_flash.smoothing[ slot ] / 2 );
+    s_flash.brightness[ slot ] = 0;
+    s_flash.cursor[ slot ] = ENVELOPE_CURSOR_START;
 
-} /* calculate_brightness_unsmoothed() */
+    /*--------------------------------------------------------
+    The first step comes on the group's next turn, a full
+    time step in, which keeps flash times on the LUT grid
+    --------------------------------------------------------*/
+    s_flash.due[ slot ] = firefly_next_turn( led, s_update_count - 1 );
+    s_flash.stepped[ slot ] = s_flash.due[ slot ] - FIREFLY_UPDATE_GROUPS;
+    trace_flash( led, s_flash.flash_id[ slot ], s_flash.smoothing[ slot ] );
+    system_boot_mark( SYSTEM_BOOT_FIRST_FLASH );
 
+    return( slot );
 
+}   /* firefly_start_flash() */
+
+
+#if( !ENVELOPE_SIMD )
 /*************************************************************************
  *
  *  Procedure:
- *      firefly_periodic_callback
+ *      firefly_step
  *
  *  Description:
- *      Periodic callback to update all fireflies.
+ *      Evaluate the flash in a slot at its new flash time. Returns FALSE
+ *      once the flash has completed.
  *
  ************************************************************************/
-static void firefly_periodic_callback
+static ramfunc boolean firefly_step
     (
-    void
+    uint8_t                 idx         /* Flash slot                   */
     )
 {
     /*--------------------------------------------------------
     Local Variables
     --------------------------------------------------------*/
-    firefly_type * firefly;
-    uint32_t                i;
+    int32_t                 flash_time;
+    flash_brightness_type   brightness;
+
+    flash_time = s_flash.flash_time[ idx ];
 
     /*--------------------------------------------------------
-    Update all fireflies
+    Calculate new smoothed brightness
     --------------------------------------------------------*/
-    for( i = 0; i < count_of_array( s_fireflies ); i++ )
-    {
-        firefly = (firefly_type *)&s_fireflies[ i ];
+    brightness = envelope_brightness( s_flash.flash_id[ idx ], flash_time, s_flash.smoothing[ idx ], &s_flash.cursor[ idx ] );
+    s_flash.brightness[ idx ] = brightness;
 
-        if( firefly->flashing )
-        {
-            /*------------------------------------------------
-            Step through active flash
-            ------------------------------------------------*/
-            firefly_step( firefly, FIREFLY_TIMESTEP );
-
-            /*------------------------------------------------
-            Update corresponding LEDs
-            ------------------------------------------------*/
-            led_set_brightness( i, firefly->brightness * 150 / 1000 );
-        }
-        else if( firefly->delay_len <= firefly->delay_time )
-        {
-            /*------------------------------------------------
-            Initialize new flash
-            ------------------------------------------------*/
-            firefly->flash_id = rand_range( FLASH_FIRST, FLASH_LAST );
-            firefly->smoothing = rand_range( FIREFLY_SMOOTHING_MIN, FIREFLY_SMOOTHING_MAX );
-            firefly->flash_time = -( firefly->smoothing / 2 );
-            firefly->flashing = TRUE;
-
-            /*------------------------------------------------
-            Update post flash delay
-            ------------------------------------------------*/
-            firefly->delay_len = rand_range( FIREFLY_DELAY_MIN, FIREFLY_DELAY_MAX );
-            firefly->delay_time = 0;
-        }
-        else
-        {
-            /*------------------------------------------------
-            Update delay counter
-            ------------------------------------------------*/
-            firefly->delay_time += FIREFLY_TIMESTEP;
-        }
-    }
+    /*--------------------------------------------------------
+    Check whether the flash has completed
+    --------------------------------------------------------*/
+    return( brightness != 0
+         || s_flash.smoothing[ idx ] >= flash_time );
 
-}   /* firefly_periodic_callback() */
+}   /* firefly_step() */
+#endif
 
 
+#if( ENVELOPE_SIMD )
 /*************************************************************************
  *
  *  Procedure:
- *      firefly_step
+ *      firefly_step_batch
  *
  *  Description:
- *      Advance a firefly's state by a specified time step.
+ *      Evaluate every slot in active_mask at its new flash time, two
+ *      slots per word, matching firefly_step() for each of them. Returns
+ *      the mask of those whose flash has completed. The brightness of the
+ *      other slot of a visited pair is evaluated again at its unchanged
+ *      time, which leaves it as it was.
  *
  ************************************************************************/
-static void firefly_step
+static ramfunc uint32_t firefly_step_batch
     (
-    firefly_type * const    firefly,
-    uint16_t                time_step
+    uint32_t                active_mask
     )
 {
     /*--------------------------------------------------------
-    Update flash time
+    Local Variables
     --------------------------------------------------------*/
-    firefly->flash_time += time_step;
+    const envelope_pair_type
+                          * time_pair;
+    const envelope_pair_type
+                          * smoothing_pair;
+    const envelope_pair_type
+                          * brightness_pair;
+    uint32_t                flashing;
+    uint32_t                done_mask;
+    uint32_t                pair;
+
+    time_pair = (const envelope_pair_type *)s_flash.flash_time;
+    smoothing_pair = (const envelope_pair_type *)s_flash.smoothing;
+    brightness_pair = (const envelope_pair_type *)s_flash.brightness;
 
     /*--------------------------------------------------------
     Calculate new smoothed brightness
     --------------------------------------------------------*/
-    firefly->brightness = calculate_brightness_smoothed( firefly->flash_id, firefly->flash_time, firefly->smoothing );
+    envelope_brightness_batch( s_flash.flash_id, s_flash.flash_time, s_flash.smoothing,
+                               s_flash.brightness, s_flash.cursor, active_mask, FIREFLY_SLOTS );
 
     /*--------------------------------------------------------
-    Update flashing flag if flash has completed
+    A lane is still flashing while lit, or while its time has
+    not passed its smoothing width
     --------------------------------------------------------*/
-    if( firefly->brightness == 0
-     && firefly->smoothing < firefly->flash_time )
+    done_mask = 0;
+    for( pair = 0; pair < FIREFLY_SLOTS / 2; pair++ )
     {
-        firefly->flashing = FALSE;
+        if( ( ( active_mask >> ( 2 * pair ) ) & 3 ) == 0 )
+        {
+            continue;
+        }
+
+        flashing = envelope_sel_sge16( smoothing_pair[ pair ], time_pair[ pair ], 0xFFFFFFFF, brightness_pair[ pair ] );
+        done_mask |= ( ( ( flashing & 0x0000FFFF ) == 0 ) | ( ( ( flashing & 0xFFFF0000 ) == 0 ) << 1 ) ) << ( 2 * pair );
     }
 
-}   /* firefly_step() */
+    return( done_mask & active_mask );
+
+}   /* firefly_step_batch() */
+#endif
+
+
+#if( FIREFLY_MODE == FIREFLY_MODE_SYNC )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      firefly_sync_pulse
+ *
+ *  Description:
+ *      Apply the mean field of the flashes started this update to every
+ *      dark firefly. Flashes are weighted LINK_WEIGHT_ONE each, flashes
+ *      heard from other jars less. Each firefly is advanced in proportion to how far
+ *      through a nominal period it is, which is what makes the jar phase
+ *      lock rather than settle into anti-phase. Advances never reorder
+ *      the wait list. O(N) in the number of waiting fireflies, and only
+ *      run on updates with a flash.
+ *
+ ************************************************************************/
+static void firefly_sync_pulse
+    (
+    uint32_t                now,
+    uint32_t                weight
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t                field;
+    int32_t                 remaining;
+    int32_t                 waited;
+    firefly_id_type         idx;
+
+    field = min_val( ( (uint64_t)weight * ( FIREFLY_SYNC_COUPLING / NUMBER_OF_FIREFLIES ) ) / LINK_WEIGHT_ONE, 0xFFFF );
+
+    for( idx = s_wait_head; idx != FIREFLY_NONE; idx = s_wait.next[ idx ] )
+    {
+        remaining = (int32_t)( s_wait.wake_tick[ idx ] - now );
+        waited = FIREFLY_SYNC_PERIOD - remaining;
+        if( remaining > 0
+         && waited > 0 )
+        {
+            s_wait.wake_tick[ idx ] -= min_val( ( (uint32_t)waited * field ) >> 16, (uint32_t)remaining );
+        }
+    }
+
+}   /* firefly_sync_pulse() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      wait_list_insert
+ *
+ *  Description:
+ *      Insert a dark firefly into the wait list, ordered by wake tick.
+ *      Fireflies with equal wake ticks keep their insertion order. O(N)
+ *      in the number of waiting fireflies, once per flash.
+ *
+ ************************************************************************/
+static void wait_list_insert
+    (
+    firefly_id_type         idx
+    )
+{
+    /*--------------------------------------------------------
+    Local Variables
+    --------------------------------------------------------*/
+    uint32_t                wake;
+    firefly_id_type         prev;
+
+    wake = s_wait.wake_tick[ idx ];
+    prev = s_wait_head;
+    if( prev == FIREFLY_NONE
+     || (int32_t)( s_wait.wake_tick[ prev ] - wake ) > 0 )
+    {
+        s_wait.next[ idx ] = prev;
+        s_wait_head = idx;
+        return;
+    }
+
+    while( s_wait.next[ prev ] != FIREFLY_NONE
+        && (int32_t)( s_wait.wake_tick[ s_wait.next[ prev ] ] - wake ) <= 0 )
+    {
+        prev = s_wait.next[ prev ];
+    }
+
+    s_wait.next[ idx ] = s_wait.next[ prev ];
+    s_wait.next[ prev ] = idx;
 
+}   /* wait_list_insert() */
@@ -15,6 +15,99 @@
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
 
+/*------------------------------------------------------------
+Firefly modes. In random mode every firefly waits a random
+delay after each flash. In sync mode fireflies run on similar
+periods and are coupled through a shared mean field, so that
+each flash nudges the others and the jar gradually phase
+locks the way Photinus carolinus does.
+------------------------------------------------------------*/
+#define FIREFLY_MODE_RANDOM     ( 0 )
+#define FIREFLY_MODE_SYNC       ( 1 )
+
+#ifndef FIREFLY_MODE
+#define FIREFLY_MODE            ( FIREFLY_MODE_RANDOM )
+#endif
+
+/*------------------------------------------------------------
+Virtual fireflies. The pool is much larger than the number of
+LEDs, and a firefly only holds an LED while it flashes, on a
+free LED if there is one or blended into a busy one otherwise.
+Random mode delays stretch with the pool so that the jar as a
+whole flashes FIREFLY_DENSITY times as often as it would with
+one firefly per LED.
+------------------------------------------------------------*/
+#ifndef FIREFLY_POOL_SIZE
+#define FIREFLY_POOL_SIZE       ( 128 )
+#endif
+
+#ifndef FIREFLY_DENSITY
+#define FIREFLY_DENSITY         ( 2 )
+#endif
+
+/*------------------------------------------------------------
+Staggered updates. Every flash is stepped 8 ms at a time,
+FIREFLY_TIMESTEP, but rather than stepping them all at once,
+the LEDs are split into FIREFLY_UPDATE_GROUPS groups, LED n in
+group n % FIREFLY_UPDATE_GROUPS, and the firefly task runs
+once per group, stepping and writing only that group's LEDs.
+An LED is written whenever a flash on it steps, with every
+flash blended into it. Must divide FIREFLY_TIMESTEP, and 1
+updates every flash at once.
+------------------------------------------------------------*/
+#ifndef FIREFLY_UPDATE_GROUPS
+#define FIREFLY_UPDATE_GROUPS   ( 8 )
+#endif
+
+/*------------------------------------------------------------
+Adaptive steps. With FIREFLY_ADAPTIVE_STEP set, each flash
+picks its next step from how fast its envelope is moving.
+Flashes rising or falling by more than FIREFLY_FAST_SLOPE per
+8 ms are stepped every FIREFLY_FAST_STEP ms, as often as the
+update period allows, rather than only on their group's turn.
+Flashes on a plateau sleep through every turn until it ends,
+as the envelope reports how long it holds. Any other flash,
+and every flash when clear, steps on its group's turn.
+------------------------------------------------------------*/
+#ifndef FIREFLY_ADAPTIVE_STEP
+#define FIREFLY_ADAPTIVE_STEP   ( 1 )
+#endif
+
+#ifndef FIREFLY_FAST_STEP
+#define FIREFLY_FAST_STEP       ( 2 )
+#endif
+
+#ifndef FIREFLY_FAST_SLOPE
+#define FIREFLY_FAST_SLOPE      ( 24 )
+#endif
+
+/*------------------------------------------------------------
+LED current budget, in DAC codes summed over every LED, where
+one LED at full brightness draws LED_DAC_MAX. Each flash holds
+the current of its pattern's peak until it ends. In random
+mode, flashes that would take the jar past the budget are put
+off by up to FIREFLY_BUDGET_DEFER_MAX ms at a time, spreading
+peaks out rather than dropping them. In sync mode a late
+flash would fall out of step, so they are skipped the way
+flashes finding no free slot are. Should the first flash of a
+dark jar still go over, the whole frame is dimmed to fit. Set
+to 0 for no limit.
+------------------------------------------------------------*/
+#ifndef FIREFLY_CURRENT_BUDGET
+#define FIREFLY_CURRENT_BUDGET  ( 4 * LED_DAC_MAX )
+#endif
+
+#ifndef FIREFLY_BUDGET_DEFER_MAX
+#define FIREFLY_BUDGET_DEFER_MAX ( 400 )
+#endif
+
+/*------------------------------------------------------------
+Pace of random mode, see firefly_set_pace(). Sync mode keeps
+its period, which the coupling is tuned for.
+------------------------------------------------------------*/
+#define FIREFLY_PACE_SHIFT      ( 8 )
+#define FIREFLY_PACE_ONE        ( 1 << FIREFLY_PACE_SHIFT )
+
 /*--------------------------------------------------------------------------------
                                       TYPES
 --------------------------------------------------------------------------------*/
@@ -31,5 +124,25 @@ void firefly_init
     void
     );
 
+void firefly_next_set
+    (
+    void
+    );
+
+void firefly_select_set
+    (
+    uint32_t                set
+    );
+
+void firefly_set_pace
+    (
+    uint32_t                pace
+    );
+
+uint32_t firefly_ticks_to_next_flash
+    (
+    void
+    );
+
 
 #endif /* FIREFLIES_H_ */
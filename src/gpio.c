@@ -25,6 +25,7 @@
 --------------------------------------------------------------------------------*/
 
 #define GPIO_PIN_MAX    ( 15 )
+#define GPIO_AF_MAX     ( 15 )
 
 
 /*--------------------------------------------------------------------------------
@@ -72,6 +73,12 @@ typedef enum
                                   PROCEDURES
 --------------------------------------------------------------------------------*/
 
+static void configure_alternate_function
+    (
+    const gpio_type   * gpio,
+    uint32_t            cfg
+    );
+
 static void configure_mode
     (
     const gpio_type   * gpio,
@@ -108,6 +115,104 @@ static void enable_port
     );
 
 
+/*************************************************************************
+ *
+ *  Procedure:
+ *      gpio_cfg_alternate
+ *
+ *  Description:
+ *      Configures given pin as a push-pull peripheral pin, routed to
+ *      alternate function af.
+ *
+ ************************************************************************/
+void gpio_cfg_alternate
+    (
+    const gpio_type   * gpio,
+    uint32_t            af
+    )
+{
+    /*--------------------------------------------------------
+    Validate input
+    --------------------------------------------------------*/
+    if( gpio == NULL
+     || gpio->port == NULL
+     || gpio->pin > GPIO_PIN_MAX
+     || af > GPIO_AF_MAX )
+    {
+        return;
+    }
+
+    /*--------------------------------------------------------
+    Ensure the port is enabled
+    --------------------------------------------------------*/
+    enable_port( gpio );
+
+    /*--------------------------------------------------------
+    Pull up, so that an idle or unconnected line reads high
+    --------------------------------------------------------*/
+    configure_pull_resistors( gpio, PULL_RESISTOR_UP );
+
+    /*--------------------------------------------------------
+    Set output speed to fast
+    --------------------------------------------------------*/
+    configure_output_speed( gpio, OUTPUT_SPEED_HIGH );
+
+    /*--------------------------------------------------------
+    Set output type to push-pull
+    --------------------------------------------------------*/
+    configure_output_type( gpio, OUTPUT_TYPE_PUSH_PULL );
+
+    /*--------------------------------------------------------
+    Select the function before handing the pin over to it
+    --------------------------------------------------------*/
+    configure_alternate_function( gpio, af );
+    configure_mode( gpio, MODE_ALTERNATE_FUNCTION );
+
+} /* gpio_cfg_alternate */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      gpio_cfg_analog
+ *
+ *  Description:
+ *      Configures given pin as an analog input.
+ *
+ ************************************************************************/
+void gpio_cfg_analog
+    (
+    const gpio_type   * gpio
+    )
+{
+    /*--------------------------------------------------------
+    Validate input
+    --------------------------------------------------------*/
+    if( gpio == NULL
+     || gpio->port == NULL
+     || gpio->pin > GPIO_PIN_MAX )
+    {
+        return;
+    }
+
+    /*--------------------------------------------------------
+    Ensure the port is enabled
+    --------------------------------------------------------*/
+    enable_port( gpio );
+
+    /*--------------------------------------------------------
+    Disable pull resistors
+    --------------------------------------------------------*/
+    configure_pull_resistors( gpio, PULL_RESISTOR_NONE );
+
+    /*--------------------------------------------------------
+    Set pin mode to analog
+    --------------------------------------------------------*/
+    configure_mode( gpio, MODE_ANALOG );
+
+} /* gpio_cfg_analog */
+
+
 /*************************************************************************
  *
  *  Procedure:
@@ -279,6 +384,100 @@ void gpio_output_set
 } /* gpio_output_set() */
 
 
+/*************************************************************************
+ *
+ *  Procedure:
+ *      gpio_pin_mask
+ *
+ *  Description:
+ *      Get the port bit mask of a given pin, for use with
+ *      gpio_port_write_masked().
+ *
+ ************************************************************************/
+uint32_t gpio_pin_mask
+    (
+    const gpio_type   * gpio
+    )
+{
+    /*--------------------------------------------------------
+    Validate input
+    --------------------------------------------------------*/
+    if( gpio == NULL
+     || gpio->pin > GPIO_PIN_MAX )
+    {
+        return( 0 );
+    }
+
+    return( 1 << gpio->pin );
+
+} /* gpio_pin_mask() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      gpio_port_write_masked
+ *
+ *  Description:
+ *      Drive every output pin in mask to its level in value with a single
+ *      write to the port's bit set/reset register. All pins change on the
+ *      same bus cycle.
+ *
+ ************************************************************************/
+ramfunc void gpio_port_write_masked
+    (
+    GPIO_TypeDef      * port,
+    uint32_t            mask,
+    uint32_t            value
+    )
+{
+    /*--------------------------------------------------------
+    Validate input
+    --------------------------------------------------------*/
+    if( port == NULL )
+    {
+        return;
+    }
+
+    /*--------------------------------------------------------
+    Set and reset halves of BSRR are written together.
+    --------------------------------------------------------*/
+    *(__IO uint32_t *)&port->BSRRL = gpio_bsrr_word( mask & 0x0000FFFF, value );
+
+} /* gpio_port_write_masked() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      configure_alternate_function
+ *
+ *  Description:
+ *      Select the alternate function of the given pin.
+ *
+ ************************************************************************/
+static void configure_alternate_function
+    (
+    const gpio_type   * gpio,
+    uint32_t            cfg
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        shift;
+    __IO uint32_t * afr;
+
+    /*--------------------------------------------------------
+    Pins 0 to 7 are selected by AFR[0], 8 to 15 by AFR[1]
+    --------------------------------------------------------*/
+    afr   = &gpio->port->AFR[ gpio->pin / 8 ];
+    shift = ( gpio->pin % 8 ) * 4;
+    *afr  = ( *afr & ~( 0xF << shift ) ) | ( cfg << shift );
+
+} /* configure_alternate_function */
+
+
 /*************************************************************************
  *
  *  Procedure:
@@ -15,6 +15,10 @@
                                    INCLUDES
 --------------------------------------------------------------------------------*/
 
+#include <stm32f3xx.h>
+
+#include "system.h"
+
 /*--------------------------------------------------------------------------------
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
@@ -23,6 +27,12 @@
                                      MACROS
 --------------------------------------------------------------------------------*/
 
+/*------------------------------------------------------------
+Bit set/reset register word that drives the pins in mask to
+their level in value, leaving all other pins untouched.
+------------------------------------------------------------*/
+#define gpio_bsrr_word( mask, value )   ( ( (mask) & (value) ) | ( ( (mask) & ~(value) ) << 16 ) )
+
 /*--------------------------------------------------------------------------------
                                       TYPES
 --------------------------------------------------------------------------------*/
@@ -48,6 +58,17 @@ typedef enum
                                    PROCEDURES
 --------------------------------------------------------------------------------*/
 
+void gpio_cfg_alternate
+    (
+    const gpio_type   * gpio,
+    uint32_t            af
+    );
+
+void gpio_cfg_analog
+    (
+    const gpio_type   * gpio
+    );
+
 void gpio_cfg_input
     (
     const gpio_type   * gpio
@@ -69,5 +90,17 @@ void gpio_output_set
     gpio_state_type     state
     );
 
+uint32_t gpio_pin_mask
+    (
+    const gpio_type   * gpio
+    );
+
+ramfunc void gpio_port_write_masked
+    (
+    GPIO_TypeDef      * port,
+    uint32_t            mask,
+    uint32_t            value
+    );
+
 
 #endif /* GPIO_H_ */
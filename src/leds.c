@@ -10,7 +10,22 @@
  *       drivers. Output is selected through three switch select pins and a switch
  *       nEnable pin. When switch nEnable is high, all outputs enter a high
  *       impedance state. When it is low, only the output selected by the switch
- *       select pins enters a low impedance state.
+ *       select pins enters a low impedance state. Larger jars add banks of
+ *       switches that share the select pins, each with its own nEnable pin.
+ *
+ *       With the DMA engine, TIM2 paces each mux slot. Its update event streams
+ *       a port write that disables the switch and selects the next driver,
+ *       compare 1 streams the DAC value and compare 2 re-enables the switch.
+ *       Frames are double buffered and refilled from the DMA half and full
+ *       transfer interrupts, so the core is not involved per slot. TIM6 only
+ *       provides a single DMA request, which is too few for this sequence.
+ *
+ *       The benchmark senses LED current on ADC1_IN1 to find how long a
+ *       driver must stay connected to settle. That needs the drivers' returns
+ *       brought to PA0 through a shared sense resistor, which this board does
+ *       not have, as each driver senses its own current to ground. Refresh edges are timed per slot with the SysTick
+ *       engine, and per frame refill with the DMA engine, whose slots are
+ *       paced by TIM2 rather than the core.
  *
  ********************************************************************************/
 
@@ -19,12 +34,64 @@
                                    INCLUDES
 --------------------------------------------------------------------------------*/
 
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <stm32f3xx.h>
 
 #include "system.h"
 #include "gpio.h"
 #include "leds.h"
+#include "trace.h"
+
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define DMA_TIMER_HZ            ( 1000000 ) /* TIM2 count rate                  */
+#define DMA_DAC_DELAY           ( 1 )       /* Switch off to DAC update (us)    */
+#define DMA_ENABLE_DELAY        ( 6 )       /* Switch off to switch on (us)     */
+#define DMA_FRAME_COUNT         ( 2 )       /* Double buffered frames           */
+
+/*------------------------------------------------------------
+Hold capacitor droop model for adaptive refresh. A driver
+input held at level V leaks towards zero at V / tau per ms,
+with tau = 2^LED_DROOP_TAU_SHIFT ms. No driver is held for
+longer than LED_HOLD_MAX_MS regardless of the model.
+------------------------------------------------------------*/
+#define LED_DROOP_TAU_SHIFT     ( 11 )
+#define LED_HOLD_MAX_MS         ( 64 )
+#define LED_REFRESH_THRESHOLD   ( 1 )       /* Error worth a slot (DAC codes)   */
+
+/*------------------------------------------------------------
+Gamma curve knots are evenly spaced over the brightness range,
+2^LED_GAMMA_SHIFT brightness steps apart in Q16.
+------------------------------------------------------------*/
+#define LED_GAMMA_SHIFT         ( 11 )
+#define LED_GAMMA_Q16_PER_STEP  ( 4294967 ) /* 2^32 / LED_BRIGHTNESS_MAX        */
+
+/*------------------------------------------------------------
+Refresh benchmark edge rate, and the cycle counter ticks per
+us at the current core clock
+------------------------------------------------------------*/
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+#define LED_BENCH_EDGE_HZ       ( LED_DMA_REFRESH_HZ )
+#else
+#define LED_BENCH_EDGE_HZ       ( SYSTICK_HZ )
+#endif
+
+#define LED_BENCH_CYCLES_PER_US ( SystemCoreClock / 1000000 )
+
+/*------------------------------------------------------------
+Benchmark current sense. Each reading is the sum of
+LED_SENSE_SAMPLES conversions.
+------------------------------------------------------------*/
+#define LED_SENSE_ADC_CHANNEL   ( 1 )
+#define LED_SENSE_ADC_SMP       ( 7 )       /* 601.5 ADC clocks per sample  */
+#define LED_SENSE_SAMPLES       ( 16 )      /* Conversions per measurement  */
+#define LED_SENSE_LEVEL_HIGH    ( LED_DAC_MAX )
+#define LED_SENSE_SETTLE_MS     ( 2 )
 
 
 /*--------------------------------------------------------------------------------
@@ -36,18 +103,22 @@ enum analog_switch_pin_type
     ANALOG_SWITCH_SELECT_0,
     ANALOG_SWITCH_SELECT_1,
     ANALOG_SWITCH_SELECT_2,
-    ANALOG_SWITCH_NENABLE,
 
-    ANALOG_SWITCH_PIN_FIRST = ANALOG_SWITCH_SELECT_0,
-    ANALOG_SWITCH_PIN_FINAL = ANALOG_SWITCH_NENABLE,
-    ANALOG_SWITCH_PIN_COUNT = ANALOG_SWITCH_PIN_FINAL - ANALOG_SWITCH_PIN_FIRST + 1
+    ANALOG_SWITCH_SELECT_FIRST = ANALOG_SWITCH_SELECT_0,
+    ANALOG_SWITCH_SELECT_FINAL = ANALOG_SWITCH_SELECT_2,
+    ANALOG_SWITCH_SELECT_COUNT = ANALOG_SWITCH_SELECT_FINAL - ANALOG_SWITCH_SELECT_FIRST + 1
 };
 
 
+
 /*--------------------------------------------------------------------------------
                                MEMORY_CONSTANTS
 --------------------------------------------------------------------------------*/
 
+/*------------------------------------------------------------
+Analog switch pins. Select and NENABLE pins of every bank must
+share one port, so that routing a slot is a single port write.
+------------------------------------------------------------*/
 static const gpio_type analog_switch_io[] =
 {
     /*--------------------------------------------------------
@@ -56,7 +127,56 @@ static const gpio_type analog_switch_io[] =
     { GPIOA,   9 },     /* ANALOG_SWITCH_SELECT_0           */
     { GPIOA,  10 },     /* ANALOG_SWITCH_SELECT_1           */
     { GPIOA,  11 },     /* ANALOG_SWITCH_SELECT_2           */
-    { GPIOA,  12 },     /* ANALOG_SWITCH_NENABLE            */
+};
+
+static const gpio_type analog_switch_nenable_io[] =
+{
+    /*--------------------------------------------------------
+    { Port, Pin }
+    --------------------------------------------------------*/
+    { GPIOA,  12 },     /* Bank 0                           */
+#if( LED_BANK_COUNT > 1 )
+    { GPIOA,   5 },     /* Bank 1                           */
+#endif
+#if( LED_BANK_COUNT > 2 )
+    { GPIOA,   6 },     /* Bank 2                           */
+#endif
+#if( LED_BANK_COUNT > 3 )
+    { GPIOA,   7 },     /* Bank 3                           */
+#endif
+};
+
+compile_assert( count_of_array( analog_switch_io ) == ANALOG_SWITCH_SELECT_COUNT, analog_switch_io );
+compile_assert( count_of_array( analog_switch_nenable_io ) == LED_BANK_COUNT, analog_switch_nenable_io );
+compile_assert( LED_COUNT <= 32, led_lit_mask );
+compile_assert( ( 1 << ANALOG_SWITCH_SELECT_COUNT ) == LED_BANK_SIZE, led_bank_size );
+
+#if( LED_BENCHMARK )
+/*------------------------------------------------------------
+LED current sense input, ADC1_IN1
+------------------------------------------------------------*/
+static const gpio_type led_sense_io = { GPIOA,  0 };
+#endif
+
+#if( LED_BENCHMARK )
+/*------------------------------------------------------------
+Refresh benchmark debug pin, toggled at every refresh edge
+------------------------------------------------------------*/
+static const gpio_type led_benchmark_io = { GPIOB,  5 };
+#endif
+
+/*------------------------------------------------------------
+Perceptual brightness curve, ( k / 32 )^2.2 in Q16. The LED
+drivers are linear in current, so without it the low end of
+a flash spends very few DAC codes on what the eye sees best.
+------------------------------------------------------------*/
+static const uint16_t led_gamma_curve[] =
+{
+        0,    32,   147,   359,   676,  1104,  1648,  2314,
+     3104,  4022,  5072,  6255,  7574,  9033, 10632, 12375,
+    14263, 16298, 18482, 20816, 23303, 25943, 28739, 31692,
+    34802, 38072, 41503, 45097, 48853, 52774, 56860, 61114,
+    65535,
 };
 
 
@@ -64,48 +184,197 @@ static const gpio_type analog_switch_io[] =
                                GLOBAL VARIABLES
 --------------------------------------------------------------------------------*/
 
+#if( LED_BENCHMARK )
+volatile led_benchmark_type g_led_benchmark;
+#endif
+
 /*--------------------------------------------------------------------------------
                                STATIC VARIABLES
 --------------------------------------------------------------------------------*/
 
-volatile static int32_t s_led_brightness[ LED_COUNT ];
+/*------------------------------------------------------------
+Brightness frames, in DAC codes. Writers fill the back frame
+between led_frame_begin() and led_frame_commit(), while the
+refresh engines only ever read the front frame. Commit swaps
+the two with a single pointer store, so a frame never tears.
+------------------------------------------------------------*/
+static uint16_t         s_led_frames[ 2 ][ LED_COUNT ];
+static uint16_t * volatile
+                        s_led_front;
+static uint16_t       * s_led_back;
+
+/*------------------------------------------------------------
+Brightness to DAC code table, built once by led_init() from
+the gamma curve and LED_DAC_MAX.
+------------------------------------------------------------*/
+static uint16_t         s_led_dac_lut[ LED_BRIGHTNESS_MAX + 1 ];
+
+/*------------------------------------------------------------
+One bit per LED driver whose hold capacitor was last charged
+to a non-zero level.
+------------------------------------------------------------*/
+volatile static uint32_t s_led_lit_mask;
+
+/*------------------------------------------------------------
+Brightness scale, of LED_SCALE_ONE, and refresh period in
+multiples of the full rate
+------------------------------------------------------------*/
+static uint32_t         s_led_scale;
+static uint32_t         s_led_refresh_divider;
+
+/*------------------------------------------------------------
+Analog switch port masks, built once by dac_init(). Each LED
+has a select value that also holds every bank disabled, and
+an enable value for the NENABLE pins that turns on only the
+LED's own bank.
+------------------------------------------------------------*/
+static GPIO_TypeDef   * s_switch_port;
+static uint32_t         s_switch_mask;
+static uint32_t         s_nenable_mask;
+static uint32_t         s_select_value[ LED_COUNT ];
+static uint32_t         s_enable_value[ LED_COUNT ];
+
+#if( ( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK ) && LED_REFRESH_ADAPTIVE )
+/*------------------------------------------------------------
+Level last written to each driver and the tick it was written
+------------------------------------------------------------*/
+static uint32_t         s_led_held[ LED_COUNT ];
+static uint32_t         s_led_held_tick[ LED_COUNT ];
+#endif
+
+#if( LED_BENCHMARK )
+/*------------------------------------------------------------
+Debug pin mask and level, and the cycle count at the last
+refresh edge
+------------------------------------------------------------*/
+static uint32_t         s_bench_pin_mask;
+static uint32_t         s_bench_pin_level;
+static uint32_t         s_bench_last_edge;
+#endif
+
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+/*------------------------------------------------------------
+DMA frame buffers. Each frame holds one port write and one DAC
+value per mux slot.
+------------------------------------------------------------*/
+static uint32_t s_dma_select[ DMA_FRAME_COUNT * LED_COUNT ];
+static uint32_t s_dma_dac[ DMA_FRAME_COUNT * LED_COUNT ];
+static uint32_t s_dma_enable[ LED_COUNT ];
+static uint32_t s_dma_lit_mask[ DMA_FRAME_COUNT ];
+
+compile_assert( DMA_TIMER_HZ / LED_DMA_SLOT_HZ > DMA_ENABLE_DELAY, dma_slot_length );
+#endif
 
 
 /*--------------------------------------------------------------------------------
                                   PROCEDURES
 --------------------------------------------------------------------------------*/
 
-static void dac_enable_output
+static void dac_init
     (
-    boolean enable
+    void
     );
 
+#if( LED_BENCHMARK )
+static ramfunc void led_benchmark_edge
+    (
+    void
+    );
 
-static void dac_init
+static void led_benchmark_init
+    (
+    void
+    );
+
+static void led_benchmark_settle
+    (
+    void
+    );
+
+static void led_benchmark_wait_us
+    (
+    uint32_t        us
+    );
+#endif
+
+static void led_build_dac_lut
+    (
+    void
+    );
+
+#if( LED_BENCHMARK )
+static void led_sense_drive
+    (
+    led_type        led_id,
+    uint32_t        dac_val
+    );
+#endif
+
+#if( LED_BENCHMARK )
+static uint32_t led_sense_read
     (
     void
     );
 
-static void dac_set_led
+static void led_sense_wait
+    (
+    uint32_t        ms
+    );
+#endif
+
+#if( ( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK ) || LED_BENCHMARK )
+static ramfunc void dac_enable_output
+    (
+    led_type    led_id
+    );
+
+static ramfunc void dac_set_led
     (
     led_type    led_id
     );
+#endif
 
-static void dac_set_output
+static ramfunc void dac_set_output
     (
     uint32_t    dac_val
     );
 
-static void led_periodic_callback
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+static ramfunc void dma_fill_frame
+    (
+    uint32_t    frame
+    );
+
+static void dma_init
+    (
+    void
+    );
+
+static ramfunc uint32_t dma_select_word
+    (
+    led_type    led_id
+    );
+#endif
+
+#if( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK )
+#if( LED_REFRESH_ADAPTIVE )
+static ramfunc int32_t led_next_slot
+    (
+    uint32_t    now
+    );
+#endif
+
+static ramfunc void led_periodic_callback
     (
     void
     );
 
-static void led_update_brightness
+static ramfunc void led_update_brightness
     (
     led_type    led_id,
     uint32_t    led_brightness
     );
+#endif
 
 
 /*************************************************************************
@@ -131,12 +400,40 @@ void led_init
     /*--------------------------------------------------------
     Initialize LED brightness values to 0
     --------------------------------------------------------*/
-    clear_array( s_led_brightness );
+    clear_array( s_led_frames );
+    s_led_front = s_led_frames[ 0 ];
+    s_led_back = s_led_frames[ 1 ];
+    s_led_scale = LED_SCALE_ONE;
+    s_led_refresh_divider = 1;
+    led_build_dac_lut();
+
+#if( LED_BENCHMARK )
+    /*--------------------------------------------------------
+    Sweep driver settling while nothing else drives the DAC,
+    then arm edge timing
+    --------------------------------------------------------*/
+    led_benchmark_init();
+#endif
+
+#if( ( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK ) && LED_REFRESH_ADAPTIVE )
+    /*--------------------------------------------------------
+    Drivers start discharged
+    --------------------------------------------------------*/
+    clear_array( s_led_held );
+    clear_array( s_led_held_tick );
+#endif
 
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+    /*--------------------------------------------------------
+    Start streaming frames to the DAC and analog switch
+    --------------------------------------------------------*/
+    dma_init();
+#else
     /*--------------------------------------------------------
     Register periodic callback function
     --------------------------------------------------------*/
-    system_add_task( led_periodic_callback, 1 );
+    system_add_task( led_periodic_callback, 1, SYSTEM_TASK_TICK | SYSTEM_TASK_IDLE );
+#endif
 
 } /* led_init */
 
@@ -144,242 +441,1101 @@ void led_init
 /*************************************************************************
  *
  *  Procedure:
- *      led_set_brightness
+ *      led_is_dark
  *
  *  Description:
- *      Set the brightness value that will be applied during periodic
- *      updates.
+ *      Check whether every LED is set to zero and every driver has been
+ *      refreshed to zero, so that refreshing can pause without any LED
+ *      drooping.
  *
  ************************************************************************/
-void led_set_brightness
+boolean led_is_dark
     (
-    led_type    led_id,
-    uint32_t    led_brightness
+    void
     )
 {
     /*--------------------------------------------------------
-    Set the brightness value if led_id is valid
+    Local variables
     --------------------------------------------------------*/
-    if( led_id < LED_COUNT )
+    const uint16_t    * frame;
+    uint32_t            i;
+
+    if( s_led_lit_mask != 0 )
     {
-        s_led_brightness[ led_id ] = led_brightness;
+        return( FALSE );
     }
 
-} /* led_set_brightness */
+    frame = s_led_front;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        if( frame[ i ] != 0 )
+        {
+            return( FALSE );
+        }
+    }
+
+    return( TRUE );
+
+} /* led_is_dark */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      led_periodic_callback
+ *      led_clock_update
  *
  *  Description:
- *      Cycles through the LEDs, updating the brightness of one for every
- *      call. Brightness is controlled by connecting the DAC output to
- *      a driver's input through an analog switch. Each driver input holds
- *      the voltage level with small capacitor while the other 7 LEDs are
- *      adjusted.
+ *      Rescale the refresh timing after a core clock change. The DMA
+ *      engine's prescaler is preloaded, so the new rate takes over at the
+ *      next slot boundary without disturbing the running frame. The
+ *      SysTick engine follows the system tick and needs nothing.
  *
  ************************************************************************/
-static void led_periodic_callback
+void led_clock_update
     (
     void
     )
 {
-    /*--------------------------------------------------------
-    Local static variables
-    --------------------------------------------------------*/
-    static led_type     led_id;
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+    TIM2->PSC = SystemCoreClock / DMA_TIMER_HZ - 1;
+#endif
 
-    /*--------------------------------------------------------
-    Update LED brightness
-    --------------------------------------------------------*/
-    led_update_brightness( led_id, s_led_brightness[ led_id ] );
+} /* led_clock_update */
 
-    /*--------------------------------------------------------
-    Increment LED
-    --------------------------------------------------------*/
-    led_id = (led_id + 1) % LED_COUNT;
 
-} /* led_periodic_callback */
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_frame_begin
+ *
+ *  Description:
+ *      Start a new brightness frame. The back frame starts as a copy of
+ *      the front one, so LEDs that are not set keep their brightness.
+ *
+ ************************************************************************/
+ramfunc void led_frame_begin
+    (
+    void
+    )
+{
+    memcpy( s_led_back, s_led_front, sizeof( s_led_frames[ 0 ] ) );
+
+} /* led_frame_begin */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      led_update_brightness
+ *      led_frame_commit
  *
  *  Description:
- *      Set the output of the DAC and routes it to the appropriate driver.
+ *      Publish the back frame to the refresh engines. Both engines read
+ *      frames at a higher priority than the deferred firefly task that
+ *      writes them, so no reader can be part way through the old front
+ *      frame when it is reused as the next back frame. With tracing on,
+ *      the main loop is told with a SYSTEM_EVENT_FRAME, and traces the
+ *      frame from there.
  *
  ************************************************************************/
-static void led_update_brightness
+ramfunc void led_frame_commit
     (
-    led_type    led_id,
-    uint32_t    led_brightness
+    void
     )
 {
     /*--------------------------------------------------------
-    Disable analog switch output during voltage transition
-    --------------------------------------------------------*/
-    dac_enable_output( FALSE );
-
-    /*--------------------------------------------------------
-    Update DAC output
+    Local variables
     --------------------------------------------------------*/
-    dac_set_output( led_brightness );
+    uint16_t  * front;
 
-    /*--------------------------------------------------------
-    Select the switch connected to the desired LED driver.
-    --------------------------------------------------------*/
-    dac_set_led( led_id );
+    front = s_led_front;
+    s_led_front = s_led_back;
+    s_led_back = front;
 
-    /*--------------------------------------------------------
-    Enable analog switch output to LED driver
-    --------------------------------------------------------*/
-    dac_enable_output( TRUE );
+#if( TRACE_ENABLE )
+    system_event_post( SYSTEM_EVENT_FRAME, 0, NULL );
+#endif
 
-} /* led_update_brightness */
+} /* led_frame_commit */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      dac_init
+ *      led_frame_trace
  *
  *  Description:
- *      Initialize DAC functionality.
+ *      Trace the front frame as a brightness snapshot, on a
+ *      SYSTEM_EVENT_FRAME. Should the main loop fall a frame behind, the
+ *      snapshot may be a later frame or part of one being built, which
+ *      only the trace ever sees.
  *
  ************************************************************************/
-static void dac_init
+void led_frame_trace
     (
     void
     )
 {
-    /*--------------------------------------------------------
-    First, configure the pins that control the analog switch
-    responsible for demultiplexing the time-division
-    multiplexed DAC signal. Output from the analog switch is
-    disabled by default.
-    --------------------------------------------------------*/
-    for( int i = ANALOG_SWITCH_PIN_FIRST; i <= ANALOG_SWITCH_PIN_FINAL; i++ )
+    trace_frame( s_led_front, LED_COUNT );
+
+} /* led_frame_trace */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_set_refresh_divider
+ *
+ *  Description:
+ *      Refresh the LEDs divider times less often than at full rate, to
+ *      save power. The DMA engine stretches its slots, and the SysTick
+ *      engine runs its task every divider ticks.
+ *
+ ************************************************************************/
+void led_set_refresh_divider
+    (
+    uint32_t    divider
+    )
+{
+    divider = max_val( divider, 1 );
+    if( divider == s_led_refresh_divider )
     {
-        gpio_cfg_output( &analog_switch_io[ i ] );
+        return;
     }
+    s_led_refresh_divider = divider;
 
-    /*--------------------------------------------------------
-    Enable clock to DAC peripheral
-    --------------------------------------------------------*/
-    RCC->APB1ENR |= RCC_APB1ENR_DAC1EN;
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+    TIM2->ARR = ( DMA_TIMER_HZ / LED_DMA_SLOT_HZ ) * divider - 1;
+#else
+    system_remove_task( led_periodic_callback );
+    system_add_task( led_periodic_callback, divider, SYSTEM_TASK_TICK | SYSTEM_TASK_IDLE );
+#endif
 
-    /*--------------------------------------------------------
-    Disable the DAC output buffer to enable rail-to-rail
-    output. An external buffer with rail-to-rail capability is
-    used instead.
-    --------------------------------------------------------*/
-    DAC->CR |= DAC_CR_BOFF1;
+} /* led_set_refresh_divider */
 
-    /*--------------------------------------------------------
-    Enable DAC peripheral
-    --------------------------------------------------------*/
-    DAC->CR |= DAC_CR_EN1;
 
-    /*--------------------------------------------------------
-    Set initial DAC output value to 0V
-    --------------------------------------------------------*/
-    dac_set_output( 0 );
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_set_scale
+ *
+ *  Description:
+ *      Scale the brightness of every LED by scale / LED_SCALE_ONE from
+ *      the next frame on.
+ *
+ ************************************************************************/
+void led_set_scale
+    (
+    uint32_t    scale
+    )
+{
+    s_led_scale = min_val( scale, LED_SCALE_ONE );
 
-} /* dac_init */
+} /* led_set_scale */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      dac_enable_output
+ *      led_get_current
+ *
+ *  Description:
+ *      Get the nominal current an LED set to a brightness draws, in DAC
+ *      codes, since the drivers are linear in current. The brightness
+ *      scale is left out, as it only ever lowers the current.
+ *
+ ************************************************************************/
+ramfunc uint32_t led_get_current
+    (
+    uint32_t    led_brightness
+    )
+{
+    return( s_led_dac_lut[ min_val( led_brightness, LED_BRIGHTNESS_MAX ) ] );
+
+} /* led_get_current */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_set_brightness
  *
  *  Description:
- *      Enables/disables the analog switch output that acts as a MUX for
- *      the DAC output to the LED drivers.
+ *      Set the brightness value, 0 to LED_BRIGHTNESS_MAX, of an LED in
+ *      the frame being built. The value is scaled and converted to a DAC
+ *      code here, so the refresh engines only ever see DAC codes.
  *
  ************************************************************************/
-static void dac_enable_output
+ramfunc void led_set_brightness
     (
-    boolean enable
+    led_type    led_id,
+    uint32_t    led_brightness
     )
 {
     /*--------------------------------------------------------
     Local variables
     --------------------------------------------------------*/
-    const gpio_type * nenable;
-    gpio_state_type   state;
+    int32_t     dac_val;
 
     /*--------------------------------------------------------
-    Get the GPIO controlling the analog switch's NENABLE input
-    and the desired state.
+    Set the brightness value if led_id is valid
     --------------------------------------------------------*/
-    nenable = &analog_switch_io[ ANALOG_SWITCH_NENABLE ];
-    state = enable ? GPIO_STATE_LOW : GPIO_STATE_HIGH;
+    if( led_id < LED_COUNT )
+    {
+        dac_val = s_led_dac_lut[ ( min_val( led_brightness, LED_BRIGHTNESS_MAX ) * s_led_scale ) >> LED_SCALE_SHIFT ];
 
-    /*--------------------------------------------------------
-    Update the state of the NENABLE input in order to enable
-    or disable the analog switch output
-    --------------------------------------------------------*/
-    gpio_output_set( nenable, state );
+        s_led_back[ led_id ] = dac_val;
+    }
 
-} /* dac_enable_output */
+} /* led_set_brightness */
 
 
+#if( LED_BENCHMARK )
 /*************************************************************************
  *
  *  Procedure:
- *      dac_set_led
+ *      led_benchmark_edge
  *
  *  Description:
- *      Set LED driver that the DAC is routed to.
+ *      Mark a refresh edge. Toggles the debug pin and bins the time since
+ *      the previous edge against the nominal edge period.
  *
  ************************************************************************/
-static void dac_set_led
+static ramfunc void led_benchmark_edge
     (
-    led_type    led_id
+    void
     )
 {
     /*--------------------------------------------------------
     Local variables
     --------------------------------------------------------*/
-    const gpio_type * select;
-    boolean           state;
+    uint32_t    now;
+    uint32_t    period;
+    int32_t     bin;
+
+    s_bench_pin_level ^= s_bench_pin_mask;
+    gpio_port_write_masked( led_benchmark_io.port, s_bench_pin_mask, s_bench_pin_level );
+
+    now = DWT->CYCCNT;
+    period = ( now - s_bench_last_edge ) / LED_BENCH_CYCLES_PER_US;
+    s_bench_last_edge = now;
 
     /*--------------------------------------------------------
-    Get the GPIO controlling the analog switch's output
-    selection, as well as the desired state for each.
+    The first edge only starts the clock
     --------------------------------------------------------*/
-    for( int i = ANALOG_SWITCH_SELECT_0; i <= ANALOG_SWITCH_SELECT_2; i++ )
+    if( g_led_benchmark.edges++ == 0 )
     {
-        select = &analog_switch_io[ i ];
-        state  = (led_id & (1 << (i - ANALOG_SWITCH_SELECT_0))) ? GPIO_STATE_HIGH : GPIO_STATE_LOW;
-        gpio_output_set( select, state );
+        return;
     }
 
-} /* dac_set_led */
+    g_led_benchmark.period_min = min_val( g_led_benchmark.period_min, period );
+    g_led_benchmark.period_max = max_val( g_led_benchmark.period_max, period );
+
+    bin = (int32_t)period - (int32_t)( 1000000 / LED_BENCH_EDGE_HZ ) + LED_BENCH_BINS / 2;
+    g_led_benchmark.period_hist[ limit_val( bin, 0, LED_BENCH_BINS - 1 ) ]++;
+
+} /* led_benchmark_edge */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      dac_set_output
+ *      led_benchmark_init
  *
  *  Description:
- *      Set the 12-bit output level of the DAC.
+ *      Run the settling sweep, then configure the debug pin and start
+ *      the cycle counter for edge timing.
  *
  ************************************************************************/
-static void dac_set_output
+static void led_benchmark_init
     (
-    uint32_t    dac_val
+    void
+    )
+{
+    clear_struct( g_led_benchmark );
+    g_led_benchmark.period_min = UINT32_MAX;
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    led_benchmark_settle();
+
+    gpio_cfg_output( &led_benchmark_io );
+    gpio_output_set( &led_benchmark_io, GPIO_STATE_LOW );
+    s_bench_pin_mask = gpio_pin_mask( &led_benchmark_io );
+    s_bench_pin_level = 0;
+
+} /* led_benchmark_init */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_benchmark_settle
+ *
+ *  Description:
+ *      Sweep the time each driver is connected to the DAC. Every driver
+ *      is charged from empty to the high sense level for each
+ *      connect time, isolated, and sensed. The shortfall against a
+ *      driver left connected is averaged over the drivers. Every driver
+ *      is left discharged.
+ *
+ ************************************************************************/
+static void led_benchmark_settle
+    (
+    void
     )
 {
     /*--------------------------------------------------------
-    Update DAC output
+    Local variables
     --------------------------------------------------------*/
-    DAC->DHR12R1 = dac_val & 0x00000FFF;
+    int32_t     full[ LED_COUNT ];
+    int32_t     error;
+    uint32_t    full_sum;
+    uint32_t    i;
+    uint32_t    step;
 
-} /* dac_set_output */
+    gpio_cfg_analog( &led_sense_io );
+    system_adc_start();
+
+    /*--------------------------------------------------------
+    Discharge every driver, so that only the driver under test
+    draws current
+    --------------------------------------------------------*/
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        led_sense_drive( i, 0 );
+        led_sense_wait( LED_SENSE_SETTLE_MS );
+    }
+
+    /*--------------------------------------------------------
+    Fully settled reference levels
+    --------------------------------------------------------*/
+    full_sum = 0;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        led_sense_drive( i, LED_SENSE_LEVEL_HIGH );
+        led_sense_wait( LED_SENSE_SETTLE_MS );
+        full[ i ] = led_sense_read();
+        full_sum += full[ i ];
+
+        led_sense_drive( i, 0 );
+        led_sense_wait( LED_SENSE_SETTLE_MS );
+    }
+    dac_set_led( LED_FIRST );
+    g_led_benchmark.settle_full = full_sum / LED_COUNT;
+
+    /*--------------------------------------------------------
+    Charge from empty for each connect time. The DAC is
+    loaded while the switch is off, as a refresh slot does.
+    --------------------------------------------------------*/
+    for( step = 0; step < LED_BENCH_SETTLE_STEPS; step++ )
+    {
+        error = 0;
+        for( i = 0; i < LED_COUNT; i++ )
+        {
+            dac_set_led( i );
+            dac_set_output( LED_SENSE_LEVEL_HIGH );
+            dac_enable_output( i );
+            led_benchmark_wait_us( ( step + 1 ) * LED_BENCH_SETTLE_STEP_US );
+            dac_set_led( i );
+            error += full[ i ] - (int32_t)led_sense_read();
+
+            led_sense_drive( i, 0 );
+            led_sense_wait( LED_SENSE_SETTLE_MS );
+            dac_set_led( i );
+        }
+
+        g_led_benchmark.settle_error[ step ] = error / (int32_t)LED_COUNT;
+    }
+
+    system_adc_stop();
+
+} /* led_benchmark_settle */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_benchmark_wait_us
+ *
+ *  Description:
+ *      Busy wait for at least the given number of us on the cycle
+ *      counter.
+ *
+ ************************************************************************/
+static void led_benchmark_wait_us
+    (
+    uint32_t        us
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    start;
+    uint32_t    cycles;
+
+    cycles = us * LED_BENCH_CYCLES_PER_US;
+    start = DWT->CYCCNT;
+    while( DWT->CYCCNT - start < cycles );
+
+} /* led_benchmark_wait_us */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_build_dac_lut
+ *
+ *  Description:
+ *      Build the brightness to DAC code table by interpolating the gamma
+ *      curve and scaling it to LED_DAC_MAX.
+ *
+ ************************************************************************/
+static void led_build_dac_lut
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    brightness;
+    uint32_t    x;
+    uint32_t    idx;
+    uint32_t    frac;
+    uint32_t    gamma;
+
+    for( brightness = 0; brightness <= LED_BRIGHTNESS_MAX; brightness++ )
+    {
+        /*----------------------------------------------------
+        Brightness as a Q16 fraction of full scale, split into
+        a curve knot and the fraction towards the next one
+        ----------------------------------------------------*/
+        x = ( brightness * LED_GAMMA_Q16_PER_STEP ) >> 16;
+        idx = x >> LED_GAMMA_SHIFT;
+        frac = x & ( ( 1 << LED_GAMMA_SHIFT ) - 1 );
+
+        gamma = led_gamma_curve[ idx ];
+        if( idx + 1 < count_of_array( led_gamma_curve ) )
+        {
+            gamma += ( ( led_gamma_curve[ idx + 1 ] - led_gamma_curve[ idx ] ) * frac ) >> LED_GAMMA_SHIFT;
+        }
+
+        s_led_dac_lut[ brightness ] = ( gamma * LED_DAC_MAX + ( 1 << 15 ) ) >> 16;
+    }
+
+} /* led_build_dac_lut */
+
+
+#if( LED_BENCHMARK )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_sense_drive
+ *
+ *  Description:
+ *      Connect a driver to the DAC at the given level, and leave it
+ *      connected.
+ *
+ ************************************************************************/
+static void led_sense_drive
+    (
+    led_type        led_id,
+    uint32_t        dac_val
+    )
+{
+    dac_set_led( led_id );
+    dac_set_output( dac_val );
+    dac_enable_output( led_id );
+
+} /* led_sense_drive */
+#endif
+
+
+#if( LED_BENCHMARK )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_sense_read
+ *
+ *  Description:
+ *      Sum LED_SENSE_SAMPLES conversions of the LED current sense input.
+ *
+ ************************************************************************/
+static uint32_t led_sense_read
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    sum;
+    uint32_t    i;
+
+    sum = 0;
+    for( i = 0; i < LED_SENSE_SAMPLES; i++ )
+    {
+        sum += system_adc_convert( LED_SENSE_ADC_CHANNEL, LED_SENSE_ADC_SMP );
+    }
+
+    return( sum );
+
+} /* led_sense_read */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_sense_wait
+ *
+ *  Description:
+ *      Busy wait for at least the given number of ms. Only used during
+ *      benchmarking, before any refresh engine is
+ *      started.
+ *
+ ************************************************************************/
+static void led_sense_wait
+    (
+    uint32_t        ms
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    start;
+
+    start = system_get_tick();
+    while( system_get_tick() - start <= ms );
+
+} /* led_sense_wait */
+#endif
+
+
+#if( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK )
+#if( LED_REFRESH_ADAPTIVE )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_next_slot
+ *
+ *  Description:
+ *      Pick the driver that most needs the next mux slot, or -1 if none
+ *      does. A driver's error is the distance between its target and
+ *      the level it was last written to, plus the droop modeled since
+ *      then. Drivers held at zero do not droop, so dark LEDs cost
+ *      nothing once discharged.
+ *
+ ************************************************************************/
+static ramfunc int32_t led_next_slot
+    (
+    uint32_t    now
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    const uint16_t    * frame;
+    int32_t             best_id;
+    int32_t             best_err;
+    int32_t             err;
+    uint32_t            age;
+    uint32_t            i;
+
+    frame = s_led_front;
+    best_id = -1;
+    best_err = LED_REFRESH_THRESHOLD - 1;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        err = (int32_t)frame[ i ] - (int32_t)s_led_held[ i ];
+        if( err < 0 )
+        {
+            err = -err;
+        }
+
+        if( s_led_held[ i ] != 0 )
+        {
+            age = now - s_led_held_tick[ i ];
+            if( age >= LED_HOLD_MAX_MS )
+            {
+                err = max_val( err, LED_REFRESH_THRESHOLD );
+            }
+
+            err += ( s_led_held[ i ] * min_val( age, LED_HOLD_MAX_MS ) ) >> LED_DROOP_TAU_SHIFT;
+        }
+
+        if( err > best_err )
+        {
+            best_err = err;
+            best_id = i;
+        }
+    }
+
+    return( best_id );
+
+} /* led_next_slot */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_periodic_callback
+ *
+ *  Description:
+ *      Updates the brightness of one LED for every call. Brightness is
+ *      controlled by connecting the DAC output to a driver's input
+ *      through an analog switch. Each driver input holds the voltage
+ *      level with small capacitor while the other LEDs are adjusted.
+ *      Without adaptive refresh the LEDs are visited in turn, so every
+ *      LED is refreshed once per LED_COUNT ticks.
+ *
+ ************************************************************************/
+static ramfunc void led_periodic_callback
+    (
+    void
+    )
+{
+#if( LED_REFRESH_ADAPTIVE )
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    int32_t             led_id;
+    uint32_t            now;
+
+#if( LED_BENCHMARK )
+    led_benchmark_edge();
+#endif
+
+    /*--------------------------------------------------------
+    Refresh the driver furthest from its target, if any
+    --------------------------------------------------------*/
+    now = system_get_tick();
+    led_id = led_next_slot( now );
+    if( led_id < 0 )
+    {
+        return;
+    }
+
+    s_led_held[ led_id ] = s_led_front[ led_id ];
+    s_led_held_tick[ led_id ] = now;
+    led_update_brightness( led_id, s_led_held[ led_id ] );
+#else
+    /*--------------------------------------------------------
+    Local static variables
+    --------------------------------------------------------*/
+    static led_type     led_id;
+
+#if( LED_BENCHMARK )
+    led_benchmark_edge();
+#endif
+
+    /*--------------------------------------------------------
+    Update LED brightness
+    --------------------------------------------------------*/
+    led_update_brightness( led_id, s_led_front[ led_id ] );
+
+    /*--------------------------------------------------------
+    Increment LED
+    --------------------------------------------------------*/
+    led_id = (led_id + 1) % LED_COUNT;
+#endif
+
+} /* led_periodic_callback */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      led_update_brightness
+ *
+ *  Description:
+ *      Set the output of the DAC and routes it to the appropriate driver.
+ *
+ ************************************************************************/
+static ramfunc void led_update_brightness
+    (
+    led_type    led_id,
+    uint32_t    led_brightness
+    )
+{
+    /*--------------------------------------------------------
+    Disable analog switch output during voltage transition and
+    select the switch connected to the desired LED driver.
+    --------------------------------------------------------*/
+    dac_set_led( led_id );
+
+    /*--------------------------------------------------------
+    Update DAC output
+    --------------------------------------------------------*/
+    dac_set_output( led_brightness );
+
+    /*--------------------------------------------------------
+    Enable analog switch output to LED driver
+    --------------------------------------------------------*/
+    dac_enable_output( led_id );
+
+    /*--------------------------------------------------------
+    Track which drivers are holding charge
+    --------------------------------------------------------*/
+    if( led_brightness )
+    {
+        s_led_lit_mask |= (uint32_t)1 << led_id;
+    }
+    else
+    {
+        s_led_lit_mask &= ~( (uint32_t)1 << led_id );
+    }
+
+} /* led_update_brightness */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dac_init
+ *
+ *  Description:
+ *      Initialize DAC functionality.
+ *
+ ************************************************************************/
+static void dac_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    First, configure the pins that control the analog switch
+    responsible for demultiplexing the time-division
+    multiplexed DAC signal. Output from the analog switch is
+    disabled by default.
+    --------------------------------------------------------*/
+    s_nenable_mask = 0;
+    for( int i = 0; i < LED_BANK_COUNT; i++ )
+    {
+        gpio_cfg_output( &analog_switch_nenable_io[ i ] );
+        s_nenable_mask |= gpio_pin_mask( &analog_switch_nenable_io[ i ] );
+    }
+
+    for( int i = ANALOG_SWITCH_SELECT_FIRST; i <= ANALOG_SWITCH_SELECT_FINAL; i++ )
+    {
+        gpio_cfg_output( &analog_switch_io[ i ] );
+    }
+
+    /*--------------------------------------------------------
+    All analog switch pins share a port. Build the masks so
+    that routing a slot takes a single port write.
+    --------------------------------------------------------*/
+    s_switch_port = analog_switch_nenable_io[ 0 ].port;
+    s_switch_mask = s_nenable_mask;
+    for( int i = ANALOG_SWITCH_SELECT_FIRST; i <= ANALOG_SWITCH_SELECT_FINAL; i++ )
+    {
+        s_switch_mask |= gpio_pin_mask( &analog_switch_io[ i ] );
+    }
+
+    for( int led_id = LED_FIRST; led_id <= LED_FINAL; led_id++ )
+    {
+        s_select_value[ led_id ] = s_nenable_mask;
+        for( int i = ANALOG_SWITCH_SELECT_FIRST; i <= ANALOG_SWITCH_SELECT_FINAL; i++ )
+        {
+            if( led_id & (1 << (i - ANALOG_SWITCH_SELECT_FIRST)) )
+            {
+                s_select_value[ led_id ] |= gpio_pin_mask( &analog_switch_io[ i ] );
+            }
+        }
+
+        s_enable_value[ led_id ] = s_nenable_mask & ~gpio_pin_mask( &analog_switch_nenable_io[ led_id / LED_BANK_SIZE ] );
+    }
+
+    /*--------------------------------------------------------
+    Enable clock to DAC peripheral
+    --------------------------------------------------------*/
+    RCC->APB1ENR |= RCC_APB1ENR_DAC1EN;
+
+    /*--------------------------------------------------------
+    Disable the DAC output buffer to enable rail-to-rail
+    output. An external buffer with rail-to-rail capability is
+    used instead.
+    --------------------------------------------------------*/
+    DAC->CR |= DAC_CR_BOFF1;
+
+    /*--------------------------------------------------------
+    Enable DAC peripheral
+    --------------------------------------------------------*/
+    DAC->CR |= DAC_CR_EN1;
+
+    /*--------------------------------------------------------
+    Set initial DAC output value to 0V
+    --------------------------------------------------------*/
+    dac_set_output( 0 );
+
+} /* dac_init */
+
+
+#if( ( LED_REFRESH_ENGINE == LED_REFRESH_SYSTICK ) || LED_BENCHMARK )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dac_enable_output
+ *
+ *  Description:
+ *      Enables the analog switch output that acts as a MUX for the DAC
+ *      output to the bank of LED drivers holding led_id. All other banks
+ *      stay disabled.
+ *
+ ************************************************************************/
+static ramfunc void dac_enable_output
+    (
+    led_type    led_id
+    )
+{
+    /*--------------------------------------------------------
+    Update the state of the NENABLE inputs in order to enable
+    the analog switch output. NENABLE is active low.
+    --------------------------------------------------------*/
+    gpio_port_write_masked( s_switch_port, s_nenable_mask, s_enable_value[ led_id ] );
+
+} /* dac_enable_output */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dac_set_led
+ *
+ *  Description:
+ *      Set LED driver that the DAC is routed to. The analog switch output
+ *      is disabled by the same port write, so no driver is connected
+ *      until dac_enable_output() is called.
+ *
+ ************************************************************************/
+static ramfunc void dac_set_led
+    (
+    led_type    led_id
+    )
+{
+    /*--------------------------------------------------------
+    Drive all select lines and NENABLE together.
+    --------------------------------------------------------*/
+    gpio_port_write_masked( s_switch_port, s_switch_mask, s_select_value[ led_id ] );
+
+} /* dac_set_led */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dac_set_output
+ *
+ *  Description:
+ *      Set the 12-bit output level of the DAC.
+ *
+ ************************************************************************/
+static ramfunc void dac_set_output
+    (
+    uint32_t    dac_val
+    )
+{
+    /*--------------------------------------------------------
+    Update DAC output
+    --------------------------------------------------------*/
+    DAC->DHR12R1 = dac_val & 0x00000FFF;
+
+} /* dac_set_output */
+
+
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      DMA1_Channel5_IRQHandler
+ *
+ *  Description:
+ *      DAC stream interrupt. Refills whichever frame the DMA has just
+ *      finished with while the other one plays out.
+ *
+ ************************************************************************/
+ramfunc void DMA1_Channel5_IRQHandler
+    (
+    void
+    )
+{
+    if( DMA1->ISR & DMA_ISR_HTIF5 )
+    {
+        DMA1->IFCR = DMA_IFCR_CHTIF5;
+        dma_fill_frame( 0 );
+    }
+
+    if( DMA1->ISR & DMA_ISR_TCIF5 )
+    {
+        DMA1->IFCR = DMA_IFCR_CTCIF5;
+        dma_fill_frame( 1 );
+    }
+
+} /* DMA1_Channel5_IRQHandler */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dma_fill_frame
+ *
+ *  Description:
+ *      Load a DMA frame buffer with the committed brightness of every
+ *      LED.
+ *
+ ************************************************************************/
+static ramfunc void dma_fill_frame
+    (
+    uint32_t    frame
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    const uint16_t    * levels;
+    uint32_t            i;
+    uint32_t            slot;
+    uint32_t            lit_mask;
+
+#if( LED_BENCHMARK )
+    led_benchmark_edge();
+#endif
+
+    levels = s_led_front;
+    lit_mask = 0;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        slot = frame * LED_COUNT + i;
+        s_dma_select[ slot ] = dma_select_word( i );
+        s_dma_dac[ slot ] = levels[ i ] & 0x00000FFF;
+        lit_mask |= s_dma_dac[ slot ] ? ( (uint32_t)1 << i ) : 0;
+    }
+
+    /*--------------------------------------------------------
+    The LEDs are dark once both frames are dark.
+    --------------------------------------------------------*/
+    s_dma_lit_mask[ frame ] = lit_mask;
+    s_led_lit_mask = s_dma_lit_mask[ 0 ] | s_dma_lit_mask[ 1 ];
+
+} /* dma_fill_frame */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dma_init
+ *
+ *  Description:
+ *      Configure TIM2 to pace the mux slots and DMA1 channels 2, 5 and 7
+ *      to stream the analog switch and DAC writes for each slot.
+ *
+ *      Slot timeline, in TIM2 counts:
+ *          0                   - switch disabled, next driver selected
+ *          DMA_DAC_DELAY       - DAC updated
+ *          DMA_ENABLE_DELAY    - switch enabled
+ *
+ ************************************************************************/
+static void dma_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    GPIO_TypeDef      * port;
+    uint32_t            i;
+
+    /*--------------------------------------------------------
+    Each slot edge is a single write to the analog switch
+    port's bit set/reset register. Enable words only depend on
+    the bank, so they are streamed from a fixed table running
+    in step with the frames.
+    --------------------------------------------------------*/
+    port = s_switch_port;
+    for( i = 0; i < LED_COUNT; i++ )
+    {
+        s_dma_enable[ i ] = gpio_bsrr_word( s_nenable_mask, s_enable_value[ i ] );
+    }
+    dma_fill_frame( 0 );
+    dma_fill_frame( 1 );
+
+    /*--------------------------------------------------------
+    Enable clocks to DMA and TIM2
+    --------------------------------------------------------*/
+    RCC->AHBENR  |= RCC_AHBENR_DMA1EN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+
+    /*--------------------------------------------------------
+    Channel 2, TIM2 update: disable and select
+    --------------------------------------------------------*/
+    DMA1_Channel2->CPAR  = (uint32_t)&port->BSRRL;
+    DMA1_Channel2->CMAR  = (uint32_t)s_dma_select;
+    DMA1_Channel2->CNDTR = count_of_array( s_dma_select );
+    DMA1_Channel2->CCR   = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_CIRC
+                         | DMA_CCR_PSIZE_1 | DMA_CCR_MSIZE_1 | DMA_CCR_PL_1;
+
+    /*--------------------------------------------------------
+    Channel 5, TIM2 compare 1: DAC value, frame interrupts
+    --------------------------------------------------------*/
+    DMA1_Channel5->CPAR  = (uint32_t)&DAC->DHR12R1;
+    DMA1_Channel5->CMAR  = (uint32_t)s_dma_dac;
+    DMA1_Channel5->CNDTR = count_of_array( s_dma_dac );
+    DMA1_Channel5->CCR   = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_CIRC
+                         | DMA_CCR_PSIZE_1 | DMA_CCR_MSIZE_1 | DMA_CCR_PL_1
+                         | DMA_CCR_HTIE | DMA_CCR_TCIE;
+
+    /*--------------------------------------------------------
+    Channel 7, TIM2 compare 2: enable
+    --------------------------------------------------------*/
+    DMA1_Channel7->CPAR  = (uint32_t)&port->BSRRL;
+    DMA1_Channel7->CMAR  = (uint32_t)s_dma_enable;
+    DMA1_Channel7->CNDTR = count_of_array( s_dma_enable );
+    DMA1_Channel7->CCR   = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_CIRC
+                         | DMA_CCR_PSIZE_1 | DMA_CCR_MSIZE_1 | DMA_CCR_PL_1;
+
+    DMA1_Channel2->CCR |= DMA_CCR_EN;
+    DMA1_Channel5->CCR |= DMA_CCR_EN;
+    DMA1_Channel7->CCR |= DMA_CCR_EN;
+    NVIC_EnableIRQ( DMA1_Channel5_IRQn );
+
+    /*--------------------------------------------------------
+    Configure TIM2 slot timing. The update event is generated
+    before DMA requests are enabled so the prescaler loads
+    without consuming a transfer. The period is preloaded too,
+    so that a new refresh rate starts on a slot boundary.
+    --------------------------------------------------------*/
+    TIM2->PSC  = SystemCoreClock / DMA_TIMER_HZ - 1;
+    TIM2->ARR  = DMA_TIMER_HZ / LED_DMA_SLOT_HZ - 1;
+    TIM2->CCR1 = DMA_DAC_DELAY;
+    TIM2->CCR2 = DMA_ENABLE_DELAY;
+    TIM2->EGR  = TIM_EGR_UG;
+    TIM2->DIER = TIM_DIER_UDE | TIM_DIER_CC1DE | TIM_DIER_CC2DE;
+    TIM2->CR1 |= TIM_CR1_ARPE | TIM_CR1_CEN;
+
+} /* dma_init */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      dma_select_word
+ *
+ *  Description:
+ *      Get the bit set/reset word that disables the analog switch and
+ *      selects the given LED driver.
+ *
+ ************************************************************************/
+static ramfunc uint32_t dma_select_word
+    (
+    led_type    led_id
+    )
+{
+    return( gpio_bsrr_word( s_switch_mask, s_select_value[ led_id ] ) );
+
+} /* dma_select_word */
+#endif
@@ -19,6 +19,91 @@
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
 
+/*------------------------------------------------------------
+LED refresh engines. The SysTick engine updates one mux slot
+per system tick from a periodic task. The DMA engine streams
+complete frames of DAC values and analog switch port writes
+paced by TIM2, with one interrupt per frame.
+------------------------------------------------------------*/
+#define LED_REFRESH_SYSTICK     ( 0 )
+#define LED_REFRESH_DMA         ( 1 )
+
+#ifndef LED_REFRESH_ENGINE
+#define LED_REFRESH_ENGINE      ( LED_REFRESH_SYSTICK )
+#endif
+
+/*------------------------------------------------------------
+LED banks. Each bank is one NX3L4051 analog switch with its
+own NENABLE line, all banks share the three select lines and
+the DAC output. Up to 4 banks, 32 LEDs, are supported, their
+NENABLE lines on PA12, PA5, PA6 and PA7 as listed in
+analog_switch_nenable_io[] in leds.c.
+------------------------------------------------------------*/
+#define LED_BANK_SIZE           ( 8 )       /* Outputs per analog switch        */
+
+#ifndef LED_BANK_COUNT
+#define LED_BANK_COUNT          ( 1 )
+#endif
+
+#define LED_COUNT               ( LED_BANK_COUNT * LED_BANK_SIZE )
+#define LED_FIRST               ( 0 )
+#define LED_FINAL               ( LED_COUNT - 1 )
+
+/*------------------------------------------------------------
+The DMA engine refreshes every LED at LED_DMA_REFRESH_HZ, so
+its slot rate grows with the number of LEDs.
+------------------------------------------------------------*/
+#ifndef LED_DMA_REFRESH_HZ
+#define LED_DMA_REFRESH_HZ      ( 1000 )    /* Refreshes per LED per second     */
+#endif
+
+#define LED_DMA_SLOT_HZ         ( LED_DMA_REFRESH_HZ * LED_COUNT )
+
+/*------------------------------------------------------------
+Brightness passed to led_set_brightness() runs from 0 to
+LED_BRIGHTNESS_MAX and is mapped through a gamma curve onto
+DAC codes 0 to LED_DAC_MAX. LED_DAC_MAX sets the peak LED
+current and may be overridden per board.
+------------------------------------------------------------*/
+#define LED_BRIGHTNESS_MAX      ( 1000 )
+
+#ifndef LED_DAC_MAX
+#define LED_DAC_MAX             ( 150 )
+#endif
+
+/*------------------------------------------------------------
+Brightness scale applied to every LED, see led_set_scale()
+------------------------------------------------------------*/
+#define LED_SCALE_SHIFT         ( 8 )
+#define LED_SCALE_ONE           ( 1 << LED_SCALE_SHIFT )
+
+/*------------------------------------------------------------
+Adaptive refresh, SysTick engine only. Rather than visiting
+the drivers in turn, each slot goes to the driver whose hold
+capacitor is furthest from its target, counting both pending
+brightness changes and modeled droop. Slots are skipped when
+no driver is off by LED_REFRESH_THRESHOLD or more.
+------------------------------------------------------------*/
+#ifndef LED_REFRESH_ADAPTIVE
+#define LED_REFRESH_ADAPTIVE    ( 1 )
+#endif
+
+/*------------------------------------------------------------
+Refresh benchmark. With LED_BENCHMARK set, led_init() sweeps
+the time a driver is connected to the DAC against the level
+it reaches, sensed on PA0 through a shared return resistor
+that has to be added to the board, and every refresh edge
+toggles a debug pin and is timed with the DWT cycle counter. Results are collected in g_led_benchmark for
+inspection from a debugger.
+------------------------------------------------------------*/
+#ifndef LED_BENCHMARK
+#define LED_BENCHMARK           ( 0 )
+#endif
+
+#define LED_BENCH_BINS          ( 32 )      /* 1 us period histogram bins       */
+#define LED_BENCH_SETTLE_STEPS  ( 32 )      /* Connect times swept              */
+#define LED_BENCH_SETTLE_STEP_US ( 2 )      /* Connect time step (us)           */
+
 /*--------------------------------------------------------------------------------
                                      MACROS
 --------------------------------------------------------------------------------*/
@@ -27,41 +112,95 @@
                                       TYPES
 --------------------------------------------------------------------------------*/
 
-typedef enum
-{
-    LED_0,
-    LED_1,
-    LED_2,
-    LED_3,
-    LED_4,
-    LED_5,
-    LED_6,
-    LED_7,
+/*------------------------------------------------------------
+LED index, LED_FIRST to LED_FINAL. LED n is output
+n % LED_BANK_SIZE of bank n / LED_BANK_SIZE.
+------------------------------------------------------------*/
+typedef uint8_t led_type;
 
-    LED_COUNT,
-    LED_FIRST = LED_0,
-    LED_FINAL = LED_7
-} led_type;
+/*------------------------------------------------------------
+Refresh benchmark results. Edge periods are binned in us
+around the nominal period, which falls in bin
+LED_BENCH_BINS / 2. Settle error k is the mean shortfall of a
+driver connected for ( k + 1 ) * LED_BENCH_SETTLE_STEP_US us,
+in summed sense counts, against settle_full for a driver
+left connected.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        edges;          /* Refresh edges timed          */
+    uint32_t        period_min;     /* Shortest edge period (us)    */
+    uint32_t        period_max;     /* Longest edge period (us)     */
+    uint32_t        period_hist[ LED_BENCH_BINS ];
+                                    /* Edge periods, 1 us bins      */
+    int32_t         settle_error[ LED_BENCH_SETTLE_STEPS ];
+                                    /* Mean shortfall per step      */
+    uint32_t        settle_full;    /* Mean fully settled reading   */
+}led_benchmark_type;
 
 
 /*--------------------------------------------------------------------------------
                                 GLOBAL VARIABLES
 --------------------------------------------------------------------------------*/
 
+#if( LED_BENCHMARK )
+extern volatile led_benchmark_type g_led_benchmark;
+#endif
+
 /*--------------------------------------------------------------------------------
                                    PROCEDURES
 --------------------------------------------------------------------------------*/
 
+void led_clock_update
+    (
+    void
+    );
+
+ramfunc void led_frame_begin
+    (
+    void
+    );
+
+ramfunc void led_frame_commit
+    (
+    void
+    );
+
+void led_frame_trace
+    (
+    void
+    );
+
+ramfunc uint32_t led_get_current
+    (
+    uint32_t    led_brightness
+    );
+
 void led_init
     (
     void
     );
 
-void led_set_brightness
+boolean led_is_dark
+    (
+    void
+    );
+
+ramfunc void led_set_brightness
     (
     led_type    led_id,
     uint32_t    led_brightness
     );
 
+void led_set_refresh_divider
+    (
+    uint32_t    divider
+    );
+
+void led_set_scale
+    (
+    uint32_t    scale
+    );
+
 
 #endif /* LEDS_H_ */
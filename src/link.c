@@ -0,0 +1,476 @@
+/*********************************************************************************
+ *
+ *  link.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Flash beacons between daisy-chained jars.
+ *
+ *       A beacon is four bytes: LINK_SYNC, hop count, flash count and a
+ *       check byte. USART2 runs from HSI, so the baud rate holds through
+ *       every performance switch. Both directions run on DMA: reception
+ *       into a circular buffer drained by link_poll(), transmission in
+ *       chunks started from link_poll(), so no byte costs an interrupt.
+ *       The only interrupt, on an idle receive line, exists to wake the
+ *       core from a tickless sleep.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stm32f3xx.h>
+
+#include "system.h"
+#include "gpio.h"
+#include "leds.h"
+#include "link.h"
+#include "trace.h"
+
+#if( LINK_ENABLE )
+
+#if( TRACE_ENABLE )
+#error "The link TX pin, PB3, is also SWO"
+#endif
+
+#if( LED_REFRESH_ENGINE == LED_REFRESH_DMA )
+#error "The link TX and the DMA refresh engine both need DMA1 channel 7"
+#endif
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define LINK_HSI_HZ             ( 8000000 )
+#define LINK_AF_USART2          ( 7 )
+#define LINK_PRIORITY           ( ( 1 << __NVIC_PRIO_BITS ) - 1 )
+
+/*------------------------------------------------------------
+Beacon framing
+------------------------------------------------------------*/
+#define LINK_SYNC               ( 0xA5 )
+#define LINK_BEACON_BYTES       ( 4 )
+#define LINK_FLASHES_MAX        ( 0xFF )
+
+/*------------------------------------------------------------
+DMA buffers, powers of two. At LINK_BAUD the receive buffer
+holds well over a firefly update of back to back beacons.
+------------------------------------------------------------*/
+#define LINK_RX_BYTES           ( 64 )
+#define LINK_TX_BYTES           ( 64 )
+
+
+/*--------------------------------------------------------------------------------
+                                     MACROS
+--------------------------------------------------------------------------------*/
+
+#define link_check( hops, flashes )     ( (uint8_t)~( LINK_SYNC + (hops) + (flashes) ) )
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               MEMORY_CONSTANTS
+--------------------------------------------------------------------------------*/
+
+static const gpio_type link_tx_io = { GPIOB,  3 };
+static const gpio_type link_rx_io = { GPIOB,  4 };
+
+
+/*--------------------------------------------------------------------------------
+                               GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+volatile link_stats_type g_link_stats;
+
+/*--------------------------------------------------------------------------------
+                               STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Receive ring, written by DMA, and the beacon being assembled
+------------------------------------------------------------*/
+static uint8_t          s_rx[ LINK_RX_BYTES ];
+static uint32_t         s_rx_read;
+static uint8_t          s_beacon[ LINK_BEACON_BYTES ];
+static uint32_t         s_beacon_len;
+
+/*------------------------------------------------------------
+Transmit ring. Bytes between tail and head are waiting, the
+first s_tx_busy of them are in flight on DMA.
+------------------------------------------------------------*/
+static uint8_t          s_tx[ LINK_TX_BYTES ];
+volatile static uint32_t s_tx_head;
+volatile static uint32_t s_tx_tail;
+static uint32_t         s_tx_busy;
+
+compile_assert( ( LINK_RX_BYTES & ( LINK_RX_BYTES - 1 ) ) == 0, link_rx_bytes );
+compile_assert( ( LINK_TX_BYTES & ( LINK_TX_BYTES - 1 ) ) == 0, link_tx_bytes );
+compile_assert( LINK_HOPS_MAX < 32, link_hops_max );
+
+/*--------------------------------------------------------------------------------
+                                  PROCEDURES
+--------------------------------------------------------------------------------*/
+
+static uint32_t link_parse
+    (
+    uint8_t         byte
+    );
+
+static boolean link_queue
+    (
+    uint32_t        hops,
+    uint32_t        flashes
+    );
+
+static uint32_t link_rx_write
+    (
+    void
+    );
+
+static void link_tx_service
+    (
+    void
+    );
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_init
+ *
+ *  Description:
+ *      Start USART2 at LINK_BAUD with both directions on DMA.
+ *
+ ************************************************************************/
+void link_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Clock USART2 from HSI, which never changes with the core
+    clock
+    --------------------------------------------------------*/
+    RCC->CFGR3 = ( RCC->CFGR3 & ~RCC_CFGR3_USART2SW ) | RCC_CFGR3_USART2SW_HSI;
+    RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
+    RCC->AHBENR  |= RCC_AHBENR_DMA1EN;
+
+    gpio_cfg_alternate( &link_tx_io, LINK_AF_USART2 );
+    gpio_cfg_alternate( &link_rx_io, LINK_AF_USART2 );
+
+    /*--------------------------------------------------------
+    8N1. Overruns overwrite rather than stall reception, the
+    framing copes with lost bytes.
+    --------------------------------------------------------*/
+    USART2->CR1 = 0;
+    USART2->BRR = ( LINK_HSI_HZ + LINK_BAUD / 2 ) / LINK_BAUD;
+    USART2->CR3 = USART_CR3_DMAT | USART_CR3_DMAR | USART_CR3_OVRDIS;
+
+    /*--------------------------------------------------------
+    Receive forever into the ring. Transmit DMA is set up per
+    chunk.
+    --------------------------------------------------------*/
+    s_rx_read = 0;
+    s_beacon_len = 0;
+    s_tx_head = 0;
+    s_tx_tail = 0;
+    s_tx_busy = 0;
+
+    DMA1_Channel6->CCR   = 0;
+    DMA1_Channel6->CPAR  = (uint32_t)&USART2->RDR;
+    DMA1_Channel6->CMAR  = (uint32_t)s_rx;
+    DMA1_Channel6->CNDTR = LINK_RX_BYTES;
+    DMA1_Channel6->CCR   = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+
+    DMA1_Channel7->CCR   = 0;
+    DMA1_Channel7->CPAR  = (uint32_t)&USART2->TDR;
+
+    /*--------------------------------------------------------
+    The idle line interrupt only wakes the core
+    --------------------------------------------------------*/
+    USART2->CR1 = USART_CR1_IDLEIE | USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+    NVIC_SetPriority( USART2_IRQn, LINK_PRIORITY );
+    NVIC_EnableIRQ( USART2_IRQn );
+
+}   /* link_init() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_is_idle
+ *
+ *  Description:
+ *      Check that no beacon is waiting to be read or sent, so that the
+ *      core may stop the tick that drives link_poll(). Safe to call from
+ *      the main loop.
+ *
+ ************************************************************************/
+boolean link_is_idle
+    (
+    void
+    )
+{
+    return( link_rx_write() == s_rx_read
+         && s_tx_head == s_tx_tail );
+
+}   /* link_is_idle() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_poll
+ *
+ *  Description:
+ *      Read the beacons received since the last call, queue them for the
+ *      next jar, and keep transmission going. Returns the coupling weight
+ *      heard, in units of LINK_WEIGHT_ONE per local flash. Call once per
+ *      firefly update.
+ *
+ ************************************************************************/
+uint32_t link_poll
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        write;
+    uint32_t        weight;
+
+    weight = 0;
+    write = link_rx_write();
+    while( s_rx_read != write )
+    {
+        weight += link_parse( s_rx[ s_rx_read ] );
+        s_rx_read = ( s_rx_read + 1 ) % LINK_RX_BYTES;
+    }
+
+    link_tx_service();
+
+    return( weight );
+
+}   /* link_poll() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_send
+ *
+ *  Description:
+ *      Queue a beacon for the flashes started this update. It goes out
+ *      on the next link_poll().
+ *
+ ************************************************************************/
+void link_send
+    (
+    uint32_t        flashes     /* Flashes started this update          */
+    )
+{
+    if( link_queue( 0, min_val( flashes, LINK_FLASHES_MAX ) ) )
+    {
+        g_link_stats.sent++;
+    }
+
+}   /* link_send() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      USART2_IRQHandler
+ *
+ *  Description:
+ *      Idle receive line. Waking the core is all that is needed, the
+ *      beacons are read by link_poll().
+ *
+ ************************************************************************/
+void USART2_IRQHandler
+    (
+    void
+    )
+{
+    USART2->ICR = USART_ICR_IDLECF;
+
+}   /* USART2_IRQHandler() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_parse
+ *
+ *  Description:
+ *      Add a received byte to the beacon being assembled. A complete
+ *      beacon is queued one hop further on, and returns its coupling
+ *      weight. A broken beacon is dropped, and assembly resumes at the
+ *      next LINK_SYNC.
+ *
+ ************************************************************************/
+static uint32_t link_parse
+    (
+    uint8_t         byte
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        hops;
+    uint32_t        flashes;
+
+    if( s_beacon_len == 0
+     && byte != LINK_SYNC )
+    {
+        g_link_stats.rx_errors++;
+        return( 0 );
+    }
+
+    s_beacon[ s_beacon_len++ ] = byte;
+    if( s_beacon_len < LINK_BEACON_BYTES )
+    {
+        return( 0 );
+    }
+    s_beacon_len = 0;
+
+    hops = s_beacon[ 1 ];
+    flashes = s_beacon[ 2 ];
+    if( s_beacon[ 3 ] != link_check( hops, flashes ) )
+    {
+        g_link_stats.rx_errors += LINK_BEACON_BYTES;
+        return( 0 );
+    }
+    g_link_stats.received++;
+
+    if( hops >= LINK_HOPS_MAX )
+    {
+        return( 0 );
+    }
+
+    /*--------------------------------------------------------
+    Pass it on while it has hops left
+    --------------------------------------------------------*/
+    if( hops + 1 < LINK_HOPS_MAX
+     && link_queue( hops + 1, flashes ) )
+    {
+        g_link_stats.relayed++;
+    }
+
+    return( ( flashes * LINK_WEIGHT_UPSTREAM ) >> hops );
+
+}   /* link_parse() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_queue
+ *
+ *  Description:
+ *      Append a beacon to the transmit ring. Returns FALSE, and drops the
+ *      beacon, if the ring is full.
+ *
+ ************************************************************************/
+static boolean link_queue
+    (
+    uint32_t        hops,
+    uint32_t        flashes
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        head;
+
+    head = s_tx_head;
+    if( head - s_tx_tail > LINK_TX_BYTES - LINK_BEACON_BYTES )
+    {
+        g_link_stats.tx_drops++;
+        return( FALSE );
+    }
+
+    s_tx[ head++ % LINK_TX_BYTES ] = LINK_SYNC;
+    s_tx[ head++ % LINK_TX_BYTES ] = hops;
+    s_tx[ head++ % LINK_TX_BYTES ] = flashes;
+    s_tx[ head++ % LINK_TX_BYTES ] = link_check( hops, flashes );
+    s_tx_head = head;
+
+    return( TRUE );
+
+}   /* link_queue() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_rx_write
+ *
+ *  Description:
+ *      Get the receive ring index the DMA writes next.
+ *
+ ************************************************************************/
+static uint32_t link_rx_write
+    (
+    void
+    )
+{
+    return( ( LINK_RX_BYTES - DMA1_Channel6->CNDTR ) % LINK_RX_BYTES );
+
+}   /* link_rx_write() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      link_tx_service
+ *
+ *  Description:
+ *      Retire a finished transmit chunk and start the next one, up to
+ *      the end of the ring or the last byte waiting.
+ *
+ ************************************************************************/
+static void link_tx_service
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        tail;
+    uint32_t        count;
+
+    if( s_tx_busy != 0 )
+    {
+        if( DMA1_Channel7->CNDTR != 0 )
+        {
+            return;
+        }
+        s_tx_tail += s_tx_busy;
+        s_tx_busy = 0;
+    }
+
+    tail = s_tx_tail;
+    count = min_val( s_tx_head - tail, LINK_TX_BYTES - ( tail % LINK_TX_BYTES ) );
+    if( count == 0 )
+    {
+        return;
+    }
+
+    DMA1_Channel7->CCR   = 0;
+    DMA1_Channel7->CMAR  = (uint32_t)&s_tx[ tail % LINK_TX_BYTES ];
+    DMA1_Channel7->CNDTR = count;
+    DMA1_Channel7->CCR   = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_EN;
+    s_tx_busy = count;
+
+}   /* link_tx_service() */
+
+#endif
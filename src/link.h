@@ -0,0 +1,100 @@
+/*********************************************************************************
+ *
+ *  link.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Flash beacons between daisy-chained jars.
+ *
+ ********************************************************************************/
+
+#ifndef LINK_H_
+#define LINK_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Set LINK_ENABLE to 1 to couple sync mode jars into one room
+scale swarm. Jars are chained TX to RX, PB3 to PB4 of the next
+jar down the row, by wire or through an IR transceiver pair.
+Each update with flashes sends a 4-byte beacon downstream, and
+beacons from upstream are relayed on for LINK_HOPS_MAX jars.
+Coupling halves with every hop, and each hop adds up to a
+firefly update of latency, so a chain phase locks to its
+first jar with a wave running down the row.
+The link takes DMA1 channels 6 and 7, so it cannot be built
+with SWO tracing or the DMA refresh engine.
+------------------------------------------------------------*/
+#ifndef LINK_ENABLE
+#define LINK_ENABLE             ( 0 )
+#endif
+
+#ifndef LINK_BAUD
+#define LINK_BAUD               ( 38400 )       /* Slow enough for IR                   */
+#endif
+
+#ifndef LINK_HOPS_MAX
+#define LINK_HOPS_MAX           ( 8 )           /* Jars a beacon reaches                */
+#endif
+
+/*------------------------------------------------------------
+Coupling weights, LINK_WEIGHT_ONE for a flash in this jar
+------------------------------------------------------------*/
+#define LINK_WEIGHT_ONE         ( 256 )
+#define LINK_WEIGHT_UPSTREAM    ( 128 )         /* A flash in the jar just upstream     */
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Link statistics, for inspection from a debugger when setting
+up a row
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        sent;           /* Beacons for local flashes    */
+    uint32_t        received;       /* Valid beacons from upstream  */
+    uint32_t        relayed;        /* Beacons passed downstream    */
+    uint32_t        rx_errors;      /* Bytes of broken beacons      */
+    uint32_t        tx_drops;       /* Beacons lost, TX buffer full */
+}link_stats_type;
+
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+#if( LINK_ENABLE )
+extern volatile link_stats_type g_link_stats;
+#endif
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+void link_init
+    (
+    void
+    );
+
+boolean link_is_idle
+    (
+    void
+    );
+
+uint32_t link_poll
+    (
+    void
+    );
+
+void link_send
+    (
+    uint32_t        flashes     /* Flashes started this update          */
+    );
+
+
+#endif /* LINK_H_ */
@@ -17,10 +17,15 @@
 #include <stm32f3xx.h>
 
 #include "system.h"
+#include "battery.h"
 #include "leds.h"
 #include "fireflies.h"
 #include "gpio.h"
+#include "link.h"
 #include "touch.h"
+#include "random.h"
+#include "replay.h"
+#include "trace.h"
 
 
 /*--------------------------------------------------------------------------------
@@ -30,6 +35,7 @@
 #define TIMEOUT_MINUTES     ( 15 )
 #define TIMEOUT_SECONDS     ( TIMEOUT_MINUTES * 60 )
 #define TIMEOUT_MS          ( TIMEOUT_SECONDS * 1000 )
+#define RAMP_TICKS          ( 1 )   /* Full speed this long before a flash  */
 
 
 /*--------------------------------------------------------------------------------
@@ -51,13 +57,25 @@ static const gpio_type hold_power_io = { GPIOA,  1 };
                                STATIC VARIABLES
 --------------------------------------------------------------------------------*/
 
-volatile static uint32_t s_timeout_counter;
-
-
 /*--------------------------------------------------------------------------------
                                   PROCEDURES
 --------------------------------------------------------------------------------*/
 
+void main_hold_power
+    (
+    void
+    );
+
+static uint32_t main_idle_ticks
+    (
+    void
+    );
+
+static void main_power_off
+    (
+    void
+    );
+
 static void main_timeout_callback
     (
     void
@@ -79,31 +97,134 @@ int main
     )
 {
     /*--------------------------------------------------------
-    Set 'Hold power' pin high before touch controller goes
-    low to keep the lights on until we decide to turn off.
+    Local variables
     --------------------------------------------------------*/
-    gpio_cfg_output( &hold_power_io );
-    gpio_output_set( &hold_power_io, GPIO_STATE_HIGH );
+    system_event_type
+                event;
+    uint32_t    idle_ticks;
+    uint32_t    seed;
 
     /*--------------------------------------------------------
-    Initialize system
+    Initialize system. Reset_Handler has already set the
+    'Hold power' pin, and the core runs from HSI while the PLL
+    locks. Bring up the LED drivers and gather entropy in the
+    meantime, then switch to full speed for the envelope
+    tables.
     --------------------------------------------------------*/
     system_init();
     led_init();
+    system_boot_mark( SYSTEM_BOOT_LEDS );
+    seed = system_get_entropy();
+    random_seed( seed );
+#if( REPLAY_RECORD )
+    replay_record_seed( seed );
+#endif
+
+    if( system_set_performance( SYSTEM_PERF_FULL ) )
+    {
+        led_clock_update();
+    }
+    system_boot_mark( SYSTEM_BOOT_PLL );
+
     firefly_init();
+#if( BATTERY_MONITOR )
+    battery_init();
+#endif
     touch_init();
+#if( LINK_ENABLE )
+    link_init();
+#endif
+    system_boot_mark( SYSTEM_BOOT_READY );
 
     /*--------------------------------------------------------
-    Start timeout counter
+    Start timeout timer
     --------------------------------------------------------*/
-    s_timeout_counter = 0;
-    system_add_task( main_timeout_callback, 1 );
+    system_timer_start( main_timeout_callback, TIMEOUT_MS );
+#if( SYSTEM_HEALTH )
+    system_health_start();
+#endif
 
     while( 1 )
     {
+#if( SYSTEM_HEALTH )
         /*----------------------------------------------------
-        Do nothing until interrupted.
+        Feed the watchdog while every task keeps running
         ----------------------------------------------------*/
+        system_health_check();
+#endif
+
+        /*----------------------------------------------------
+        Handle the work interrupts have left for us. Every
+        touch restarts the timeout.
+        ----------------------------------------------------*/
+        while( system_event_get( &event ) )
+        {
+            switch( event.id )
+            {
+                case SYSTEM_EVENT_TOUCH:
+                    system_timer_start( main_timeout_callback, TIMEOUT_MS );
+                    break;
+
+                case SYSTEM_EVENT_TIMER:
+                    event.task();
+                    break;
+
+#if( TRACE_ENABLE )
+                case SYSTEM_EVENT_FRAME:
+                    led_frame_trace();
+                    break;
+#endif
+
+                case SYSTEM_EVENT_SHUTDOWN:
+                    main_power_off();
+                    break;
+
+                case SYSTEM_EVENT_DOUBLE_TAP:
+                    firefly_next_set();
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        /*----------------------------------------------------
+        While every firefly is waiting in the dark, nothing
+        needs full speed or the tick until just before the
+        next flash or the next task that still has work in the
+        dark, a touch, or a beacon from another jar. Otherwise,
+        run at full speed and sleep until the next interrupt.
+        ----------------------------------------------------*/
+        idle_ticks = main_idle_ticks();
+        if( system_set_performance( idle_ticks ? SYSTEM_PERF_IDLE : SYSTEM_PERF_FULL ) )
+        {
+            led_clock_update();
+        }
+
+        /*----------------------------------------------------
+        Check for new events with interrupts masked, so that
+        one posted after the check still wakes the core. A
+        firefly update may have run while the clock switched,
+        so the idle time is taken again before sleeping on it.
+        If it is gone, loop round to return to full speed.
+        ----------------------------------------------------*/
+        __disable_irq();
+        if( !system_event_pending() )
+        {
+            if( idle_ticks == 0 )
+            {
+                __WFI();
+            }
+            else
+            {
+                idle_ticks = main_idle_ticks();
+                if( idle_ticks != 0 )
+                {
+                    system_sleep( idle_ticks - RAMP_TICKS );
+                }
+            }
+        }
+        __enable_irq();
     }
 
     return( 0 );
@@ -114,37 +235,105 @@ int main
 /*************************************************************************
  *
  *  Procedure:
- *      main_timeout_callback
+ *      main_hold_power
  *
  *  Description:
- *      A callback function to end firefly activity if the jar has not
- *      been touched in TIMEOUT_MS.
+ *      Set 'Hold power' pin high before touch controller goes low to keep
+ *      the lights on until we decide to turn off. Called by Reset_Handler
+ *      ahead of .data and .bss initialization, so this may only use
+ *      constants and the stack.
  *
  ************************************************************************/
-static void main_timeout_callback
+void main_hold_power
+    (
+    void
+    )
+{
+    gpio_cfg_output( &hold_power_io );
+    gpio_output_set( &hold_power_io, GPIO_STATE_HIGH );
+
+} /* main_hold_power() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      main_idle_ticks
+ *
+ *  Description:
+ *      Get the ticks until the next flash or the next task that still
+ *      has work in the dark, or 0 if the jar cannot idle. It can while
+ *      every LED is dark, the link is quiet, and the wait is longer than
+ *      RAMP_TICKS.
+ *
+ ************************************************************************/
+static uint32_t main_idle_ticks
     (
     void
     )
 {
     /*--------------------------------------------------------
-    Reset the timeout counter if a touch event was sensed,
-    otherwise increment the counter.
+    Local variables
     --------------------------------------------------------*/
-    if( touch_read() == TOUCH_STATE_ACTIVE )
+    uint32_t    ticks;
+
+    ticks = min_val( firefly_ticks_to_next_flash(), system_ticks_to_next_task() );
+    if( ticks <= RAMP_TICKS
+     || !led_is_dark() )
     {
-        s_timeout_counter = 0;
+        return( 0 );
     }
-    else
+
+#if( LINK_ENABLE )
+    if( !link_is_idle() )
     {
-        s_timeout_counter++;
+        return( 0 );
     }
+#endif
 
+    return( ticks );
+
+} /* main_idle_ticks() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      main_power_off
+ *
+ *  Description:
+ *      Let go of the 'Hold power' pin. Power stays on for as long as the
+ *      touch controller still holds it.
+ *
+ ************************************************************************/
+static void main_power_off
+    (
+    void
+    )
+{
+    gpio_output_set( &hold_power_io, GPIO_STATE_LOW );
+
+} /* main_power_off() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      main_timeout_callback
+ *
+ *  Description:
+ *      One-shot timer callback to end firefly activity once the jar has
+ *      not been touched in TIMEOUT_MS. Every touch rearms the timer.
+ *
+ ************************************************************************/
+static void main_timeout_callback
+    (
+    void
+    )
+{
     /*--------------------------------------------------------
-    Check if it's time to shut down.
+    Shut down.
     --------------------------------------------------------*/
-    if( s_timeout_counter >= TIMEOUT_MS )
-    {
-        gpio_output_set( &hold_power_io, GPIO_STATE_LOW );
-    }
+    main_power_off();
 
 } /* main_timeout_callback() */
@@ -0,0 +1,127 @@
+/*********************************************************************************
+ *
+ *  random.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Small seedable pseudo-random number generator.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#include "random.h"
+
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+State used when seeded with zero, which would otherwise lock
+the xorshift generator at zero forever.
+------------------------------------------------------------*/
+#define RANDOM_DEFAULT_STATE    ( 0x6D2B79F5 )
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               MEMORY_CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+static uint32_t s_state = RANDOM_DEFAULT_STATE;
+
+
+/*--------------------------------------------------------------------------------
+                                  PROCEDURES
+--------------------------------------------------------------------------------*/
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      random_next
+ *
+ *  Description:
+ *      Return the next 32-bit value of a xorshift32 generator. Three
+ *      shifts and three xors, no divide and no library state.
+ *
+ ************************************************************************/
+uint32_t random_next
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    x;
+
+    x = s_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s_state = x;
+
+    return( x );
+
+}   /* random_next() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      random_range
+ *
+ *  Description:
+ *      Return a value in [min, max]. The 32-bit output is scaled onto
+ *      the span with a multiply and shift rather than a modulo, which
+ *      avoids the divide and uses the high bits of the generator.
+ *
+ ************************************************************************/
+int32_t random_range
+    (
+    int32_t         min,    /* Smallest value returned                  */
+    int32_t         max     /* Largest value returned                   */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    span;
+
+    span = (uint32_t)( max - min ) + 1;
+
+    return( min + (int32_t)( ( (uint64_t)random_next() * span ) >> 32 ) );
+
+}   /* random_range() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      random_seed
+ *
+ *  Description:
+ *      Seed the generator.
+ *
+ ************************************************************************/
+void random_seed
+    (
+    uint32_t        seed    /* Generator seed, any value                */
+    )
+{
+    s_state = ( seed != 0 ) ? seed : RANDOM_DEFAULT_STATE;
+
+}   /* random_seed() */
@@ -0,0 +1,47 @@
+/*********************************************************************************
+ *
+ *  random.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Small seedable pseudo-random number generator.
+ *
+ ********************************************************************************/
+
+#ifndef RANDOM_H_
+#define RANDOM_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+uint32_t random_next
+    (
+    void
+    );
+
+int32_t random_range
+    (
+    int32_t         min,    /* Smallest value returned                  */
+    int32_t         max     /* Largest value returned                   */
+    );
+
+void random_seed
+    (
+    uint32_t        seed    /* Generator seed, any value                */
+    );
+
+
+#endif /* RANDOM_H_ */
@@ -0,0 +1,312 @@
+/*********************************************************************************
+ *
+ *  replay.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Record the inputs of the firefly engine for deterministic replay.
+ *
+ *       Updates normally come one period apart, so only the ones that do not
+ *       take an entry, such as the first after a tickless sleep or one that
+ *       a long deferred task held up. A jar recording from boot fills the log
+ *       in tens of minutes or more, depending on how often it sleeps.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#include "system.h"
+#include "fireflies.h"
+#include "replay.h"
+
+#if( REPLAY_RECORD )
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define REPLAY_FNV_BASIS        ( 0x811C9DC5 )
+#define REPLAY_FNV_PRIME        ( 0x01000193 )
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               MEMORY_CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+replay_log_type g_replay_log;
+
+/*--------------------------------------------------------------------------------
+                               STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Regular cadence, and the inputs last logged
+------------------------------------------------------------*/
+static uint32_t         s_period;
+static uint32_t         s_next_tick;
+static uint32_t         s_pace;
+static uint32_t         s_set;
+static uint8_t          s_degrade;
+
+/*--------------------------------------------------------------------------------
+                                  PROCEDURES
+--------------------------------------------------------------------------------*/
+
+static ramfunc boolean replay_append
+    (
+    replay_entry_id_type
+                    id,
+    uint32_t        tick,
+    uint32_t        value
+    );
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_beacon
+ *
+ *  Description:
+ *      Log the beacon weight an update heard from upstream, if any.
+ *
+ ************************************************************************/
+ramfunc void replay_record_beacon
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        weight      /* Beacon weight heard              */
+    )
+{
+    if( weight != 0 )
+    {
+        replay_append( REPLAY_ENTRY_BEACON, tick, weight );
+    }
+
+}   /* replay_record_beacon() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_degrade
+ *
+ *  Description:
+ *      Log the degraded mode an update runs in, if it has changed.
+ *
+ ************************************************************************/
+ramfunc void replay_record_degrade
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint8_t         degrade     /* Degraded mode in effect          */
+    )
+{
+    if( degrade != s_degrade
+     && replay_append( REPLAY_ENTRY_DEGRADE, tick, degrade ) )
+    {
+        s_degrade = degrade;
+    }
+
+}   /* replay_record_degrade() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_led
+ *
+ *  Description:
+ *      Fold an LED write into the frame hash.
+ *
+ ************************************************************************/
+ramfunc void replay_record_led
+    (
+    uint32_t        led,        /* LED written                      */
+    uint32_t        brightness  /* Brightness written               */
+    )
+{
+    if( g_replay_log.dropped == 0 )
+    {
+        g_replay_log.frame_hash = ( g_replay_log.frame_hash ^ led ) * REPLAY_FNV_PRIME;
+        g_replay_log.frame_hash = ( g_replay_log.frame_hash ^ brightness ) * REPLAY_FNV_PRIME;
+    }
+
+}   /* replay_record_led() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_pace
+ *
+ *  Description:
+ *      Log the random mode pace an update runs at, if it has changed.
+ *
+ ************************************************************************/
+ramfunc void replay_record_pace
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        pace        /* Pace in effect                   */
+    )
+{
+    if( pace != s_pace
+     && replay_append( REPLAY_ENTRY_PACE, tick, pace ) )
+    {
+        s_pace = pace;
+    }
+
+}   /* replay_record_pace() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_seed
+ *
+ *  Description:
+ *      Start a new log for a run seeded with seed.
+ *
+ ************************************************************************/
+void replay_record_seed
+    (
+    uint32_t        seed        /* Random seed                      */
+    )
+{
+    clear_struct( g_replay_log );
+    g_replay_log.magic = REPLAY_MAGIC;
+    g_replay_log.seed = seed;
+    g_replay_log.frame_hash = REPLAY_FNV_BASIS;
+    s_degrade = 0;
+    s_pace = FIREFLY_PACE_ONE;
+    s_set = 0;
+
+}   /* replay_record_seed() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_set
+ *
+ *  Description:
+ *      Log the pattern set an update runs towards, if it has changed.
+ *
+ ************************************************************************/
+ramfunc void replay_record_set
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        set         /* Pattern set asked for            */
+    )
+{
+    if( set != s_set
+     && replay_append( REPLAY_ENTRY_SET, tick, set ) )
+    {
+        s_set = set;
+    }
+
+}   /* replay_record_set() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_start
+ *
+ *  Description:
+ *      Log the tick the firefly engine started on and its update period.
+ *
+ ************************************************************************/
+void replay_record_start
+    (
+    uint32_t        tick,       /* Tick of firefly_init()           */
+    uint32_t        period      /* Regular update period            */
+    )
+{
+    s_period = period;
+    s_next_tick = tick + period;
+    replay_append( REPLAY_ENTRY_START, tick, period );
+
+}   /* replay_record_start() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_record_update
+ *
+ *  Description:
+ *      Count an update, and log it along with its number if it did not
+ *      come one period after the last.
+ *
+ ************************************************************************/
+ramfunc void replay_record_update
+    (
+    uint32_t        tick        /* Tick of the update               */
+    )
+{
+    if( tick != s_next_tick
+     && !replay_append( REPLAY_ENTRY_UPDATE, tick, g_replay_log.updates ) )
+    {
+        return;
+    }
+
+    if( g_replay_log.dropped == 0 )
+    {
+        g_replay_log.updates++;
+    }
+    s_next_tick = tick + s_period;
+
+}   /* replay_record_update() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      replay_append
+ *
+ *  Description:
+ *      Append an entry. Returns FALSE, and stops the log, if it is full.
+ *
+ ************************************************************************/
+static ramfunc boolean replay_append
+    (
+    replay_entry_id_type
+                    id,
+    uint32_t        tick,
+    uint32_t        value
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    replay_entry_type
+                  * entry;
+
+    if( g_replay_log.count >= REPLAY_LOG_MAX
+     || g_replay_log.dropped != 0 )
+    {
+        g_replay_log.dropped++;
+        return( FALSE );
+    }
+
+    entry = &g_replay_log.entries[ g_replay_log.count++ ];
+    entry->tick = tick;
+    entry->value = value;
+    entry->id = id;
+
+    return( TRUE );
+
+}   /* replay_append() */
+
+#endif
@@ -0,0 +1,144 @@
+/*********************************************************************************
+ *
+ *  replay.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Record the inputs of the firefly engine for deterministic replay.
+ *
+ ********************************************************************************/
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Set REPLAY_RECORD to 1 to log everything the firefly engine
+takes from outside: the random seed, the tick of its first
+update, updates that do not follow one period after the last,
+degraded mode, pace and pattern set changes and beacon
+weights. Everything else follows from these. A hash of every
+LED write checks that a replay, see sim/, reproduced the run.
+Dump g_replay_log from a debugger as raw bytes to replay it
+on the host.
+------------------------------------------------------------*/
+#ifndef REPLAY_RECORD
+#define REPLAY_RECORD           ( 0 )
+#endif
+
+#ifndef REPLAY_LOG_MAX
+#define REPLAY_LOG_MAX          ( 256 )         /* Entries, 12 bytes each               */
+#endif
+
+#define REPLAY_MAGIC            ( 0x4C504552 )  /* "REPL"                               */
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Log entry IDs
+------------------------------------------------------------*/
+typedef uint8_t replay_entry_id_type;
+enum
+{
+    REPLAY_ENTRY_START,             /* firefly_init(), value period */
+    REPLAY_ENTRY_UPDATE,            /* Update number value off tick */
+    REPLAY_ENTRY_DEGRADE,           /* Degraded mode now value      */
+    REPLAY_ENTRY_BEACON,            /* Beacon weight value heard    */
+    REPLAY_ENTRY_PACE,              /* Random mode pace now value   */
+    REPLAY_ENTRY_SET,               /* Pattern set asked for value  */
+};
+
+/*------------------------------------------------------------
+Log entry, for the update at tick
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        tick;
+    uint32_t        value;
+    replay_entry_id_type
+                    id;
+}replay_entry_type;
+
+/*------------------------------------------------------------
+Replay log. Recording stops at the first entry that does not
+fit, and updates and frame_hash only cover the run up to it.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        magic;          /* REPLAY_MAGIC once seeded     */
+    uint32_t        seed;           /* random_seed() at boot        */
+    uint32_t        count;          /* Entries recorded             */
+    uint32_t        dropped;        /* Entries past a full log      */
+    uint32_t        updates;        /* Updates the log covers       */
+    uint32_t        frame_hash;     /* FNV-1a of every LED write    */
+    replay_entry_type
+                    entries[ REPLAY_LOG_MAX ];
+}replay_log_type;
+
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+#if( REPLAY_RECORD )
+extern replay_log_type g_replay_log;
+#endif
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+ramfunc void replay_record_beacon
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        weight      /* Beacon weight heard              */
+    );
+
+ramfunc void replay_record_degrade
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint8_t         degrade     /* Degraded mode in effect          */
+    );
+
+ramfunc void replay_record_led
+    (
+    uint32_t        led,        /* LED written                      */
+    uint32_t        brightness  /* Brightness written               */
+    );
+
+ramfunc void replay_record_pace
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        pace        /* Pace in effect                   */
+    );
+
+void replay_record_seed
+    (
+    uint32_t        seed        /* Random seed                      */
+    );
+
+ramfunc void replay_record_set
+    (
+    uint32_t        tick,       /* Tick of the update               */
+    uint32_t        set         /* Pattern set asked for            */
+    );
+
+void replay_record_start
+    (
+    uint32_t        tick,       /* Tick of firefly_init()           */
+    uint32_t        period      /* Regular update period            */
+    );
+
+ramfunc void replay_record_update
+    (
+    uint32_t        tick        /* Tick of the update               */
+    );
+
+
+#endif /* REPLAY_H_ */
@@ -54,6 +54,27 @@ defined in linker script */
 .word   _sbss
 /* end address for the .bss section. defined in linker script */
 .word   _ebss
+/* load, start and end addresses of the .ramfunc section. Weak, so that a
+linker script without the section below copies nothing and .ramfunc simply
+stays in flash.
+
+  .ramfunc :
+  {
+    . = ALIGN(4);
+    _sramfunc = .;
+    *(.ramfunc)
+    *(.ramfunc*)
+    . = ALIGN(4);
+    _eramfunc = .;
+  } >RAM AT> FLASH
+  _siramfunc = LOADADDR(.ramfunc);
+*/
+.weak   _siramfunc
+.weak   _sramfunc
+.weak   _eramfunc
+.word   _siramfunc
+.word   _sramfunc
+.word   _eramfunc
 
 .equ  BootRAM,        0xF1E0F85F
 /**
@@ -71,6 +92,10 @@ defined in linker script */
 Reset_Handler:
   ldr   sp, =_estack    /* Atollic update: set stack pointer */
 
+/* Latch the power on before anything else, so that a short touch keeps the
+board running. main_hold_power() must not rely on .data or .bss. */
+  bl  main_hold_power
+
 /* Copy the data segment initializers from flash to SRAM */
   movs  r1, #0
   b LoopCopyDataInit
@@ -87,6 +112,20 @@ LoopCopyDataInit:
     adds    r2, r0, r1
     cmp r2, r3
     bcc CopyDataInit
+
+/* Copy the ramfunc code from flash to SRAM */
+    ldr r0, =_sramfunc
+    ldr r1, =_eramfunc
+    ldr r2, =_siramfunc
+    b   LoopCopyRamfunc
+
+CopyRamfunc:
+    ldr r3, [r2], #4
+    str r3, [r0], #4
+
+LoopCopyRamfunc:
+    cmp r0, r1
+    bcc CopyRamfunc
     ldr r2, =_sbss
     b   LoopFillZerobss
 /* Zero fill the bss segment. */
@@ -17,6 +17,81 @@
 #include <stm32f3xx.h>
 
 #include "system.h"
+#include "trace.h"
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define TASK_NONE           ( -1 )      /* Due list terminator                  */
+
+/*------------------------------------------------------------
+Interrupt priorities. The DMA refresh engine stays at the
+default priority 0, above the tick.
+------------------------------------------------------------*/
+#define PRIORITY_TICK           ( 1 )
+#define PRIORITY_DEFERRED       ( ( 1 << __NVIC_PRIO_BITS ) - 1 )
+
+/*------------------------------------------------------------
+While sleeping, SysTick counts HCLK / 8 so that a single
+reload can span a couple of seconds.
+------------------------------------------------------------*/
+#define SLEEP_CLOCK_DIVIDER     ( 8 )
+#define SLEEP_COUNTS_PER_TICK   ( SystemCoreClock / SLEEP_CLOCK_DIVIDER / SYSTICK_HZ )
+#define SLEEP_TICKS_MAX         ( SysTick_LOAD_RELOAD_Msk / SLEEP_COUNTS_PER_TICK )
+
+/*------------------------------------------------------------
+Boot entropy sources. The unique device ID is three words at
+a fixed system memory address.
+------------------------------------------------------------*/
+#define UID_WORDS               ( (const uint32_t *)0x1FFFF7AC )
+#define UID_WORD_COUNT          ( 3 )
+#define ADC_SQR1_SQ1_Pos        ( 6 )
+#define ADC_SMPR_CHANNELS       ( 10 )      /* Channels per SMPRx       */
+#define ADC_SMPR_BITS           ( 3 )
+#define ADC_REGULATOR_DELAY     ( 1000 )    /* > 10 us at 64 MHz        */
+#define ENTROPY_SAMPLES         ( 32 )
+
+/*------------------------------------------------------------
+One-shot timer. TIM15 counts milliseconds, and its repetition
+counter stretches the 16-bit period to about 4.6 hours.
+------------------------------------------------------------*/
+#define TIMER_HZ                ( 1000 )
+#define TIMER_PERIOD_MAX        ( 0x10000 )
+#define TIMER_REPEAT_MAX        ( 0x100 )
+#define TIMER_MS_MAX            ( TIMER_PERIOD_MAX * TIMER_REPEAT_MAX )
+
+/*------------------------------------------------------------
+Deadline time base. TIM16 counts microseconds and wraps every
+65.5 ms, so it is folded into a 32-bit count at every tick.
+------------------------------------------------------------*/
+#define TIME_HZ                 ( 1000000 )
+#define TICK_US                 ( TIME_HZ / SYSTICK_HZ )
+
+/*------------------------------------------------------------
+Independent watchdog, clocked from the LSI at a nominal 40 kHz
+(30 to 50 kHz over temperature). A tickless sleep wakes in
+time for the main loop to reload it.
+------------------------------------------------------------*/
+#define IWDG_KEY_RELOAD         ( 0xAAAA )
+#define IWDG_KEY_ACCESS         ( 0x5555 )
+#define IWDG_KEY_START          ( 0xCCCC )
+#define WATCHDOG_LSI_HZ         ( 40000 )
+#define WATCHDOG_PRESCALER      ( 3 )       /* LSI / 32                 */
+#define WATCHDOG_RELOAD         ( SYSTEM_WATCHDOG_MS * ( WATCHDOG_LSI_HZ / 32 ) / 1000 )
+#define WATCHDOG_SLEEP_TICKS    ( SYSTEM_WATCHDOG_MS / 2 * SYSTICK_HZ / 1000 )
+
+/*------------------------------------------------------------
+End of the firmware image in flash. Both the initialised data
+and the .ramfunc code are loaded from flash past the code,
+and whichever load image ends higher ends the image. Without
+a .ramfunc output section the weak symbols are all 0. Record
+pages must sit above it.
+------------------------------------------------------------*/
+#define DATA_LOAD_END           ( (uint32_t)_sidata + ( (uint32_t)_edata - (uint32_t)_sdata ) )
+#define RAMFUNC_LOAD_END        ( (uint32_t)_siramfunc + ( (uint32_t)_eramfunc - (uint32_t)_sramfunc ) )
+#define IMAGE_END               ( max_val( DATA_LOAD_END, RAMFUNC_LOAD_END ) )
+
 
 /*--------------------------------------------------------------------------------
                                       TYPES
@@ -29,30 +104,169 @@ typedef struct
 {
     task_ptr_type   task;
     uint32_t        period;
+    uint32_t        due;        /* Tick the task is next due    */
+    int8_t          next;       /* Next node in the due list    */
+    uint8_t         flags;      /* SYSTEM_TASK_ flags           */
 }task_list_type;
 
 /*--------------------------------------------------------------------------------
                                GLOBAL VARIABLES
 --------------------------------------------------------------------------------*/
 
+extern const uint32_t   _sidata[];  /* Set by the linker script */
+extern const uint32_t   _sdata[];
+extern const uint32_t   _edata[];
+extern const uint32_t   _siramfunc[] __attribute__(( weak ));
+extern const uint32_t   _sramfunc[] __attribute__(( weak ));
+extern const uint32_t   _eramfunc[] __attribute__(( weak ));
+
+#if( SYSTEM_HEALTH )
+volatile system_health_type g_system_health;
+#endif
+
+#if( SYSTEM_PROFILE )
+volatile system_profile_type g_system_profile;
+#endif
+
 /*--------------------------------------------------------------------------------
                                STATIC VARIABLES
 --------------------------------------------------------------------------------*/
 
 /*------------------------------------------------------------
-System Tasks
+System Tasks. Registered tasks are linked into a list sorted
+by due tick, so each SysTick only visits the tasks that are
+actually due. The list is only modified with interrupts
+masked or from within SysTick.
+------------------------------------------------------------*/
+static task_list_type   s_task_list[ SYSTEM_TASKS_MAX ];
+static int8_t           s_due_head = TASK_NONE;
+
+/*------------------------------------------------------------
+Deferred tasks that are due and waiting for PendSV, one bit
+per task slot. Set by SysTick, cleared by PendSV.
 ------------------------------------------------------------*/
-volatile static task_list_type s_task_list[ SYSTEM_TASKS_MAX ];
+volatile static uint32_t s_deferred_pending;
+
+compile_assert( SYSTEM_TASKS_MAX <= 32, deferred_pending );
+
+/*------------------------------------------------------------
+Event queue. Producers claim a slot by advancing the head
+with LDREX/STREX, so interrupts at any priority may post,
+and publish it by writing its id last. The main loop is the
+only consumer: it takes slots in order, clears them, and only
+then advances the tail.
+------------------------------------------------------------*/
+static volatile system_event_type
+                        s_events[ SYSTEM_EVENTS_MAX ];
+volatile static uint32_t s_event_head;
+volatile static uint32_t s_event_tail;
+
+compile_assert( ( SYSTEM_EVENTS_MAX & ( SYSTEM_EVENTS_MAX - 1 ) ) == 0, events_max );
+
+/*------------------------------------------------------------
+System tick counter
+------------------------------------------------------------*/
+volatile static uint32_t s_tick;
+
+/*------------------------------------------------------------
+One-shot timer callback, NULL while the timer is idle
+------------------------------------------------------------*/
+volatile static task_ptr_type s_timer_callback;
+static uint32_t         s_timer_deadline;
+
+/*------------------------------------------------------------
+Current performance state
+------------------------------------------------------------*/
+static system_perf_type s_perf;
+
+#if( SYSTEM_HEALTH )
+compile_assert( WATCHDOG_RELOAD <= IWDG_RLR_RL, watchdog_reload );
+
+/*------------------------------------------------------------
+Deadline time base. s_time_us is the time in microseconds at
+TIM16 count s_time_cnt, and s_tick_us the time of the current
+tick. Only changed from SysTick or with interrupts masked.
+------------------------------------------------------------*/
+static uint32_t         s_time_us;
+static uint16_t         s_time_cnt;
+static uint32_t         s_tick_us;
+
+/*------------------------------------------------------------
+Time each task fell due for the run it is waiting on
+------------------------------------------------------------*/
+static uint32_t         s_release_us[ SYSTEM_TASKS_MAX ];
+
+/*------------------------------------------------------------
+Task progress at the last watchdog reload, and the current
+deadline miss window
+------------------------------------------------------------*/
+static uint32_t         s_kick_released[ SYSTEM_TASKS_MAX ];
+static uint32_t         s_kick_runs[ SYSTEM_TASKS_MAX ];
+static uint32_t         s_window_tick;
+static uint32_t         s_window_misses;
+static uint8_t          s_clean_windows;
+#endif
 
 /*--------------------------------------------------------------------------------
                                   PROCEDURES
 --------------------------------------------------------------------------------*/
 
-static void execute_tasks
+static ramfunc void due_list_insert
+    (
+    int8_t          idx
+    );
+
+static void due_list_remove
+    (
+    int8_t          idx
+    );
+
+static uint32_t entropy_mix
+    (
+    uint32_t        x
+    );
+
+static ramfunc void execute_tasks
+    (
+    void
+    );
+
+#if( SYSTEM_HEALTH )
+static void health_reset_task
+    (
+    int8_t          idx
+    );
+
+static ramfunc uint32_t health_time_fold
     (
     void
     );
 
+static ramfunc uint32_t health_time_us
+    (
+    void
+    );
+#endif
+
+#if( SYSTEM_PROFILE )
+static void profile_reset_task
+    (
+    int8_t          idx
+    );
+
+static ramfunc void profile_update
+    (
+    volatile system_task_profile_type
+                  * profile,
+    uint32_t        cycles
+    );
+#endif
+
+static ramfunc void run_task
+    (
+    int8_t          idx
+    );
+
 
 /*************************************************************************
  *
@@ -66,13 +280,18 @@ static void execute_tasks
 void system_add_task
     (
     task_ptr_type   tsk,    /* Pointer to periodic task function        */
-    uint32_t        prd     /* Task period in milliseconds              */
+    uint32_t        prd,    /* Task period in milliseconds              */
+    uint8_t         flags   /* SYSTEM_TASK_TICK or _DEFERRED, | _IDLE   */
     )
 {
     /*--------------------------------------------------------
     Local variables
     --------------------------------------------------------*/
     uint32_t        i;      /* loop counter                 */
+    uint32_t        primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
 
     /*--------------------------------------------------------
     Register new task
@@ -80,12 +299,22 @@ void system_add_task
     for( i = 0; i < count_of_array( s_task_list ); i++ )
     {
         /*----------------------------------------------------
-        Assign to first empty slot
+        Assign to first empty slot, first due one period from
+        now.
         ----------------------------------------------------*/
         if( s_task_list[ i ].task == NULL )
         {
             s_task_list[ i ].task = tsk;
             s_task_list[ i ].period = max_val( prd, 1 );
+            s_task_list[ i ].due = s_tick + s_task_list[ i ].period;
+            s_task_list[ i ].flags = flags;
+            due_list_insert( i );
+#if( SYSTEM_HEALTH )
+            health_reset_task( i );
+#endif
+#if( SYSTEM_PROFILE )
+            profile_reset_task( i );
+#endif
             break;
         }
 
@@ -98,176 +327,1670 @@ void system_add_task
         }
     }
 
+    __set_PRIMASK( primask );
+
 }   /* system_add_task() */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      system_init
+ *      system_adc_convert
  *
  *  Description:
- *      Initializes the system structure and configures the system clock.
+ *      Run a single conversion of an ADC1 channel and return the 12-bit
+ *      result. The ADC must be running, see system_adc_start().
  *
- *  References:
+ ************************************************************************/
+uint32_t system_adc_convert
+    (
+    uint32_t        channel,    /* ADC1 input channel                   */
+    uint32_t        smp         /* Sample time selection, 0 to 7        */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    __IO uint32_t     * smpr;
+    uint32_t            shift;
+
+    /*--------------------------------------------------------
+    Channels 0 to 9 are timed by SMPR1, 10 to 18 by SMPR2
+    --------------------------------------------------------*/
+    smpr = ( channel < ADC_SMPR_CHANNELS ) ? &ADC1->SMPR1 : &ADC1->SMPR2;
+    shift = ( channel % ADC_SMPR_CHANNELS ) * ADC_SMPR_BITS;
+    *smpr = ( *smpr & ~( 7 << shift ) ) | ( ( smp & 7 ) << shift );
+    ADC1->SQR1 = channel << ADC_SQR1_SQ1_Pos;
+
+    ADC1->CR |= ADC_CR_ADSTART;
+    while( !( ADC1->ISR & ADC_ISR_EOC ) );
+
+    return( ADC1->DR );
+
+}   /* system_adc_convert() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_adc_start
  *
+ *  Description:
+ *      Power up ADC1 for system_adc_convert(), with VREFINT routed to
+ *      channel 18.
  *
  ************************************************************************/
-void system_init
+void system_adc_start
     (
     void
     )
 {
     /*--------------------------------------------------------
-    Configure flash latency to allow sufficient flash access
-    time. Flash latency must be at least 2 wait states for
-    clock speeds between 48MHz and 72 MHz.
+    Local variables
     --------------------------------------------------------*/
-    FLASH->ACR |= FLASH_ACR_LATENCY_1;
+    volatile uint32_t   wait;
 
     /*--------------------------------------------------------
-    Set PLL to operate at 16x and enable PLL. Default input to
-    PLL is HSI clock divided by 2. HSI clock is an 8MHz
-    internal RC oscillator. Resulting operating frequency
-    should therefore be 64MHz.
+    Clock the ADC synchronously from HCLK and route VREFINT
+    to channel 18
     --------------------------------------------------------*/
-    RCC->CFGR |= RCC_CFGR_PLLMUL;
-    RCC->CR   |= RCC_CR_PLLON;
+    RCC->AHBENR |= RCC_AHBENR_ADC1EN;
+    ADC1_COMMON->CCR = ( ADC1_COMMON->CCR & ~ADC1_CCR_CKMODE ) | ADC1_CCR_CKMODE_0 | ADC1_CCR_VREFEN;
 
     /*--------------------------------------------------------
-    Wait for hardware to indicate PLL is ready
+    Enable the ADC voltage regulator and wait out its startup
+    time
     --------------------------------------------------------*/
-    while( !(RCC->CR & RCC_CR_PLLRDY) );
+    ADC1->CR &= ~ADC_CR_ADVREGEN;
+    ADC1->CR |= ADC_CR_ADVREGEN_0;
+    for( wait = ADC_REGULATOR_DELAY; wait > 0; wait-- );
 
     /*--------------------------------------------------------
-    Set system clock source to PLL
+    Enable the ADC
     --------------------------------------------------------*/
-    RCC->CFGR |= RCC_CFGR_SW_PLL;
+    ADC1->ISR = ADC_ISR_ADRD;
+    ADC1->CR |= ADC_CR_ADEN;
+    while( !( ADC1->ISR & ADC_ISR_ADRD ) );
 
-    /*--------------------------------------------------------
-    Wait for hardware to indicate that the system clock source
-    is PLL.
-    --------------------------------------------------------*/
-    while( !(RCC->CFGR & RCC_CFGR_SWS_PLL) );
+}   /* system_adc_start() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_adc_stop
+ *
+ *  Description:
+ *      Power down ADC1 and gate its clock. The voltage regulator only
+ *      turns off at ADVREGEN 10, which it must reach through 00.
+ *
+ ************************************************************************/
+void system_adc_stop
+    (
+    void
+    )
+{
+    ADC1->CR |= ADC_CR_ADDIS;
+    while( ADC1->CR & ADC_CR_ADEN );
+    ADC1->CR &= ~ADC_CR_ADVREGEN;
+    ADC1->CR |= ADC_CR_ADVREGEN_1;
+    ADC1_COMMON->CCR &= ~ADC1_CCR_VREFEN;
+    RCC->AHBENR &= ~RCC_AHBENR_ADC1EN;
+
+}   /* system_adc_stop() */
 
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_event_get
+ *
+ *  Description:
+ *      Take the oldest event off the queue. Main loop only. Returns FALSE
+ *      if there is none.
+ *
+ ************************************************************************/
+boolean system_event_get
+    (
+    system_event_type
+                  * event   /* Oldest event, if any                     */
+    )
+{
     /*--------------------------------------------------------
-    Update SystemCoreClock to reflect current system clock
+    Local variables
     --------------------------------------------------------*/
-    SystemCoreClockUpdate();
+    volatile system_event_type
+                      * slot;
+    uint32_t            tail;
+
+    tail = s_event_tail;
+    slot = &s_events[ tail % SYSTEM_EVENTS_MAX ];
+    if( tail == s_event_head
+     || slot->id == SYSTEM_EVENT_NONE )
+    {
+        return( FALSE );
+    }
 
     /*--------------------------------------------------------
-    Configure SysTick to operate at SYSTICK_HZ
+    Read the event before freeing its slot
     --------------------------------------------------------*/
-    SysTick_Config( SystemCoreClock / SYSTICK_HZ );
+    __DMB();
+    event->id   = slot->id;
+    event->arg  = slot->arg;
+    event->task = slot->task;
+    slot->id = SYSTEM_EVENT_NONE;
+    __DMB();
+    s_event_tail = tail + 1;
 
-}   /* system_init() */
+    return( TRUE );
+
+}   /* system_event_get() */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      system_remove_task
+ *      system_event_pending
  *
  *  Description:
- *      Remove a periodic system task.
+ *      Check whether any event is waiting. Check with interrupts masked
+ *      before a WFI, so that an event posted in between still wakes the
+ *      core.
  *
  ************************************************************************/
-void system_remove_task
+boolean system_event_pending
     (
-    task_ptr_type   tsk     /* Pointer to periodic task function        */
+    void
+    )
+{
+    return( s_event_head != s_event_tail );
+
+}   /* system_event_pending() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_event_post
+ *
+ *  Description:
+ *      Queue an event for the main loop, from any context. Never blocks.
+ *      Returns FALSE, and drops the event, if the queue is full.
+ *
+ ************************************************************************/
+ramfunc boolean system_event_post
+    (
+    system_event_id_type
+                    id,     /* Event to post                            */
+    uint8_t         arg,    /* Event argument                           */
+    task_ptr_type   task    /* Event callback                           */
     )
 {
     /*--------------------------------------------------------
     Local variables
     --------------------------------------------------------*/
-    uint32_t    i;      /* loop counter                     */
+    volatile system_event_type
+                  * slot;
+    uint32_t        head;
 
     /*--------------------------------------------------------
-    Remove task
+    Claim the slot at the head. A post that preempts this one
+    between the exclusive pair makes the store fail, and the
+    claim is retried behind it.
     --------------------------------------------------------*/
-    for( i = 0; i < count_of_array( s_task_list ); i++ )
+    do
     {
-        /*----------------------------------------------------
-        Remove any instances of task
-        ----------------------------------------------------*/
-        if( s_task_list[ i ].task == tsk )
+        head = __LDREXW( &s_event_head );
+        if( head - s_event_tail >= SYSTEM_EVENTS_MAX )
         {
-            s_task_list[ i ].task = NULL;
-            s_task_list[ i ].period = 0;
+            __CLREX();
+#if( SYSTEM_PROFILE )
+            g_system_profile.event_drops++;
+#endif
+            return( FALSE );
         }
-    }
+    } while( __STREXW( head + 1, &s_event_head ) != 0 );
 
-}   /* system_remove_task() */
+    /*--------------------------------------------------------
+    Fill the slot, then publish it
+    --------------------------------------------------------*/
+    slot = &s_events[ head % SYSTEM_EVENTS_MAX ];
+    slot->arg  = arg;
+    slot->task = task;
+    __DMB();
+    slot->id = id;
+
+    return( TRUE );
+
+}   /* system_event_post() */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      SysTick_Handler
+ *      system_flash_spare_page
  *
  *  Description:
- *      SysTick interrupt routine.
+ *      Get the address of a page counted back from the end of flash, 0
+ *      being the last, or NULL if the firmware image reaches into it.
  *
  ************************************************************************/
-void SysTick_Handler
+const void * system_flash_spare_page
     (
-    void
+    uint32_t        index   /* Pages back from the last one             */
     )
 {
-    execute_tasks();
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        page;
 
-}   /* SysTick_Handler() */
+    page = FLASH_BASE + SYSTEM_FLASH_SIZE_KB * 1024 - ( index + 1 ) * FLASH_PAGE_BYTES;
+    if( page < IMAGE_END )
+    {
+        return( NULL );
+    }
+
+    return( (const void *)page );
+
+}   /* system_flash_spare_page() */
 
 
 /*************************************************************************
  *
  *  Procedure:
- *      execute_tasks
+ *      system_flash_write_page
  *
  *  Description:
- *      Execute periodic system task. This function runs on every SysTick.
- *      It compares the period of each task to a running counter in order
- *      to determine which tasks to execute.
+ *      Erase one flash page and program it with size bytes of data.
+ *      Execution stalls while the flash is busy, so this is only meant
+ *      for rare writes such as the pattern set store. Pages the firmware
+ *      image reaches into are refused. Returns TRUE if the page reads
+ *      back as written.
  *
  ************************************************************************/
-static void execute_tasks
+boolean system_flash_write_page
     (
-    void
+    const void    * page,   /* Page aligned flash address               */
+    const void    * data,   /* Data to program                          */
+    uint32_t        size    /* Size of data in bytes                    */
     )
 {
     /*--------------------------------------------------------
-    Local static variables
+    Local variables
     --------------------------------------------------------*/
-    static uint32_t counter = 0;    /* persistent counter   */
+    __IO uint16_t     * dst;
+    const uint8_t     * src;
+    uint32_t            i;
+
+    if( ( (uint32_t)page % FLASH_PAGE_BYTES ) != 0
+     || (uint32_t)page < IMAGE_END
+     || size > FLASH_PAGE_BYTES )
+    {
+        return( FALSE );
+    }
 
     /*--------------------------------------------------------
-    Local variables
+    Unlock the flash controller
     --------------------------------------------------------*/
-    int                 i;          /* task index           */
-    volatile task_list_type
-                      * cur_task;   /* pointer to task      */
+    if( FLASH->CR & FLASH_CR_LOCK )
+    {
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
 
     /*--------------------------------------------------------
-    Increment counter
+    Erase the page
     --------------------------------------------------------*/
-    counter++;
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = (uint32_t)page;
+    FLASH->CR |= FLASH_CR_STRT;
+    while( FLASH->SR & FLASH_SR_BSY );
+    FLASH->CR &= ~FLASH_CR_PER;
 
     /*--------------------------------------------------------
-    Execute tasks
+    Program a half word at a time, padding an odd final byte
+    with the erased value
     --------------------------------------------------------*/
-    for( i = 0; i < count_of_array( s_task_list ); i++ )
+    dst = (__IO uint16_t *)page;
+    src = (const uint8_t *)data;
+    FLASH->CR |= FLASH_CR_PG;
+    for( i = 0; i < size; i += 2 )
     {
-        cur_task = &s_task_list[ i ];
+        *dst++ = src[ i ] | ( ( i + 1 < size ) ? src[ i + 1 ] : 0xFF ) << 8;
+        while( FLASH->SR & FLASH_SR_BSY );
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    FLASH->CR |= FLASH_CR_LOCK;
 
-        /*----------------------------------------------------
-        Execute only if current task's period has elapsed.
-        ----------------------------------------------------*/
-        if( ((counter + i) % cur_task->period) == 0
-         && cur_task->task != NULL )
-        {
-            cur_task->task();
-        }
+    return( memcmp( page, data, size ) == 0 );
+
+}   /* system_flash_write_page() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_get_degrade
+ *
+ *  Description:
+ *      Get the degraded mode, 0 while every task keeps its deadlines and
+ *      up to SYSTEM_DEGRADE_MAX while they repeatedly do not. Work that
+ *      can be shed should shrink by half for every level.
+ *
+ ************************************************************************/
+uint8_t system_get_degrade
+    (
+    void
+    )
+{
+#if( SYSTEM_HEALTH )
+    return( g_system_health.degrade );
+#else
+    return( 0 );
+#endif
+
+}   /* system_get_degrade() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_get_entropy
+ *
+ *  Description:
+ *      Gather a per-device, per-boot seed value. The 96-bit unique
+ *      device ID separates jars from each other, the least significant
+ *      bits of repeated VREFINT conversions separate one boot from the
+ *      next. The ADC is powered down again before returning.
+ *
+ ************************************************************************/
+uint32_t system_get_entropy
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t            entropy;
+    uint32_t            i;
+
+    /*--------------------------------------------------------
+    Fold in the unique device ID
+    --------------------------------------------------------*/
+    entropy = 0;
+    for( i = 0; i < UID_WORD_COUNT; i++ )
+    {
+        entropy = entropy_mix( entropy ^ UID_WORDS[ i ] );
     }
 
-}   /* execute_tasks() */
+    /*--------------------------------------------------------
+    Collect the noisy low bits of VREFINT conversions. The
+    shortest sample time keeps the conversion noisy, which is
+    the point here.
+    --------------------------------------------------------*/
+    system_adc_start();
+    for( i = 0; i < ENTROPY_SAMPLES; i++ )
+    {
+        entropy = entropy_mix( entropy ^ system_adc_convert( SYSTEM_ADC_VREFINT, 0 ) );
+    }
+    system_adc_stop();
+
+    return( entropy );
+
+}   /* system_get_entropy() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_get_tick
+ *
+ *  Description:
+ *      Get the number of SysTick events since boot.
+ *
+ ************************************************************************/
+uint32_t system_get_tick
+    (
+    void
+    )
+{
+    return( s_tick );
+
+}   /* system_get_tick() */
+
+
+#if( SYSTEM_HEALTH )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_health_check
+ *
+ *  Description:
+ *      Reload the watchdog, but only if every task that fell due since
+ *      the last reload has run since, and step the degraded mode once a
+ *      window of ticks has passed. Called from the main loop, so that a
+ *      stuck interrupt starves it as well.
+ *
+ ************************************************************************/
+void system_health_check
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    volatile system_task_health_type
+                      * health;
+    uint32_t            i;
+    uint32_t            misses;
+    uint32_t            tick;
+    boolean             progress;
+
+    /*--------------------------------------------------------
+    A task that has not fallen due since the last reload is
+    just waiting, not stuck.
+    --------------------------------------------------------*/
+    progress = TRUE;
+    for( i = 0; i < count_of_array( s_task_list ); i++ )
+    {
+        health = &g_system_health.tasks[ i ];
+        if( s_task_list[ i ].task != NULL
+         && health->released != s_kick_released[ i ]
+         && health->runs == s_kick_runs[ i ] )
+        {
+            progress = FALSE;
+        }
+    }
+
+    if( progress )
+    {
+        IWDG->KR = IWDG_KEY_RELOAD;
+        for( i = 0; i < count_of_array( s_task_list ); i++ )
+        {
+            s_kick_released[ i ] = g_system_health.tasks[ i ].released;
+            s_kick_runs[ i ] = g_system_health.tasks[ i ].runs;
+        }
+    }
+
+    /*--------------------------------------------------------
+    Degrade on a window with repeated deadline misses, and
+    recover only after a run of clean ones.
+    --------------------------------------------------------*/
+    tick = s_tick;
+    if( tick - s_window_tick < SYSTEM_DEGRADE_WINDOW )
+    {
+        return;
+    }
+    misses = g_system_health.misses - s_window_misses;
+    s_window_misses += misses;
+    s_window_tick = tick;
+
+    if( misses >= SYSTEM_DEGRADE_MISSES )
+    {
+        s_clean_windows = 0;
+        if( g_system_health.degrade < SYSTEM_DEGRADE_MAX )
+        {
+            g_system_health.degrade++;
+            g_system_health.degrade_max = max_val( g_system_health.degrade_max, g_system_health.degrade );
+        }
+    }
+    else if( misses != 0 )
+    {
+        s_clean_windows = 0;
+    }
+    else if( g_system_health.degrade > 0
+          && ++s_clean_windows >= SYSTEM_RECOVER_WINDOWS )
+    {
+        s_clean_windows = 0;
+        g_system_health.degrade--;
+    }
+
+}   /* system_health_check() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_health_start
+ *
+ *  Description:
+ *      Start the independent watchdog. Once started it cannot be
+ *      stopped, so this is left until initialization, which may take
+ *      longer than the watchdog period, is complete. The watchdog is
+ *      frozen while a debugger halts the core.
+ *
+ ************************************************************************/
+void system_health_start
+    (
+    void
+    )
+{
+    DBGMCU->APB1FZ |= DBGMCU_APB1_FZ_DBG_IWDG_STOP;
+
+    IWDG->KR  = IWDG_KEY_START;
+    IWDG->KR  = IWDG_KEY_ACCESS;
+    IWDG->PR  = WATCHDOG_PRESCALER;
+    IWDG->RLR = WATCHDOG_RELOAD;
+    while( IWDG->SR != 0 );
+    IWDG->KR  = IWDG_KEY_RELOAD;
+
+}   /* system_health_start() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_init
+ *
+ *  Description:
+ *      Initializes the system structure and starts the PLL. Returns
+ *      running from HSI without waiting for the PLL to lock.
+ *
+ *  References:
+ *
+ *
+ ************************************************************************/
+void system_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Set PLL to operate at 16x and enable PLL. Default input to
+    PLL is HSI clock divided by 2. HSI clock is an 8MHz
+    internal RC oscillator. Resulting operating frequency
+    should therefore be 64MHz.
+    --------------------------------------------------------*/
+    RCC->CFGR |= RCC_CFGR_PLLMUL;
+    RCC->CR   |= RCC_CR_PLLON;
+
+    /*--------------------------------------------------------
+    Keep running from HSI rather than wait for the PLL to
+    lock, so that the rest of boot overlaps with it. The core
+    switches over, with the flash wait states it needs, on the
+    first system_set_performance( SYSTEM_PERF_FULL ).
+    --------------------------------------------------------*/
+    SystemCoreClockUpdate();
+
+    /*--------------------------------------------------------
+    Configure SysTick to operate at SYSTICK_HZ
+    --------------------------------------------------------*/
+    SysTick_Config( SystemCoreClock / SYSTICK_HZ );
+    s_perf = SYSTEM_PERF_IDLE;
+
+    /*--------------------------------------------------------
+    Tick tasks preempt deferred tasks, never the other way
+    around.
+    --------------------------------------------------------*/
+    NVIC_SetPriority( SysTick_IRQn, PRIORITY_TICK );
+    NVIC_SetPriority( PendSV_IRQn, PRIORITY_DEFERRED );
+
+#if( SYSTEM_HEALTH )
+    /*--------------------------------------------------------
+    Note a watchdog reset, then start the deadline time base.
+    TIM16 stops along with SysTick while a debugger halts the
+    core.
+    --------------------------------------------------------*/
+    if( RCC->CSR & RCC_CSR_IWDGRSTF )
+    {
+        g_system_health.watchdog_reset = TRUE;
+    }
+    RCC->CSR |= RCC_CSR_RMVF;
+
+    RCC->APB2ENR |= RCC_APB2ENR_TIM16EN;
+    DBGMCU->APB2FZ |= DBGMCU_APB2_FZ_DBG_TIM16_STOP;
+    TIM16->PSC = SystemCoreClock / TIME_HZ - 1;
+    TIM16->ARR = 0xFFFF;
+    TIM16->EGR = TIM_EGR_UG;
+    TIM16->CR1 = TIM_CR1_CEN;
+#endif
+
+#if( SYSTEM_PROFILE )
+    /*--------------------------------------------------------
+    Start the DWT cycle counter
+    --------------------------------------------------------*/
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+#if( TRACE_ENABLE )
+    /*--------------------------------------------------------
+    Start streaming trace events
+    --------------------------------------------------------*/
+    trace_init();
+#endif
+
+}   /* system_init() */
+
+
+#if( SYSTEM_PROFILE )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_profile_boot
+ *
+ *  Description:
+ *      Record the time a boot milestone is first reached, in
+ *      microseconds from the first tick. Later calls for the same
+ *      milestone are ignored.
+ *
+ ************************************************************************/
+void system_profile_boot
+    (
+    system_boot_type
+                    milestone   /* Boot milestone just reached      */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+    uint32_t        tick;
+    uint32_t        counts;
+
+    if( g_system_profile.boot_us[ milestone ] != 0 )
+    {
+        return;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    /*--------------------------------------------------------
+    A tick that wrapped but has not been counted yet belongs
+    to this reading.
+    --------------------------------------------------------*/
+    tick = s_tick;
+    counts = SysTick->LOAD - SysTick->VAL;
+    if( SCB->ICSR & SCB_ICSR_PENDSTSET_Msk )
+    {
+        tick++;
+        counts = SysTick->LOAD - SysTick->VAL;
+    }
+
+    g_system_profile.boot_us[ milestone ] = max_val( tick * ( 1000000 / SYSTICK_HZ )
+                                                   + counts / ( SystemCoreClock / 1000000 ), 1 );
+
+    __set_PRIMASK( primask );
+
+}   /* system_profile_boot() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_remove_task
+ *
+ *  Description:
+ *      Remove a periodic system task.
+ *
+ ************************************************************************/
+void system_remove_task
+    (
+    task_ptr_type   tsk     /* Pointer to periodic task function        */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    i;      /* loop counter                     */
+    uint32_t    primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    /*--------------------------------------------------------
+    Remove task
+    --------------------------------------------------------*/
+    for( i = 0; i < count_of_array( s_task_list ); i++ )
+    {
+        /*----------------------------------------------------
+        Remove any instances of task
+        ----------------------------------------------------*/
+        if( s_task_list[ i ].task == tsk )
+        {
+            due_list_remove( i );
+            s_deferred_pending &= ~( (uint32_t)1 << i );
+            s_task_list[ i ].task = NULL;
+            s_task_list[ i ].period = 0;
+        }
+    }
+
+    __set_PRIMASK( primask );
+
+}   /* system_remove_task() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_set_performance
+ *
+ *  Description:
+ *      Switch the core clock between the PLL and HSI. SystemCoreClock,
+ *      the SysTick reload and the one-shot timer follow the new clock, so
+ *      task periods and timeouts are kept. The tick in progress restarts
+ *      at the new rate, rounded to the nearest whole tick. Peripherals
+ *      clocked from the core clock outside this module have to be
+ *      rescaled by their owners. Returns TRUE if the clock changed.
+ *
+ ************************************************************************/
+boolean system_set_performance
+    (
+    system_perf_type
+                    perf    /* Performance state to run in              */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+    uint32_t        load;
+    uint32_t        elapsed;
+    int32_t         remaining;
+    task_ptr_type   tsk;
+
+    if( perf == s_perf )
+    {
+        return( FALSE );
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    load = SysTick->LOAD;
+    elapsed = load - SysTick->VAL;
+#if( SYSTEM_HEALTH )
+    health_time_fold();
+#endif
+
+    if( perf == SYSTEM_PERF_FULL )
+    {
+        /*----------------------------------------------------
+        Add wait states before speeding up. The PLL keeps
+        its multiplier from system_init().
+        ----------------------------------------------------*/
+        FLASH->ACR = ( FLASH->ACR & ~FLASH_ACR_LATENCY ) | FLASH_ACR_LATENCY_1;
+        RCC->CR |= RCC_CR_PLLON;
+        while( !( RCC->CR & RCC_CR_PLLRDY ) );
+        RCC->CFGR = ( RCC->CFGR & ~RCC_CFGR_SW ) | RCC_CFGR_SW_PLL;
+        while( ( RCC->CFGR & RCC_CFGR_SWS ) != RCC_CFGR_SWS_PLL );
+    }
+    else
+    {
+        /*----------------------------------------------------
+        Remove wait states only once slowed down, and stop
+        the PLL while it is not needed.
+        ----------------------------------------------------*/
+        RCC->CFGR = ( RCC->CFGR & ~RCC_CFGR_SW ) | RCC_CFGR_SW_HSI;
+        while( ( RCC->CFGR & RCC_CFGR_SWS ) != RCC_CFGR_SWS_HSI );
+        RCC->CR &= ~RCC_CR_PLLON;
+        FLASH->ACR &= ~FLASH_ACR_LATENCY;
+    }
+
+    SystemCoreClockUpdate();
+    s_perf = perf;
+
+#if( TRACE_ENABLE )
+    TPI->ACPR = SystemCoreClock / TRACE_SWO_HZ - 1;
+#endif
+
+#if( SYSTEM_HEALTH )
+    /*--------------------------------------------------------
+    Restart the time base at the new rate from where it was
+    before the switch.
+    --------------------------------------------------------*/
+    TIM16->PSC = SystemCoreClock / TIME_HZ - 1;
+    TIM16->EGR = TIM_EGR_UG;
+    s_time_cnt = 0;
+    s_tick_us  = s_time_us;
+#endif
+
+    /*--------------------------------------------------------
+    Restart the tick at the new rate. A tick more than half
+    elapsed is counted now rather than dropped.
+    --------------------------------------------------------*/
+    SysTick->LOAD = SystemCoreClock / SYSTICK_HZ - 1;
+    SysTick->VAL  = 0;
+    if( elapsed > load / 2 )
+    {
+        SCB->ICSR = SCB_ICSR_PENDSTSET_Msk;
+    }
+
+    /*--------------------------------------------------------
+    Rearm an armed one-shot timer on the new clock for the
+    rest of its delay.
+    --------------------------------------------------------*/
+    tsk = s_timer_callback;
+    if( tsk != NULL )
+    {
+        remaining = (int32_t)( s_timer_deadline - s_tick );
+        system_timer_start( tsk, max_val( remaining, 1 ) );
+    }
+
+    __set_PRIMASK( primask );
+
+    return( TRUE );
+
+}   /* system_set_performance() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_sleep
+ *
+ *  Description:
+ *      Suppress SysTick and sleep until either the given number of ticks
+ *      has elapsed or another interrupt wakes the core. The tick counter
+ *      is advanced by the time actually slept, and the next tick comes
+ *      early by any part of a tick slept past the last whole one. Tasks
+ *      are not executed while sleeping, and resume on the first tick
+ *      after waking.
+ *
+ ************************************************************************/
+void system_sleep
+    (
+    uint32_t        ticks   /* Maximum number of ticks to sleep         */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+    uint32_t        counts_per_tick;
+    uint32_t        load;
+    uint32_t        counted;
+    uint32_t        elapsed;
+    uint32_t        partial;
+
+    if( ticks == 0 )
+    {
+        return;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    /*--------------------------------------------------------
+    Let a tick that is already pending run first.
+    --------------------------------------------------------*/
+    if( SCB->ICSR & SCB_ICSR_PENDSTSET_Msk )
+    {
+        __set_PRIMASK( primask );
+        return;
+    }
+
+    /*--------------------------------------------------------
+    Reprogram SysTick for a single long period.
+    --------------------------------------------------------*/
+    counts_per_tick = SLEEP_COUNTS_PER_TICK;
+    ticks = min_val( ticks, SLEEP_TICKS_MAX );
+#if( SYSTEM_HEALTH )
+    ticks = min_val( ticks, WATCHDOG_SLEEP_TICKS );
+    health_time_fold();
+#endif
+    load = ticks * counts_per_tick - 1;
+
+    SysTick->CTRL = 0;
+    SysTick->LOAD = load;
+    SysTick->VAL  = 0;
+    SysTick->CTRL = SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    /*--------------------------------------------------------
+    Sleep. With interrupts masked, any pending interrupt still
+    wakes the core, but is only serviced once the tick counter
+    has been corrected below.
+    --------------------------------------------------------*/
+    __DSB();
+    __WFI();
+
+    /*--------------------------------------------------------
+    Account for the time slept. A wrapped counter means the
+    full period elapsed and its SysTick must not also count
+    as a regular tick. Otherwise another interrupt woke the
+    core part way into a tick, which is carried over rather
+    than dropped, as a wake every tick would stop the clock.
+    --------------------------------------------------------*/
+    if( SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk )
+    {
+        elapsed = ticks;
+        partial = 0;
+        SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    }
+    else
+    {
+        counted = load - SysTick->VAL;
+        elapsed = counted / counts_per_tick;
+        partial = counted % counts_per_tick;
+    }
+    s_tick += elapsed;
+
+    /*--------------------------------------------------------
+    Restore the regular tick, its first period short by the
+    part already slept. Writing the reload value only takes
+    effect at the next wrap, once the short period has been
+    loaded. TIM16 may have wrapped while asleep, so the time
+    base follows the tick instead.
+    --------------------------------------------------------*/
+    SysTick->CTRL = 0;
+    SysTick->LOAD = ( counts_per_tick - partial ) * SLEEP_CLOCK_DIVIDER - 1;
+    SysTick->VAL  = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+    while( SysTick->VAL == 0 );
+    SysTick->LOAD = SystemCoreClock / SYSTICK_HZ - 1;
+#if( SYSTEM_HEALTH )
+    s_tick_us  = s_time_us + elapsed * TICK_US;
+    s_time_us  = s_tick_us + ( partial * TICK_US ) / counts_per_tick;
+    s_time_cnt = TIM16->CNT;
+#endif
+
+    __set_PRIMASK( primask );
+
+}   /* system_sleep() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_ticks_to_next_task
+ *
+ *  Description:
+ *      Get the number of ticks until the next task other than an idle
+ *      one is due, or SYSTEM_TICKS_FOREVER if there is none.
+ *
+ ************************************************************************/
+uint32_t system_ticks_to_next_task
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    primask;
+    uint32_t    ticks;
+    int32_t     remaining;
+    int8_t      idx;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    ticks = SYSTEM_TICKS_FOREVER;
+    idx = s_due_head;
+    while( idx != TASK_NONE
+        && ( s_task_list[ idx ].flags & SYSTEM_TASK_IDLE ) )
+    {
+        idx = s_task_list[ idx ].next;
+    }
+    if( idx != TASK_NONE )
+    {
+        remaining = (int32_t)( s_task_list[ idx ].due - s_tick );
+        ticks = max_val( remaining, 0 );
+    }
+
+    __set_PRIMASK( primask );
+
+    return( ticks );
+
+}   /* system_ticks_to_next_task() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_timer_start
+ *
+ *  Description:
+ *      Arm the one-shot timer to call a function once after a delay. On
+ *      expiry the function is posted as a SYSTEM_EVENT_TIMER event, for
+ *      the main loop to call. Arming an armed timer restarts it with the
+ *      new delay and callback, but does not recall an expiry already
+ *      posted. The timer keeps counting through a tickless sleep, and
+ *      costs nothing per tick while it runs.
+ *
+ ************************************************************************/
+void system_timer_start
+    (
+    task_ptr_type   tsk,    /* Function to call when the timer expires  */
+    uint32_t        ms      /* Delay in milliseconds                    */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+    uint32_t        repeat;
+    uint32_t        period;
+
+    /*--------------------------------------------------------
+    Split the delay into period x repeat count. Rounding the
+    period up makes the delay at most repeat - 1 ms long.
+    --------------------------------------------------------*/
+    ms = limit_val( ms, 1, TIMER_MS_MAX );
+    repeat = ( ( ms - 1 ) / TIMER_PERIOD_MAX ) + 1;
+    period = ( ms + repeat - 1 ) / repeat;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    /*--------------------------------------------------------
+    Stop the timer and load the new delay. URS keeps the
+    forced update from raising an interrupt.
+    --------------------------------------------------------*/
+    RCC->APB2ENR |= RCC_APB2ENR_TIM15EN;
+    TIM15->CR1  = 0;
+    TIM15->PSC  = SystemCoreClock / TIMER_HZ - 1;
+    TIM15->ARR  = period - 1;
+    TIM15->RCR  = repeat - 1;
+    TIM15->CNT  = 0;
+    TIM15->CR1  = TIM_CR1_OPM | TIM_CR1_URS;
+    TIM15->EGR  = TIM_EGR_UG;
+    TIM15->SR   = 0;
+    TIM15->DIER = TIM_DIER_UIE;
+    NVIC_ClearPendingIRQ( TIM15_IRQn );
+    NVIC_EnableIRQ( TIM15_IRQn );
+
+    /*--------------------------------------------------------
+    Go. One pulse mode stops the counter once the repetition
+    counter runs out.
+    --------------------------------------------------------*/
+    s_timer_callback = tsk;
+    s_timer_deadline = s_tick + ms;
+    TIM15->CR1 |= TIM_CR1_CEN;
+
+    __set_PRIMASK( primask );
+
+}   /* system_timer_start() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      system_timer_stop
+ *
+ *  Description:
+ *      Cancel the one-shot timer, if armed.
+ *
+ ************************************************************************/
+void system_timer_stop
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    if( s_timer_callback != NULL )
+    {
+        TIM15->CR1 = 0;
+        TIM15->SR = 0;
+        NVIC_ClearPendingIRQ( TIM15_IRQn );
+        s_timer_callback = NULL;
+    }
+
+    __set_PRIMASK( primask );
+
+}   /* system_timer_stop() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      PendSV_Handler
+ *
+ *  Description:
+ *      Run every deferred task flagged by SysTick, in task slot order.
+ *      Tasks flagged again while this runs are picked up before
+ *      returning. A deferred task that is still waiting when it falls due
+ *      again runs only once.
+ *
+ ************************************************************************/
+ramfunc void PendSV_Handler
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        pending;
+    int8_t          idx;
+
+    while( 1 )
+    {
+        __disable_irq();
+        pending = s_deferred_pending;
+        s_deferred_pending = 0;
+        __enable_irq();
+
+        if( pending == 0 )
+        {
+            break;
+        }
+
+        for( idx = 0; pending != 0; idx++, pending >>= 1 )
+        {
+            if( pending & 1 )
+            {
+                run_task( idx );
+            }
+        }
+    }
+
+}   /* PendSV_Handler() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      SysTick_Handler
+ *
+ *  Description:
+ *      SysTick interrupt routine.
+ *
+ ************************************************************************/
+ramfunc void SysTick_Handler
+    (
+    void
+    )
+{
+#if( SYSTEM_PROFILE )
+    /*--------------------------------------------------------
+    Local static variables
+    --------------------------------------------------------*/
+    static uint32_t last_entry;
+#endif
+
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+#if( SYSTEM_PROFILE )
+    uint32_t        entry;
+    uint32_t        cycles;
+#endif
+#if( SYSTEM_HEALTH )
+    uint32_t        now;
+    uint32_t        lost;
+#endif
+
+#if( SYSTEM_PROFILE )
+    entry = DWT->CYCCNT;
+    if( g_system_profile.isr_count )
+    {
+        g_system_profile.elapsed_cycles += entry - last_entry;
+    }
+    last_entry = entry;
+#endif
+
+#if( SYSTEM_HEALTH )
+    /*--------------------------------------------------------
+    Count back in the ticks that merged into this one. Every
+    handler runs after its own reload, so whole periods since
+    the last handler beyond the first were lost.
+    --------------------------------------------------------*/
+    now = health_time_fold();
+    lost = ( now - s_tick_us ) / TICK_US;
+    s_tick_us = now;
+    if( lost > 1 )
+    {
+        s_tick += lost - 1;
+        g_system_health.lost_ticks += lost - 1;
+    }
+#endif
+
+    execute_tasks();
+
+#if( SYSTEM_PROFILE )
+    cycles = DWT->CYCCNT - entry;
+    g_system_profile.isr_count++;
+    g_system_profile.isr_cycles_total += cycles;
+    g_system_profile.isr_cycles_max = max_val( g_system_profile.isr_cycles_max, cycles );
+#endif
+
+}   /* SysTick_Handler() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      TIM1_BRK_TIM15_IRQHandler
+ *
+ *  Description:
+ *      One-shot timer expiry. The callback is cleared before it is
+ *      posted, so it may rearm the timer.
+ *
+ ************************************************************************/
+void TIM1_BRK_TIM15_IRQHandler
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    task_ptr_type   tsk;
+
+    if( !( TIM15->SR & TIM_SR_UIF ) )
+    {
+        return;
+    }
+    TIM15->SR = 0;
+
+    /*--------------------------------------------------------
+    Hand the callback to the main loop. Should the queue be
+    full, run it here rather than lose it.
+    --------------------------------------------------------*/
+    tsk = s_timer_callback;
+    s_timer_callback = NULL;
+    if( tsk != NULL
+     && !system_event_post( SYSTEM_EVENT_TIMER, 0, tsk ) )
+    {
+        tsk();
+    }
+
+}   /* TIM1_BRK_TIM15_IRQHandler() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      due_list_insert
+ *
+ *  Description:
+ *      Link a task into the due list behind all tasks due no later than
+ *      it, so tasks due on the same tick run in registration order.
+ *
+ ************************************************************************/
+static ramfunc void due_list_insert
+    (
+    int8_t          idx
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    int8_t        * link;
+    uint32_t        due;
+
+    due = s_task_list[ idx ].due;
+    link = &s_due_head;
+    while( *link != TASK_NONE
+        && (int32_t)( s_task_list[ *link ].due - due ) <= 0 )
+    {
+        link = &s_task_list[ *link ].next;
+    }
+
+    s_task_list[ idx ].next = *link;
+    *link = idx;
+
+}   /* due_list_insert() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      due_list_remove
+ *
+ *  Description:
+ *      Unlink a task from the due list, if present.
+ *
+ ************************************************************************/
+static void due_list_remove
+    (
+    int8_t          idx
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    int8_t        * link;
+
+    for( link = &s_due_head; *link != TASK_NONE; link = &s_task_list[ *link ].next )
+    {
+        if( *link == idx )
+        {
+            *link = s_task_list[ idx ].next;
+            break;
+        }
+    }
+
+}   /* due_list_remove() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      entropy_mix
+ *
+ *  Description:
+ *      32-bit integer finalizer, spreads every input bit across the
+ *      whole word so that a few noisy ADC bits move the entire seed.
+ *
+ ************************************************************************/
+static uint32_t entropy_mix
+    (
+    uint32_t        x
+    )
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+
+    return( x );
+
+}   /* entropy_mix() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      execute_tasks
+ *
+ *  Description:
+ *      Execute periodic system task. This function runs on every SysTick.
+ *      Only tasks at the head of the due list whose due tick has been
+ *      reached are visited. Each is rescheduled one period later before
+ *      it runs, so a task may safely remove itself. Deferred tasks are
+ *      flagged for PendSV instead of run.
+ *
+ ************************************************************************/
+static ramfunc void execute_tasks
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    int8_t              idx;        /* task index           */
+    task_list_type    * cur_task;   /* pointer to task      */
+    uint32_t            tick;
+
+    /*--------------------------------------------------------
+    Increment counter
+    --------------------------------------------------------*/
+    tick = ++s_tick;
+
+    /*--------------------------------------------------------
+    Execute due tasks
+    --------------------------------------------------------*/
+    while( s_due_head != TASK_NONE
+        && (int32_t)( tick - s_task_list[ s_due_head ].due ) >= 0 )
+    {
+        idx = s_due_head;
+        cur_task = &s_task_list[ idx ];
+        s_due_head = cur_task->next;
+
+#if( SYSTEM_HEALTH )
+        /*----------------------------------------------------
+        Note when the task fell due. A deferred task still
+        waiting on an earlier release keeps the earlier time.
+        ----------------------------------------------------*/
+        g_system_health.tasks[ idx ].released++;
+        if( !( s_deferred_pending & ( (uint32_t)1 << idx ) ) )
+        {
+            s_release_us[ idx ] = s_tick_us - ( tick - cur_task->due ) * TICK_US;
+        }
+#endif
+
+        /*----------------------------------------------------
+        Reschedule, without bursting to catch up if the task
+        has fallen more than a period behind.
+        ----------------------------------------------------*/
+        cur_task->due += cur_task->period;
+        if( (int32_t)( cur_task->due - tick ) <= 0 )
+        {
+            cur_task->due = tick + cur_task->period;
+        }
+        due_list_insert( idx );
+
+        /*----------------------------------------------------
+        Hand deferred tasks to PendSV
+        ----------------------------------------------------*/
+        if( cur_task->flags & SYSTEM_TASK_DEFERRED )
+        {
+            s_deferred_pending |= (uint32_t)1 << idx;
+            SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+        }
+        else
+        {
+            run_task( idx );
+        }
+    }
+
+}   /* execute_tasks() */
+
+
+#if( SYSTEM_HEALTH )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      health_reset_task
+ *
+ *  Description:
+ *      Clear the deadline record of a newly registered task slot.
+ *
+ ************************************************************************/
+static void health_reset_task
+    (
+    int8_t          idx
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    volatile system_task_health_type
+                  * health;
+
+    health = &g_system_health.tasks[ idx ];
+    health->released = 0;
+    health->runs = 0;
+    health->late = 0;
+    health->lateness_max_us = 0;
+    s_kick_released[ idx ] = 0;
+    s_kick_runs[ idx ] = 0;
+
+}   /* health_reset_task() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      health_time_fold
+ *
+ *  Description:
+ *      Fold the TIM16 count into the 32-bit time base and return the
+ *      time in microseconds. Called at least once per TIM16 wrap, from
+ *      SysTick or with interrupts masked.
+ *
+ ************************************************************************/
+static ramfunc uint32_t health_time_fold
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint16_t        cnt;
+
+    cnt = TIM16->CNT;
+    s_time_us += (uint16_t)( cnt - s_time_cnt );
+    s_time_cnt = cnt;
+
+    return( s_time_us );
+
+}   /* health_time_fold() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      health_time_us
+ *
+ *  Description:
+ *      Get the time in microseconds, from any priority.
+ *
+ ************************************************************************/
+static ramfunc uint32_t health_time_us
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t        primask;
+    uint32_t        now;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    now = s_time_us + (uint16_t)( TIM16->CNT - s_time_cnt );
+    __set_PRIMASK( primask );
+
+    return( now );
+
+}   /* health_time_us() */
+#endif
+
+
+#if( SYSTEM_PROFILE )
+/*************************************************************************
+ *
+ *  Procedure:
+ *      profile_reset_task
+ *
+ *  Description:
+ *      Clear the profile of a newly registered task slot.
+ *
+ ************************************************************************/
+static void profile_reset_task
+    (
+    int8_t          idx
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    volatile system_task_profile_type
+                  * profile;
+
+    profile = &g_system_profile.tasks[ idx ];
+    profile->task = s_task_list[ idx ].task;
+    profile->count = 0;
+    profile->cycles_min = 0xFFFFFFFF;
+    profile->cycles_max = 0;
+    profile->cycles_total = 0;
+
+}   /* profile_reset_task() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      profile_update
+ *
+ *  Description:
+ *      Add one measured call to a task profile.
+ *
+ ************************************************************************/
+static ramfunc void profile_update
+    (
+    volatile system_task_profile_type
+                  * profile,
+    uint32_t        cycles
+    )
+{
+    profile->count++;
+    profile->cycles_total += cycles;
+    profile->cycles_min = min_val( profile->cycles_min, cycles );
+    profile->cycles_max = max_val( profile->cycles_max, cycles );
+
+}   /* profile_update() */
+#endif
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      run_task
+ *
+ *  Description:
+ *      Run one task, traced, profiled and checked against its deadline.
+ *      The slot may have been emptied since the task was flagged.
+ *
+ ************************************************************************/
+static ramfunc void run_task
+    (
+    int8_t          idx
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    task_ptr_type       task;
+#if( SYSTEM_PROFILE )
+    uint32_t            start;      /* task entry cycle     */
+#endif
+#if( SYSTEM_HEALTH )
+    volatile system_task_health_type
+                      * health;
+    uint32_t            release;    /* time the task fell due */
+    uint32_t            deadline;
+    uint32_t            lateness;
+#endif
+
+    task = s_task_list[ idx ].task;
+    if( task == NULL )
+    {
+        return;
+    }
+
+#if( SYSTEM_HEALTH )
+    health = &g_system_health.tasks[ idx ];
+    release = s_release_us[ idx ];
+    deadline = s_task_list[ idx ].period * TICK_US;
+    lateness = health_time_us() - release;
+    health->lateness_max_us = max_val( health->lateness_max_us, lateness );
+#endif
+
+    trace_task_entry( idx );
+#if( SYSTEM_PROFILE )
+    start = DWT->CYCCNT;
+    task();
+    profile_update( &g_system_profile.tasks[ idx ], DWT->CYCCNT - start );
+#else
+    task();
+#endif
+    trace_task_exit( idx );
+
+#if( SYSTEM_HEALTH )
+    /*--------------------------------------------------------
+    A run that ends past the next release has missed its
+    deadline. The period is taken before the run, as the task
+    may remove itself.
+    --------------------------------------------------------*/
+    health->runs++;
+    if( health_time_us() - release > deadline )
+    {
+        health->late++;
+        g_system_health.misses++;
+    }
+#endif
 
+}   /* run_task() */
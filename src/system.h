@@ -22,8 +22,89 @@
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
 
-#define SYSTEM_TASKS_MAX    ( 10 )      /* Maximum number of system tasks       */
-#define SYSTICK_HZ          ( 1000 )    /* Number of systick events per second  */
+#define SYSTEM_TASKS_MAX        ( 10 )          /* Maximum number of system tasks       */
+#define SYSTICK_HZ              ( 1000 )        /* Number of systick events per second  */
+#define SYSTEM_TICKS_FOREVER    ( 0xFFFFFFFF )  /* No system task is scheduled          */
+
+/*------------------------------------------------------------
+Event queue depth, a power of two. Interrupts post events for
+the main loop to handle between WFIs.
+------------------------------------------------------------*/
+#define SYSTEM_EVENTS_MAX       ( 16 )
+
+/*------------------------------------------------------------
+Task flags. Tick tasks run inside SysTick, for timing that
+must not slip. Deferred tasks are only flagged by SysTick and
+run from PendSV at the lowest interrupt priority, so however
+long they take, they never delay a tick task. Idle tasks have
+nothing to do while the jar is dark, so a dark sleep may run
+past them, see system_ticks_to_next_task().
+------------------------------------------------------------*/
+#define SYSTEM_TASK_TICK        ( 0x00 )
+#define SYSTEM_TASK_DEFERRED    ( 0x01 )
+#define SYSTEM_TASK_IDLE        ( 0x02 )
+
+/*------------------------------------------------------------
+ADC1 channel of the internal reference, and its factory
+reading at SYSTEM_VREFINT_CAL_MV
+------------------------------------------------------------*/
+#define SYSTEM_ADC_VREFINT      ( 18 )
+#define SYSTEM_VREFINT_CAL      ( *(const uint16_t *)0x1FFFF7BA )
+#define SYSTEM_VREFINT_CAL_MV   ( 3300 )
+
+/*------------------------------------------------------------
+Flash is erased a page at a time and programmed a half word
+at a time. The F301 comes with 32 or 64 KB, its size in KB
+read from the factory data, so pages kept for records are
+counted back from the end of whichever part it runs on, see
+system_flash_spare_page().
+------------------------------------------------------------*/
+#define FLASH_PAGE_BYTES        ( 0x800 )
+#define SYSTEM_FLASH_SIZE_KB    ( *(const uint16_t *)0x1FFFF7CC )
+
+/*------------------------------------------------------------
+Set SYSTEM_PROFILE to 1 to measure every task dispatched by
+SysTick with the DWT cycle counter. Results are collected in
+g_system_profile for inspection from a debugger.
+------------------------------------------------------------*/
+#ifndef SYSTEM_PROFILE
+#define SYSTEM_PROFILE          ( 0 )
+#endif
+
+/*------------------------------------------------------------
+Set SYSTEM_HEALTH to 0 to drop deadline monitoring, the
+watchdog and degraded mode. Task releases and runs are timed
+against TIM16, free running at 1 MHz, so overruns are caught
+even when they merge SysTicks. Results are collected in
+g_system_health, which is meant to be kept in field builds.
+------------------------------------------------------------*/
+#ifndef SYSTEM_HEALTH
+#define SYSTEM_HEALTH           ( 1 )
+#endif
+
+/*------------------------------------------------------------
+The watchdog resets the jar once a task that fell due has not
+run for SYSTEM_WATCHDOG_MS. Repeated deadline misses step the
+degraded mode down a level per window of SYSTEM_DEGRADE_WINDOW
+ticks, clean windows step it back up.
+------------------------------------------------------------*/
+#define SYSTEM_WATCHDOG_MS      ( 2000 )        /* Reset once progress stops this long  */
+#define SYSTEM_DEGRADE_MAX      ( 3 )           /* Deepest degraded mode                */
+#define SYSTEM_DEGRADE_WINDOW   ( 1000 )        /* Ticks per deadline miss count        */
+#define SYSTEM_DEGRADE_MISSES   ( 4 )           /* Misses in a window to degrade        */
+#define SYSTEM_RECOVER_WINDOWS  ( 10 )          /* Clean windows to recover a level     */
+
+/*------------------------------------------------------------
+Set SYSTEM_RAMFUNC to 1 to run the tick hot path from SRAM.
+Only do so with a linker script that has the .ramfunc output
+section from startup_stm32f301x8.s, and room for it next to
+.bss. Without it the code stays in flash, but loses inlining
+and pays a long call on every hot helper. Host builds never
+relocate code.
+------------------------------------------------------------*/
+#ifndef SYSTEM_RAMFUNC
+#define SYSTEM_RAMFUNC          ( 0 )
+#endif
 
 
 /*--------------------------------------------------------------------------------
@@ -37,6 +118,34 @@
 #define max_val( val1, val2 )       ( (val1) > (val2) ? (val1) : (val2) )
 #define limit_val( val, min, max)   ( min_val( max_val( val, min ), max ) )
 
+/*------------------------------------------------------------
+Build time check, fails to compile with a negative array size
+when cond is false. name must be unique within the file.
+------------------------------------------------------------*/
+#define compile_assert( cond, name )    typedef char compile_assert_##name[ ( cond ) ? 1 : -1 ]
+
+/*------------------------------------------------------------
+SRAM placement for the tick hot path, which then fetches
+without flash wait states. ramfunc code is copied to SRAM by
+Reset_Handler, and must be marked on the prototype as well so
+that callers in flash reach it with a long call.
+------------------------------------------------------------*/
+#if( defined( __arm__ ) && SYSTEM_RAMFUNC )
+#define ramfunc                     __attribute__(( section( ".ramfunc" ), noinline, long_call ))
+#else
+#define ramfunc
+#endif
+
+
+/*------------------------------------------------------------
+Boot milestones are only timed while profiling
+------------------------------------------------------------*/
+#if( SYSTEM_PROFILE )
+#define system_boot_mark( m )       system_profile_boot( m )
+#else
+#define system_boot_mark( m )       ( (void)0 )
+#endif
+
 
 /*--------------------------------------------------------------------------------
                                       TYPES
@@ -47,6 +156,118 @@ Task Function Pointer
 ------------------------------------------------------------*/
 typedef void (*task_ptr_type)( void );
 
+/*------------------------------------------------------------
+Event IDs
+------------------------------------------------------------*/
+typedef uint8_t system_event_id_type;
+enum
+{
+    SYSTEM_EVENT_NONE,              /* Slot posted but not yet written  */
+    SYSTEM_EVENT_TOUCH,             /* Debounced touch edge             */
+    SYSTEM_EVENT_TIMER,             /* One-shot timer expired           */
+    SYSTEM_EVENT_FRAME,             /* LED frame committed, if traced   */
+    SYSTEM_EVENT_SHUTDOWN,          /* Supply too low to run on         */
+    SYSTEM_EVENT_DOUBLE_TAP,        /* Touch pressed twice in a row     */
+};
+
+/*------------------------------------------------------------
+Event. Timer events carry the callback to run as task.
+------------------------------------------------------------*/
+typedef struct
+{
+    system_event_id_type
+                    id;
+    uint8_t         arg;            /* Event argument, 0 if unused  */
+    task_ptr_type   task;           /* Callback, NULL if unused     */
+}system_event_type;
+
+/*------------------------------------------------------------
+Task execution profile, in core clock cycles. The mean is
+cycles_total / count, left to the reader to keep 64-bit
+divides out of the ISR.
+------------------------------------------------------------*/
+typedef struct
+{
+    task_ptr_type   task;           /* Task the slot belongs to     */
+    uint32_t        count;          /* Number of measured calls     */
+    uint32_t        cycles_min;     /* Shortest call                */
+    uint32_t        cycles_max;     /* Longest call                 */
+    uint64_t        cycles_total;   /* Sum of all calls             */
+}system_task_profile_type;
+
+/*------------------------------------------------------------
+Boot milestones, in the order they are reached
+------------------------------------------------------------*/
+typedef enum
+{
+    SYSTEM_BOOT_LEDS,               /* LED drivers running on HSI   */
+    SYSTEM_BOOT_PLL,                /* Core running from the PLL    */
+    SYSTEM_BOOT_READY,              /* Initialization complete      */
+    SYSTEM_BOOT_FIRST_FLASH,        /* First firefly flash starts   */
+
+    SYSTEM_BOOT_COUNT
+} system_boot_type;
+
+/*------------------------------------------------------------
+System profile. ISR occupancy is isr_cycles_total divided by
+elapsed_cycles. Boot milestones are in microseconds from the
+first tick, about where system_init() returns, and read 0
+until reached.
+------------------------------------------------------------*/
+typedef struct
+{
+    system_task_profile_type
+                    tasks[ SYSTEM_TASKS_MAX ];
+    uint32_t        boot_us[ SYSTEM_BOOT_COUNT ];
+                                    /* Time each milestone reached  */
+    uint32_t        event_drops;    /* Events lost to a full queue  */
+    uint32_t        isr_count;      /* Number of SysTick handlers   */
+    uint32_t        isr_cycles_max; /* Longest SysTick handler      */
+    uint64_t        isr_cycles_total;
+                                    /* Cycles spent in SysTick      */
+    uint64_t        elapsed_cycles; /* Cycles since profiling began */
+}system_profile_type;
+
+/*------------------------------------------------------------
+Task deadline record. A run misses its deadline when it
+finishes later than one period after the task fell due.
+Lateness is measured from the tick the task fell due to the
+start of the run.
+------------------------------------------------------------*/
+typedef struct
+{
+    uint32_t        released;       /* Times the task fell due      */
+    uint32_t        runs;           /* Times the task ran           */
+    uint32_t        late;           /* Runs that missed a deadline  */
+    uint32_t        lateness_max_us;/* Latest start of a run        */
+}system_task_health_type;
+
+/*------------------------------------------------------------
+System health. Lost ticks are SysTicks that merged while the
+handler or a higher priority interrupt overran, and are added
+back to the tick counter.
+------------------------------------------------------------*/
+typedef struct
+{
+    system_task_health_type
+                    tasks[ SYSTEM_TASKS_MAX ];
+    uint32_t        misses;         /* Deadline misses of all tasks */
+    uint32_t        lost_ticks;     /* SysTicks merged by overruns  */
+    uint8_t         degrade;        /* Degraded mode, 0 for none    */
+    uint8_t         degrade_max;    /* Deepest mode since boot      */
+    uint8_t         watchdog_reset; /* TRUE after a watchdog reset  */
+}system_health_type;
+
+/*------------------------------------------------------------
+Performance states. Full speed runs the core from the PLL at
+64 MHz, idle runs it straight from the 8 MHz HSI.
+------------------------------------------------------------*/
+typedef enum
+{
+    SYSTEM_PERF_IDLE,
+    SYSTEM_PERF_FULL
+} system_perf_type;
+
 /*------------------------------------------------------------
 Boolean type
 ------------------------------------------------------------*/
@@ -62,6 +283,14 @@ enum
                                 GLOBAL VARIABLES
 --------------------------------------------------------------------------------*/
 
+#if( SYSTEM_HEALTH )
+extern volatile system_health_type g_system_health;
+#endif
+
+#if( SYSTEM_PROFILE )
+extern volatile system_profile_type g_system_profile;
+#endif
+
 /*--------------------------------------------------------------------------------
                                    PROCEDURES
 --------------------------------------------------------------------------------*/
@@ -69,18 +298,128 @@ enum
 void system_add_task
     (
     task_ptr_type   tsk,    /* Pointer to periodic task function        */
-    uint32_t        prd     /* Task period in milliseconds              */
+    uint32_t        prd,    /* Task period in milliseconds              */
+    uint8_t         flags   /* SYSTEM_TASK_TICK or _DEFERRED, | _IDLE   */
+    );
+
+uint32_t system_adc_convert
+    (
+    uint32_t        channel,    /* ADC1 input channel                   */
+    uint32_t        smp         /* Sample time selection, 0 to 7        */
+    );
+
+void system_adc_start
+    (
+    void
     );
 
+void system_adc_stop
+    (
+    void
+    );
+
+boolean system_event_get
+    (
+    system_event_type
+                  * event   /* Oldest event, if any                     */
+    );
+
+boolean system_event_pending
+    (
+    void
+    );
+
+ramfunc boolean system_event_post
+    (
+    system_event_id_type
+                    id,     /* Event to post                            */
+    uint8_t         arg,    /* Event argument                           */
+    task_ptr_type   task    /* Event callback                           */
+    );
+
+const void * system_flash_spare_page
+    (
+    uint32_t        index   /* Pages back from the last one             */
+    );
+
+boolean system_flash_write_page
+    (
+    const void    * page,   /* Page aligned flash address               */
+    const void    * data,   /* Data to program                          */
+    uint32_t        size    /* Size of data in bytes                    */
+    );
+
+uint8_t system_get_degrade
+    (
+    void
+    );
+
+uint32_t system_get_entropy
+    (
+    void
+    );
+
+uint32_t system_get_tick
+    (
+    void
+    );
+
+#if( SYSTEM_HEALTH )
+void system_health_check
+    (
+    void
+    );
+
+void system_health_start
+    (
+    void
+    );
+#endif
+
 void system_init
     (
     void
     );
 
+#if( SYSTEM_PROFILE )
+void system_profile_boot
+    (
+    system_boot_type
+                    milestone   /* Boot milestone just reached      */
+    );
+#endif
+
 void system_remove_task
     (
     task_ptr_type   tsk     /* Pointer to periodic task function        */
     );
 
+boolean system_set_performance
+    (
+    system_perf_type
+                    perf    /* Performance state to run in              */
+    );
+
+void system_sleep
+    (
+    uint32_t        ticks   /* Maximum number of ticks to sleep         */
+    );
+
+uint32_t system_ticks_to_next_task
+    (
+    void
+    );
+
+void system_timer_start
+    (
+    task_ptr_type   tsk,    /* Function to call when the timer expires  */
+    uint32_t        ms      /* Delay in milliseconds                    */
+    );
+
+void system_timer_stop
+    (
+    void
+    );
+
 
 #endif /* SYSTEM_H_ */
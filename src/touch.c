@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stm32f3xx.h>
 
+#include "system.h"
 #include "touch.h"
 #include "gpio.h"
 
@@ -43,6 +44,16 @@ static const gpio_type touch_io = { GPIOA,  2 };
                                STATIC VARIABLES
 --------------------------------------------------------------------------------*/
 
+/*------------------------------------------------------------
+Tick of the last debounced touch edge
+------------------------------------------------------------*/
+volatile static uint32_t s_last_touch_tick;
+
+/*------------------------------------------------------------
+Tick of the last press that can start a double tap
+------------------------------------------------------------*/
+static uint32_t         s_last_press_tick;
+
 /*--------------------------------------------------------------------------------
                                   PROCEDURES
 --------------------------------------------------------------------------------*/
@@ -64,9 +75,93 @@ void touch_init
 {
     gpio_cfg_input( &touch_io );
 
+    /*--------------------------------------------------------
+    Boot counts as a touch.
+    --------------------------------------------------------*/
+    s_last_touch_tick = system_get_tick();
+    s_last_press_tick = s_last_touch_tick - TOUCH_DOUBLE_TAP_MS;
+
+    /*--------------------------------------------------------
+    Route the touch pin to its EXTI line. Both edges count as
+    touch activity, so pressing and releasing each restart the
+    timeout, and either wakes the core from a tickless sleep.
+    --------------------------------------------------------*/
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->EXTICR[ touch_io.pin / 4 ] &= ~( 0xF << ( ( touch_io.pin % 4 ) * 4 ) );
+    EXTI->RTSR |= 1 << touch_io.pin;
+    EXTI->FTSR |= 1 << touch_io.pin;
+    EXTI->IMR  |= 1 << touch_io.pin;
+    NVIC_EnableIRQ( EXTI2_TSC_IRQn );
+
 } /* touch_init() */
 
 
+/*************************************************************************
+ *
+ *  Procedure:
+ *      EXTI2_TSC_IRQHandler
+ *
+ *  Description:
+ *      Touch edge interrupt. Posts a touch event, ignoring edges that
+ *      follow the last accepted one by less than TOUCH_DEBOUNCE_MS. A
+ *      press within TOUCH_DOUBLE_TAP_MS of the one before also posts a
+ *      double tap, and a third press starts over.
+ *
+ ************************************************************************/
+void EXTI2_TSC_IRQHandler
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    now;
+
+    EXTI->PR = 1 << touch_io.pin;
+
+    now = system_get_tick();
+    if( now - s_last_touch_tick >= TOUCH_DEBOUNCE_MS )
+    {
+        s_last_touch_tick = now;
+        system_event_post( SYSTEM_EVENT_TOUCH, 0, NULL );
+
+        if( touch_read() == TOUCH_STATE_ACTIVE )
+        {
+            if( now - s_last_press_tick < TOUCH_DOUBLE_TAP_MS )
+            {
+                system_event_post( SYSTEM_EVENT_DOUBLE_TAP, 0, NULL );
+                s_last_press_tick = now - TOUCH_DOUBLE_TAP_MS;
+            }
+            else
+            {
+                s_last_press_tick = now;
+            }
+        }
+    }
+
+} /* EXTI2_TSC_IRQHandler */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      touch_get_last_tick
+ *
+ *  Description:
+ *      Get the system tick of the last debounced touch edge.
+ *
+ ************************************************************************/
+uint32_t touch_get_last_tick
+    (
+    void
+    )
+{
+    return( s_last_touch_tick );
+
+} /* touch_get_last_tick */
+
+
 /*************************************************************************
  *
  *  Procedure:
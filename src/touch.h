@@ -19,6 +19,9 @@
                                 LITERAL CONSTANTS
 --------------------------------------------------------------------------------*/
 
+#define TOUCH_DEBOUNCE_MS       ( 20 )      /* Edges closer than this are bounce    */
+#define TOUCH_DOUBLE_TAP_MS     ( 400 )     /* Presses closer than this double tap  */
+
 /*--------------------------------------------------------------------------------
                                      MACROS
 --------------------------------------------------------------------------------*/
@@ -50,6 +53,11 @@ void touch_init
     void
     );
 
+uint32_t touch_get_last_tick
+    (
+    void
+    );
+
 touch_state_type touch_read
     (
     void
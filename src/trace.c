@@ -0,0 +1,137 @@
+/*********************************************************************************
+ *
+ *  trace.c
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Streaming event trace over ITM stimulus ports and SWO.
+ *
+ *       The ITM timestamps every packet with a local timestamp in core clock
+ *       cycles, so events carry no time of their own. Packets leave on PB3,
+ *       SWO, as NRZ at TRACE_SWO_HZ without the TPIU formatter, which most
+ *       SWO viewers decode directly.
+ *
+ ********************************************************************************/
+
+
+/*--------------------------------------------------------------------------------
+                                   INCLUDES
+--------------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stm32f3xx.h>
+
+#include "system.h"
+#include "trace.h"
+
+#if( TRACE_ENABLE )
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+#define ITM_UNLOCK_KEY          ( 0xC5ACCE55 )
+#define ITM_TRACE_BUS_ID        ( 1 )
+#define TPI_PROTOCOL_NRZ        ( 2 )
+#define TRACE_PORT_MASK         ( ( 1 << TRACE_PORT_TASK_ENTRY ) \
+                                | ( 1 << TRACE_PORT_TASK_EXIT  ) \
+                                | ( 1 << TRACE_PORT_FLASH      ) \
+                                | ( 1 << TRACE_PORT_FRAME      ) )
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                               STATIC VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                  PROCEDURES
+--------------------------------------------------------------------------------*/
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      trace_init
+ *
+ *  Description:
+ *      Route the ITM to the SWO pin and enable the trace stimulus ports.
+ *      Call after the system clock is configured, since the SWO bit rate
+ *      is derived from it.
+ *
+ ************************************************************************/
+void trace_init
+    (
+    void
+    )
+{
+    /*--------------------------------------------------------
+    Enable the trace blocks and the asynchronous trace pin
+    --------------------------------------------------------*/
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DBGMCU->CR = ( DBGMCU->CR & ~DBGMCU_CR_TRACE_MODE ) | DBGMCU_CR_TRACE_IOEN;
+
+    /*--------------------------------------------------------
+    SWO as NRZ, bypassing the formatter
+    --------------------------------------------------------*/
+    TPI->SPPR = TPI_PROTOCOL_NRZ;
+    TPI->ACPR = SystemCoreClock / TRACE_SWO_HZ - 1;
+    TPI->FFCR = TPI_FFCR_TrigIn_Msk;
+
+    /*--------------------------------------------------------
+    Enable the ITM with local timestamps and the trace ports
+    --------------------------------------------------------*/
+    ITM->LAR = ITM_UNLOCK_KEY;
+    ITM->TCR = ( ITM_TRACE_BUS_ID << ITM_TCR_TraceBusID_Pos )
+             | ITM_TCR_SWOENA_Msk | ITM_TCR_SYNCENA_Msk
+             | ITM_TCR_TSENA_Msk  | ITM_TCR_ITMENA_Msk;
+    ITM->TPR = 0;
+    ITM->TER = TRACE_PORT_MASK;
+
+}   /* trace_init() */
+
+
+/*************************************************************************
+ *
+ *  Procedure:
+ *      trace_put_frame
+ *
+ *  Description:
+ *      Stream a compact snapshot of a brightness frame, three LEDs per
+ *      word. Each word carries its group number, so a dropped word costs
+ *      only that word's LEDs.
+ *
+ ************************************************************************/
+void trace_put_frame
+    (
+    const uint16_t    * levels,     /* DAC code per LED                 */
+    uint32_t            count       /* Number of LEDs                   */
+    )
+{
+    /*--------------------------------------------------------
+    Local variables
+    --------------------------------------------------------*/
+    uint32_t    word;
+    uint32_t    group;
+    uint32_t    i;
+    uint32_t    j;
+
+    for( i = 0, group = 0; i < count; i += TRACE_FRAME_LEDS, group++ )
+    {
+        word = group << 24;
+        for( j = 0; j < TRACE_FRAME_LEDS && i + j < count; j++ )
+        {
+            word |= min_val( levels[ i + j ], 0xFF ) << ( 8 * j );
+        }
+        trace_put_32( TRACE_PORT_FRAME, word );
+    }
+
+}   /* trace_put_frame() */
+
+#endif
@@ -0,0 +1,119 @@
+/*********************************************************************************
+ *
+ *  trace.h
+ *
+ *  Created on: Oct 14, 2026
+ *      Author:
+ *       Brief: Streaming event trace over ITM stimulus ports and SWO.
+ *
+ ********************************************************************************/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*--------------------------------------------------------------------------------
+                                LITERAL CONSTANTS
+--------------------------------------------------------------------------------*/
+
+/*------------------------------------------------------------
+Set TRACE_ENABLE to 1 to stream events on the SWO pin. Every
+event is a single stimulus port write, timestamped by the ITM
+itself. Events are dropped rather than stalling the caller
+when the ITM FIFO is full. With TRACE_ENABLE at 0 the trace
+macros compile to nothing.
+------------------------------------------------------------*/
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE            ( 0 )
+#endif
+
+#ifndef TRACE_SWO_HZ
+#define TRACE_SWO_HZ            ( 2000000 )     /* SWO NRZ bit rate                     */
+#endif
+
+/*------------------------------------------------------------
+Stimulus ports and their payloads
+    TASK_ENTRY  8-bit   system task index
+    TASK_EXIT   8-bit   system task index
+    FLASH       32-bit  LED << 24 | flash_id << 16 | smoothing
+    FRAME       32-bit  group << 24 | three LEDs, 8 bits each,
+                        LED 3 * group in the low byte. Group 0
+                        starts a frame, DAC codes saturate at 255.
+------------------------------------------------------------*/
+#define TRACE_PORT_TASK_ENTRY   ( 1 )
+#define TRACE_PORT_TASK_EXIT    ( 2 )
+#define TRACE_PORT_FLASH        ( 3 )
+#define TRACE_PORT_FRAME        ( 4 )
+
+#define TRACE_FRAME_LEDS        ( 3 )           /* LEDs per frame word                  */
+
+
+/*--------------------------------------------------------------------------------
+                                     MACROS
+--------------------------------------------------------------------------------*/
+
+#if( TRACE_ENABLE )
+#include <stm32f3xx.h>
+
+/*------------------------------------------------------------
+A stimulus port reads non-zero when it can take a write.
+------------------------------------------------------------*/
+#define trace_put_8( port, val )                        \
+    do                                                  \
+    {                                                   \
+        if( ITM->PORT[ port ].u32 != 0 )                \
+        {                                               \
+            ITM->PORT[ port ].u8 = (uint8_t)( val );    \
+        }                                               \
+    } while( 0 )
+
+#define trace_put_32( port, val )                       \
+    do                                                  \
+    {                                                   \
+        if( ITM->PORT[ port ].u32 != 0 )                \
+        {                                               \
+            ITM->PORT[ port ].u32 = (uint32_t)( val );  \
+        }                                               \
+    } while( 0 )
+
+#define trace_task_entry( idx )     trace_put_8( TRACE_PORT_TASK_ENTRY, idx )
+#define trace_task_exit( idx )      trace_put_8( TRACE_PORT_TASK_EXIT, idx )
+#define trace_flash( idx, flash_id, smoothing )                                 \
+    trace_put_32( TRACE_PORT_FLASH, ( (uint32_t)( idx ) << 24 )                 \
+                                  | ( (uint32_t)( flash_id ) << 16 )            \
+                                  | ( (uint16_t)( smoothing ) ) )
+#define trace_frame( levels, count )    trace_put_frame( levels, count )
+#else
+#define trace_task_entry( idx )                 ( (void)0 )
+#define trace_task_exit( idx )                  ( (void)0 )
+#define trace_flash( idx, flash_id, smoothing ) ( (void)0 )
+#define trace_frame( levels, count )            ( (void)0 )
+#endif
+
+
+/*--------------------------------------------------------------------------------
+                                      TYPES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                GLOBAL VARIABLES
+--------------------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------------------
+                                   PROCEDURES
+--------------------------------------------------------------------------------*/
+
+#if( TRACE_ENABLE )
+void trace_init
+    (
+    void
+    );
+
+void trace_put_frame
+    (
+    const uint16_t    * levels,     /* DAC code per LED                 */
+    uint32_t            count       /* Number of LEDs                   */
+    );
+#endif
+
+
+#endif /* TRACE_H_ */